@@ -78,6 +78,27 @@ void mark_all_free()
 	}
 }
 
+void mark_block_free(void *block)
+{
+	arena *cur = get_current_arena();
+	for (size_t i = 0; i < cur->used_count; i++)
+	{
+		if (cur->used_blocks[i] == block) {
+			cur->used_blocks[i] = cur->used_blocks[--cur->used_count];
+			break;
+		}
+	}
+	if (cur->free_count == cur->free_storage) {
+		if (cur->free_storage) {
+			cur->free_storage *= 2;
+		} else {
+			cur->free_storage = DEFAULT_STORAGE_SIZE;
+		}
+		cur->free_blocks = realloc(cur->free_blocks, cur->free_storage * sizeof(void *));
+	}
+	cur->free_blocks[cur->free_count++] = block;
+}
+
 void *try_alloc_arena()
 {
 	if (!current_arena || !current_arena->free_count) {
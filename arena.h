@@ -13,6 +13,7 @@ arena *set_current_arena(arena *a);
 arena *start_new_arena();
 void track_block(void *block);
 void mark_all_free();
+void mark_block_free(void *block);
 void *try_alloc_arena();
 
 #endif //ARENA_H_
@@ -4,7 +4,11 @@
  BlastEm is free software distributed under the terms of the GNU General Public License version 3 or greater. See COPYING for full license text.
 */
 #include "backend.h"
+#include "arena.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
 
 deferred_addr * defer_address(deferred_addr * old_head, uint32_t address, uint8_t *dest)
 {
@@ -51,6 +55,320 @@ void process_deferred(deferred_addr ** head_ptr, void * context, native_addr_fun
 	}
 }
 
+void init_native_map(native_map *map, uint32_t num_chunks, uint32_t chunk_size)
+{
+	uint32_t num_leaves = (num_chunks + NATIVE_LEAF_SLOTS - 1) / NATIVE_LEAF_SLOTS;
+	map->leaves = calloc(num_leaves, sizeof(native_map_slot *));
+	map->num_chunks = num_chunks;
+	map->chunk_size = chunk_size;
+}
+
+void free_native_map(native_map *map)
+{
+	uint32_t num_leaves = (map->num_chunks + NATIVE_LEAF_SLOTS - 1) / NATIVE_LEAF_SLOTS;
+	for (uint32_t leaf = 0; leaf < num_leaves; leaf++)
+	{
+		native_map_slot *slots = map->leaves[leaf];
+		if (!slots) {
+			continue;
+		}
+		for (uint32_t i = 0; i < NATIVE_LEAF_SLOTS && leaf * NATIVE_LEAF_SLOTS + i < map->num_chunks; i++)
+		{
+			free(slots[i].offsets);
+			free(slots[i].wide_offsets);
+		}
+		free(slots);
+	}
+	free(map->leaves);
+	map->leaves = NULL;
+}
+
+native_map_slot *find_native_slot(native_map *map, uint32_t address)
+{
+	uint32_t chunk = address / map->chunk_size;
+	native_map_slot *slots = map->leaves[chunk / NATIVE_LEAF_SLOTS];
+	if (!slots) {
+		return NULL;
+	}
+	native_map_slot *slot = slots + chunk % NATIVE_LEAF_SLOTS;
+	return slot->offsets || slot->wide_offsets ? slot : NULL;
+}
+
+uint32_t native_slot_offset(native_map_slot *slot, uint32_t offset)
+{
+	if (slot->offsets) {
+		uint16_t short_off = slot->offsets[offset];
+		if (short_off == SHORT_INVALID_OFFSET) {
+			return INVALID_OFFSET;
+		}
+		return short_off == SHORT_EXTENSION_WORD ? EXTENSION_WORD : short_off;
+	}
+	return slot->wide_offsets[offset];
+}
+
+uint32_t native_map_offset(native_map *map, uint32_t address)
+{
+	native_map_slot *slot = find_native_slot(map, address);
+	if (!slot) {
+		return INVALID_OFFSET;
+	}
+	return native_slot_offset(slot, address % map->chunk_size);
+}
+
+code_ptr native_map_lookup(native_map *map, uint32_t address)
+{
+	native_map_slot *slot = find_native_slot(map, address);
+	if (!slot) {
+		return NULL;
+	}
+	uint32_t offset = native_slot_offset(slot, address % map->chunk_size);
+	if (offset == INVALID_OFFSET || offset == EXTENSION_WORD) {
+		return NULL;
+	}
+	return slot->base + (int32_t)offset;
+}
+
+static native_map_slot *alloc_native_slot(native_map *map, uint32_t address)
+{
+	uint32_t chunk = address / map->chunk_size;
+	native_map_slot **leaf = map->leaves + chunk / NATIVE_LEAF_SLOTS;
+	if (!*leaf) {
+		uint32_t leaf_slots = map->num_chunks < NATIVE_LEAF_SLOTS ? map->num_chunks : NATIVE_LEAF_SLOTS;
+		*leaf = calloc(leaf_slots, sizeof(native_map_slot));
+	}
+	native_map_slot *slot = *leaf + chunk % NATIVE_LEAF_SLOTS;
+	if (!slot->offsets && !slot->wide_offsets) {
+		slot->offsets = malloc(sizeof(uint16_t) * map->chunk_size);
+		memset(slot->offsets, 0xFF, sizeof(uint16_t) * map->chunk_size);
+	}
+	return slot;
+}
+
+static void widen_native_slot(native_map *map, native_map_slot *slot)
+{
+	slot->wide_offsets = malloc(sizeof(int32_t) * map->chunk_size);
+	for (uint32_t i = 0; i < map->chunk_size; i++)
+	{
+		slot->wide_offsets[i] = native_slot_offset(slot, i);
+	}
+	free(slot->offsets);
+	slot->offsets = NULL;
+}
+
+void native_map_set(native_map *map, uint32_t address, code_ptr native)
+{
+	native_map_slot *slot = alloc_native_slot(map, address);
+	if (!slot->base) {
+		slot->base = native;
+	}
+	ptrdiff_t offset = native - slot->base;
+	if (slot->offsets && (offset < 0 || offset >= SHORT_EXTENSION_WORD)) {
+		widen_native_slot(map, slot);
+	}
+	if (slot->offsets) {
+		slot->offsets[address % map->chunk_size] = offset;
+	} else {
+		slot->wide_offsets[address % map->chunk_size] = offset;
+	}
+}
+
+void native_map_set_extension(native_map *map, uint32_t address)
+{
+	native_map_slot *slot = alloc_native_slot(map, address);
+	uint32_t offset = address % map->chunk_size;
+	if (slot->offsets) {
+		if (slot->offsets[offset] == SHORT_INVALID_OFFSET) {
+			slot->offsets[offset] = SHORT_EXTENSION_WORD;
+		}
+	} else if (slot->wide_offsets[offset] == INVALID_OFFSET) {
+		slot->wide_offsets[offset] = EXTENSION_WORD;
+	}
+}
+
+void native_map_clear(native_map *map, uint32_t address)
+{
+	native_map_slot *slot = find_native_slot(map, address);
+	if (!slot) {
+		return;
+	}
+	uint32_t offset = address % map->chunk_size;
+	if (slot->offsets) {
+		slot->offsets[offset] = SHORT_INVALID_OFFSET;
+	} else {
+		slot->wide_offsets[offset] = INVALID_OFFSET;
+	}
+}
+
+void init_code_cache(cpu_options *opts, uint32_t megabytes)
+{
+	code_cache *cache = &opts->code_cache;
+	if (!opts->cold_code.cur) {
+		init_code_info(&opts->cold_code);
+	}
+	//chunks allocated from here on hold translated code and are released on a flush
+	opts->code.chunks = opts->cold_code.chunks = &cache->chunks;
+	cache->start = opts->code;
+	cache->cold_start = opts->cold_code;
+	cache->max_chunks = megabytes * 1024 * 1024 / CODE_ALLOC_SIZE;
+}
+
+void code_cache_track(cpu_options *opts)
+{
+	code_cache *cache = &opts->code_cache;
+	if (cache->max_chunks && cache->chunks.num + 1 >= cache->max_chunks) {
+		cache->flush_pending = 1;
+	}
+}
+
+void flush_code_cache(cpu_options *opts)
+{
+	code_cache *cache = &opts->code_cache;
+	for (uint32_t i = 0; i < cache->chunks.num; i++)
+	{
+		mark_block_free(cache->chunks.list[i]);
+	}
+	cache->chunks.num = 0;
+	opts->code = cache->start;
+	opts->cold_code = cache->cold_start;
+	uint32_t num_chunks = opts->native_code_map.num_chunks, chunk_size = opts->native_code_map.chunk_size;
+	free_native_map(&opts->native_code_map);
+	init_native_map(&opts->native_code_map, num_chunks, chunk_size);
+	remove_deferred_until(&opts->deferred, NULL);
+	cache->flush_pending = 0;
+	cache->flushes++;
+}
+
+//Starts the profiled entry for the code at address, the counter itself is emitted after
+//the cycle check of its first instruction so the usual prologue layout is kept
+void code_profile_block_start(cpu_options *opts, uint32_t address)
+{
+	code_profile *profile = &opts->profile;
+	if (!profile->enabled) {
+		return;
+	}
+	if (!profile->chunks || profile->chunks->used == PROFILE_CHUNK_BLOCKS) {
+		code_profile_chunk *chunk = calloc(1, sizeof(code_profile_chunk));
+		chunk->next = profile->chunks;
+		profile->chunks = chunk;
+	}
+	code_profile_block *block = profile->chunks->blocks + profile->chunks->used++;
+	block->address = address;
+	block->stream_start = !profile->cur;
+	profile->cur = block;
+	profile->counter_pending = 1;
+}
+
+//Records the native size of the current entry, called again as it grows
+void code_profile_block_size(cpu_options *opts, uint32_t native_size)
+{
+	if (opts->profile.cur) {
+		opts->profile.cur->native_size = native_size;
+	}
+}
+
+void code_profile_stream_end(cpu_options *opts)
+{
+	opts->profile.cur = NULL;
+	opts->profile.counter_pending = 0;
+}
+
+typedef struct {
+	uint64_t count;
+	uint64_t cycles;
+	uint32_t address;
+	uint32_t last_address;
+	uint32_t native_size;
+} profile_summary;
+
+static int profile_address_cmp(const void *a, const void *b)
+{
+	profile_summary const *sa = a, *sb = b;
+	return sa->address < sb->address ? -1 : sa->address > sb->address;
+}
+
+static int profile_count_cmp(const void *a, const void *b)
+{
+	profile_summary const *sa = a, *sb = b;
+	return sa->count > sb->count ? -1 : sa->count < sb->count;
+}
+
+void code_profile_print(cpu_options *opts, uint32_t max_blocks)
+{
+	uint32_t num_chunks = 0, num_blocks = 0;
+	for (code_profile_chunk *chunk = opts->profile.chunks; chunk; chunk = chunk->next)
+	{
+		num_chunks++;
+		num_blocks += chunk->used;
+	}
+	if (!num_blocks) {
+		puts("No blocks have been profiled");
+		return;
+	}
+	//chunks are linked newest first, but entries have to be walked in the order they were translated
+	code_profile_chunk **chunks = malloc(num_chunks * sizeof(code_profile_chunk *));
+	uint32_t chunk_index = num_chunks;
+	for (code_profile_chunk *chunk = opts->profile.chunks; chunk; chunk = chunk->next)
+	{
+		chunks[--chunk_index] = chunk;
+	}
+	//consecutive entries of a stream that ran the same number of times are reported as one block
+	profile_summary *summary = malloc(num_blocks * sizeof(profile_summary));
+	profile_summary *cur = NULL;
+	uint32_t num_summary = 0;
+	for (chunk_index = 0; chunk_index < num_chunks; chunk_index++)
+	{
+		code_profile_chunk *chunk = chunks[chunk_index];
+		for (uint32_t i = 0; i < chunk->used; i++)
+		{
+			code_profile_block *block = chunk->blocks + i;
+			if (!cur || block->stream_start || cur->count != block->count) {
+				cur = summary + num_summary++;
+				cur->count = block->count;
+				cur->cycles = 0;
+				cur->address = block->address;
+				cur->native_size = 0;
+			}
+			cur->cycles += block->count * block->cycles;
+			cur->last_address = block->address;
+			cur->native_size += block->native_size;
+		}
+	}
+	free(chunks);
+	//flushes and retranslation leave several entries for the same address behind
+	qsort(summary, num_summary, sizeof(profile_summary), profile_address_cmp);
+	uint32_t merged = 0;
+	for (uint32_t i = 0; i < num_summary; i++)
+	{
+		if (merged && summary[merged-1].address == summary[i].address) {
+			summary[merged-1].count += summary[i].count;
+			summary[merged-1].cycles += summary[i].cycles;
+			summary[merged-1].last_address = summary[i].last_address;
+			summary[merged-1].native_size = summary[i].native_size;
+		} else {
+			summary[merged++] = summary[i];
+		}
+	}
+	qsort(summary, merged, sizeof(profile_summary), profile_count_cmp);
+	puts("Address  Last addr            Count      Est. cycles  Native size");
+	for (uint32_t i = 0; i < merged && i < max_blocks && summary[i].count; i++)
+	{
+		printf("%7X %10X %16"PRIu64" %16"PRIu64" %12u\n", summary[i].address, summary[i].last_address, summary[i].count, summary[i].cycles, summary[i].native_size);
+	}
+	free(summary);
+}
+
+void code_profile_free(cpu_options *opts)
+{
+	code_profile_chunk *chunk = opts->profile.chunks;
+	while (chunk)
+	{
+		code_profile_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	opts->profile.chunks = NULL;
+}
+
 memmap_chunk const *find_map_chunk(uint32_t address, cpu_options *opts, uint16_t flags, uint32_t *size_sum)
 {
 	if (size_sum) {
@@ -75,7 +393,9 @@ void * get_native_pointer(uint32_t address, void ** mem_pointers, cpu_options *
 	for (uint32_t chunk = 0; chunk < opts->memmap_chunks; chunk++)
 	{
 		if (address >= memmap[chunk].start && address < memmap[chunk].end) {
-			if (!(memmap[chunk].flags & MMAP_READ)) {
+			//arbitrated chunks only hand their pointer to the generated read functions
+			//so code fetches and other direct accesses keep going through the handlers
+			if (!(memmap[chunk].flags & MMAP_READ) || (memmap[chunk].flags & MMAP_ARBITRATED)) {
 				return NULL;
 			}
 			uint8_t * base = memmap[chunk].flags & MMAP_PTR_IDX
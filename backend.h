@@ -29,11 +29,65 @@ typedef struct {
 } host_ea;
 #endif
 
+//offsets are stored as 16-bit values relative to base until one doesn't fit,
+//at which point the slot is switched over to a full 32-bit array
+#define SHORT_INVALID_OFFSET 0xFFFF
+#define SHORT_EXTENSION_WORD 0xFFFE
+#define NATIVE_LEAF_SLOTS 256
+
 typedef struct {
 	uint8_t  *base;
-	int32_t  *offsets;
+	uint16_t *offsets;
+	int32_t  *wide_offsets;
 } native_map_slot;
 
+typedef struct {
+	native_map_slot **leaves;
+	uint32_t        num_chunks;
+	uint32_t        chunk_size;
+} native_map;
+
+//Translated code is thrown away all at once when it grows past max_chunks chunks
+//of CODE_ALLOC_SIZE. Blocks are linked to each other directly, so dropping just the
+//cold ones would mean tracking every jump into them
+#define DEFAULT_CODE_CACHE_SIZE 32 //in megabytes
+
+typedef struct {
+	code_chunk_list chunks;
+	code_info start;
+	code_info cold_start;
+	uint32_t  max_chunks;
+	uint32_t  flushes;
+	uint8_t   flush_pending;
+} code_cache;
+
+//Execution counters for translated code, only emitted when profiling is enabled.
+//There is one per native map entry so branches into the middle of a stream are
+//counted too. Entries are never moved since translated code increments count in place
+typedef struct {
+	uint64_t count;
+	uint32_t address;
+	uint32_t cycles;      //guest cycles of every path through the entry added together
+	uint32_t native_size;
+	uint8_t  stream_start;
+} code_profile_block;
+
+#define PROFILE_CHUNK_BLOCKS 1024
+
+typedef struct code_profile_chunk code_profile_chunk;
+struct code_profile_chunk {
+	code_profile_chunk *next;
+	uint32_t           used;
+	code_profile_block blocks[PROFILE_CHUNK_BLOCKS];
+};
+
+typedef struct {
+	code_profile_chunk *chunks;
+	code_profile_block *cur;
+	uint8_t            enabled;
+	uint8_t            counter_pending;
+} code_profile;
+
 typedef struct deferred_addr {
 	struct deferred_addr *next;
 	code_ptr             dest;
@@ -56,6 +110,8 @@ typedef enum {
 #define MMAP_FUNC_NULL 0x40
 #define MMAP_BYTESWAP  0x80
 #define MMAP_AUX_BUFF  0x100
+//reads through the pointer wait on another bus master, see arb_cycles and arb_count_off
+#define MMAP_ARBITRATED 0x200
 
 typedef uint16_t (*read_16_fun)(uint32_t address, void * context);
 typedef uint8_t (*read_8_fun)(uint32_t address, void * context);
@@ -80,9 +136,12 @@ typedef struct {
 
 typedef struct {
 	uint32_t flags;
-	native_map_slot    *native_code_map;
+	native_map         native_code_map;
 	deferred_addr      *deferred;
 	code_info          code;
+	code_info          cold_code;     //slow paths jumped to from code, kept out of the way of the hot path
+	code_cache         code_cache;
+	code_profile       profile;
 	uint8_t            **ram_inst_sizes;
 	memmap_chunk const *memmap;
 	code_ptr           save_context;
@@ -97,11 +156,14 @@ typedef struct {
 	uint32_t           address_mask;
 	uint32_t           max_address;
 	uint32_t           bus_cycles;
+	uint32_t           arb_cycles;    //extra cycles for a direct read from an MMAP_ARBITRATED chunk
 	uint32_t           clock_divider;
 	uint32_t           move_pc_off;
 	uint32_t           move_pc_size;
+	uint32_t           check_patch_size; //check_cycles_int is padded with NOPs to be at least this big
 	int32_t            mem_ptr_off;
 	int32_t            ram_flags_off;
+	int32_t            arb_count_off; //context offset of a 32-bit count of direct MMAP_ARBITRATED reads
 	uint8_t            ram_flags_shift;
 	uint8_t            address_size;
 	uint8_t            byte_swap;
@@ -119,8 +181,33 @@ deferred_addr * defer_address(deferred_addr * old_head, uint32_t address, uint8_
 void remove_deferred_until(deferred_addr **head_ptr, deferred_addr * remove_to);
 void process_deferred(deferred_addr ** head_ptr, void * context, native_addr_func get_native);
 
+void init_native_map(native_map *map, uint32_t num_chunks, uint32_t chunk_size);
+void free_native_map(native_map *map);
+native_map_slot *find_native_slot(native_map *map, uint32_t address);
+uint32_t native_slot_offset(native_map_slot *slot, uint32_t offset);
+uint32_t native_map_offset(native_map *map, uint32_t address);
+code_ptr native_map_lookup(native_map *map, uint32_t address);
+void native_map_set(native_map *map, uint32_t address, code_ptr native);
+void native_map_set_extension(native_map *map, uint32_t address);
+void native_map_clear(native_map *map, uint32_t address);
+
+void init_code_cache(cpu_options *opts, uint32_t megabytes);
+void code_cache_track(cpu_options *opts);
+void flush_code_cache(cpu_options *opts);
+
+void code_profile_block_start(cpu_options *opts, uint32_t address);
+void code_profile_block_size(cpu_options *opts, uint32_t native_size);
+void code_profile_stream_end(cpu_options *opts);
+void code_profile_print(cpu_options *opts, uint32_t max_blocks);
+void code_profile_free(cpu_options *opts);
+
 void cycles(cpu_options *opts, uint32_t num);
+code_ptr cold_code_start(cpu_options *opts, code_info *hot);
+void cold_code_end(cpu_options *opts, code_info *hot);
+void jcc_cold(cpu_options *opts, uint8_t cc, code_info *hot);
 void check_cycles_int(cpu_options *opts, uint32_t address);
+void check_cycles_int_call(cpu_options *opts, uint32_t address, code_ptr handler);
+code_ptr check_cycles_int_stub(cpu_options *opts, code_ptr native);
 void check_cycles(cpu_options * opts);
 void check_code_prologue(code_info *code);
 void log_address(cpu_options *opts, uint32_t address, char * format);
@@ -1,9 +1,13 @@
 #include "backend.h"
 #include "gen_x86.h"
 #include <string.h>
+#include <stdlib.h>
 
 void cycles(cpu_options *opts, uint32_t num)
 {
+	if (opts->profile.cur) {
+		opts->profile.cur->cycles += num;
+	}
 	if (opts->limit < 0) {
 		sub_ir(&opts->code, num*opts->clock_divider, opts->cycles, SZ_D);
 	} else {
@@ -11,24 +15,90 @@ void cycles(cpu_options *opts, uint32_t num)
 	}
 }
 
+//Switches opts->code over to the cold code region so a slow path can be emitted there.
+//The code_info it replaces is saved in hot until cold_code_end
+code_ptr cold_code_start(cpu_options *opts, code_info *hot)
+{
+	if (!opts->cold_code.cur) {
+		init_code_info(&opts->cold_code);
+	}
+	check_alloc_code(&opts->cold_code, MAX_INST_LEN*8);
+	*hot = opts->code;
+	opts->code = opts->cold_code;
+	opts->code.stack_off = hot->stack_off;
+	return opts->code.cur;
+}
+
+void cold_code_end(cpu_options *opts, code_info *hot)
+{
+	opts->cold_code = opts->code;
+	opts->code = *hot;
+}
+
+//Emits a conditional jump to a new stub in the cold code region and switches over to it.
+//The caller is expected to jump back to hot->cur at the end of the stub
+void jcc_cold(cpu_options *opts, uint8_t cc, code_info *hot)
+{
+	code_info *code = &opts->code;
+	check_alloc_code(code, 6);
+	code_ptr jmp_off = code->cur + 2;
+	jcc(code, cc, code->cur + 512); //force 32-bit displacement
+	code_ptr stub = cold_code_start(opts, hot);
+	*((int32_t *)jmp_off) = stub - (jmp_off + sizeof(int32_t));
+}
+
 void check_cycles_int(cpu_options *opts, uint32_t address)
+{
+	check_cycles_int_call(opts, address, opts->handle_cycle_limit_int);
+}
+
+//The hot path is just the compare and a jump to a cold stub that loads the address into
+//scratch1 and calls handler. CPUs that patch something bigger than a jmp over the check
+//set check_patch_size so it gets padded out to have room for it
+void check_cycles_int_call(cpu_options *opts, uint32_t address, code_ptr handler)
 {
 	code_info *code = &opts->code;
+	check_alloc_code(code, MAX_INST_LEN*2);
+	code_ptr start = code->cur;
 	uint8_t cc;
 	if (opts->limit < 0) {
 		cmp_ir(code, 1, opts->cycles, SZ_D);
-		cc = CC_NS;
+		cc = CC_S;
 	} else {
 		cmp_rr(code, opts->cycles, opts->limit, SZ_D);
-		cc = CC_A;
+		cc = CC_BE;
 	}
-	code_ptr jmp_off = code->cur+1;
-	jcc(code, cc, jmp_off+1);
+	code_info hot;
+	jcc_cold(opts, cc, &hot);
 	mov_ir(code, address, opts->scratch1, SZ_D);
-	call(code, opts->handle_cycle_limit_int);
-	*jmp_off = code->cur - (jmp_off+1);
+	call(code, handler);
+	jmp(code, hot.cur);
+	cold_code_end(opts, &hot);
+	while (code->cur < start + opts->check_patch_size)
+	{
+		*(code->cur++) = 0x90; //NOP
+	}
+	if (opts->profile.counter_pending) {
+		//scratch1 is free again by the time the check is done
+		mov_ir(code, (intptr_t)&opts->profile.cur->count, opts->scratch1, SZ_PTR);
+		add_irdisp(code, 1, opts->scratch1, 0, SZ_Q);
+		opts->profile.counter_pending = 0;
+	}
+}
+
+//Returns the cold stub of the check_cycles_int at native, or the stub a breakpoint has
+//replaced it with. Either way it starts with the mov of the address to scratch1
+code_ptr check_cycles_int_stub(cpu_options *opts, code_ptr native)
+{
+	if (is_jmp(native)) {
+		return native + 1 + sizeof(int32_t) + *((int32_t *)(native + 1));
+	}
+	code_ptr jmp_off = native + opts->move_pc_off;
+	return jmp_off + sizeof(int32_t) + *((int32_t *)jmp_off);
 }
 
+//Emits a throwaway copy of the hot part of check_cycles_int_call to find where the rel32 of
+//its jump to the cold stub lives and how big the mov at the start of that stub is
 void retranslate_calc(cpu_options *opts)
 {
 	code_info *code = &opts->code;
@@ -36,32 +106,36 @@ void retranslate_calc(cpu_options *opts)
 	uint8_t cc;
 	if (opts->limit < 0) {
 		cmp_ir(code, 1, opts->cycles, SZ_D);
-		cc = CC_NS;
+		cc = CC_S;
 	} else {
 		cmp_rr(code, opts->cycles, opts->limit, SZ_D);
-		cc = CC_A;
+		cc = CC_BE;
 	}
-	jcc(code, cc, code->cur+2);
-	opts->move_pc_off = code->cur - tmp.cur;
+	jcc(code, cc, code->cur + 512); //same forced 32-bit displacement as jcc_cold
+	opts->move_pc_off = code->cur - sizeof(int32_t) - tmp.cur;
 	mov_ir(code, 0x1234, opts->scratch1, SZ_D);
-	opts->move_pc_size = code->cur - tmp.cur - opts->move_pc_off;
+	opts->move_pc_size = code->cur - tmp.cur - opts->move_pc_off - sizeof(int32_t);
 	*code = tmp;
 }
 
+//Points the call after the mov in the cold stub at handler and jumps to the stub from the
+//hot path, which only needs room for a jmp. The stub is never returned to after that
 void patch_for_retranslate(cpu_options *opts, code_ptr native_address, code_ptr handler)
 {
-	if (!is_mov_ir(native_address)) {
-		//instruction is not already patched for either retranslation or a breakpoint
-		//copy original mov_ir instruction containing PC to beginning of native code area
-		memmove(native_address, native_address + opts->move_pc_off, opts->move_pc_size);
-	}
-	//jump to the retranslation handler
+	code_ptr stub = check_cycles_int_stub(opts, native_address);
 	code_info tmp = {
-		.cur =  native_address + opts->move_pc_size,
-		.last = native_address + 256,
+		.cur =  stub + opts->move_pc_size,
+		.last = stub + 256,
 		.stack_off = 0
 	};
 	jmp(&tmp, handler);
+	if (!is_jmp(native_address)) {
+		//instruction is not already patched for retranslation or a breakpoint
+		tmp.cur = native_address;
+		tmp.last = native_address + 256;
+		jmp(&tmp, native_address + 256); //force 32-bit displacement
+		*((int32_t *)(native_address + 1)) = stub - tmp.cur;
+	}
 }
 
 void check_cycles(cpu_options * opts)
@@ -70,16 +144,16 @@ void check_cycles(cpu_options * opts)
 	uint8_t cc;
 	if (opts->limit < 0) {
 		cmp_ir(code, 1, opts->cycles, SZ_D);
-		cc = CC_NS;
+		cc = CC_S;
 	} else {
 		cmp_rr(code, opts->cycles, opts->limit, SZ_D);
-		cc = CC_A;
+		cc = CC_BE;
 	}
-	check_alloc_code(code, MAX_INST_LEN*2);
-	code_ptr jmp_off = code->cur+1;
-	jcc(code, cc, jmp_off+1);
+	code_info hot;
+	jcc_cold(opts, cc, &hot);
 	call(code, opts->handle_cycle_limit);
-	*jmp_off = code->cur - (jmp_off+1);
+	jmp(code, hot.cur);
+	cold_code_end(opts, &hot);
 }
 
 void log_address(cpu_options *opts, uint32_t address, char * format)
@@ -100,9 +174,24 @@ void check_code_prologue(code_info *code)
 	check_alloc_code(code, MAX_INST_LEN*4);
 }
 
+//memory maps with at least this many chunks dispatch through a table of pages
+//instead of walking a chain of range checks on every access
+#define MIN_PAGE_TABLE_CHUNKS 5
+#define PAGE_TABLE_ENTRIES 256
+
 code_ptr gen_mem_fun(cpu_options * opts, memmap_chunk const * memmap, uint32_t num_chunks, ftype fun_type, code_ptr *after_inc)
 {
 	code_info *code = &opts->code;
+	code_ptr *page_table = NULL;
+	if (num_chunks >= MIN_PAGE_TABLE_CHUNKS) {
+		//the table lives in the code buffer so its address fits in an immediate
+		check_alloc_code(code, (PAGE_TABLE_ENTRIES + 1) * sizeof(code_ptr));
+		code_ptr aligned = code->cur + (-(intptr_t)code->cur & (sizeof(code_ptr) - 1));
+		if ((intptr_t)aligned <= 0x7FFFFFFF) {
+			page_table = (code_ptr *)aligned;
+			code->cur = (code_ptr)(page_table + PAGE_TABLE_ENTRIES);
+		}
+	}
 	code_ptr start = code->cur;
 	check_cycles(opts);
 	uint8_t is_write = fun_type == WRITE_16 || fun_type == WRITE_8;
@@ -122,6 +211,30 @@ code_ptr gen_mem_fun(cpu_options * opts, memmap_chunk const * memmap, uint32_t n
 	} else if (opts->address_size == SZ_W && opts->address_mask != 0xFFFF) {
 		and_ir(code, opts->address_mask, adr_reg, SZ_W);
 	}
+	uint8_t page_shift = 0;
+	code_ptr *chunk_start = NULL, chain_entry = NULL;
+	//register that is neither the address nor the value
+	uint8_t tmp_reg = is_write ? opts->scratch1 : opts->scratch2;
+	if (page_table) {
+		while ((opts->address_mask >> page_shift) >= PAGE_TABLE_ENTRIES)
+		{
+			page_shift++;
+		}
+		chunk_start = calloc(num_chunks, sizeof(code_ptr));
+		push_r(code, tmp_reg);
+		if (opts->address_size == SZ_D) {
+			mov_rr(code, adr_reg, tmp_reg, SZ_D);
+		} else {
+			movzx_rr(code, adr_reg, tmp_reg, opts->address_size, SZ_D);
+		}
+		shr_ir(code, page_shift, tmp_reg, SZ_D);
+		shl_ir(code, sizeof(code_ptr) == 8 ? 3 : 2, tmp_reg, SZ_D);
+		add_ir(code, (intptr_t)page_table, tmp_reg, SZ_PTR);
+		jmp_rind(code, tmp_reg);
+		//pages that aren't covered by a single chunk land here
+		chain_entry = code->cur;
+		pop_r(code, tmp_reg);
+	}
 	code_ptr lb_jcc = NULL, ub_jcc = NULL;
 	uint16_t access_flag = is_write ? MMAP_WRITE : MMAP_READ;
 	uint32_t ram_flags_off = opts->ram_flags_off;
@@ -143,6 +256,9 @@ code_ptr gen_mem_fun(cpu_options * opts, memmap_chunk const * memmap, uint32_t n
 		} else {
 			max_address = memmap[chunk].start;
 		}
+		if (chunk_start) {
+			chunk_start[chunk] = code->cur;
+		}
 
 		if (memmap[chunk].mask != opts->address_mask) {
 			and_ir(code, memmap[chunk].mask, adr_reg, opts->address_size);
@@ -185,6 +301,11 @@ code_ptr gen_mem_fun(cpu_options * opts, memmap_chunk const * memmap, uint32_t n
 
 					*not_null = code->cur - (not_null + 1);
 				}
+				if (memmap[chunk].flags & MMAP_ARBITRATED) {
+					//the other bus master is charged for these later using the count
+					cycles(opts, opts->arb_cycles);
+					add_irdisp(code, 1, opts->context_reg, opts->arb_count_off, SZ_D);
+				}
 				if ((opts->byte_swap || memmap[chunk].flags & MMAP_BYTESWAP) && size == SZ_B) {
 					xor_ir(code, 1, adr_reg, opts->address_size);
 				}
@@ -318,5 +439,33 @@ code_ptr gen_mem_fun(cpu_options * opts, memmap_chunk const * memmap, uint32_t n
 		mov_ir(code, size == SZ_B ? 0xFF : 0xFFFF, opts->scratch1, size);
 	}
 	retn(code);
+	if (page_table) {
+		code_ptr *stubs = calloc(num_chunks, sizeof(code_ptr));
+		uint32_t page_size = 1 << page_shift;
+		for (uint32_t page = 0; page < PAGE_TABLE_ENTRIES; page++)
+		{
+			uint32_t page_start = page << page_shift;
+			page_table[page] = chain_entry;
+			for (uint32_t chunk = 0; chunk < num_chunks; chunk++)
+			{
+				if (memmap[chunk].start >= page_start + page_size || memmap[chunk].end <= page_start) {
+					continue;
+				}
+				if (memmap[chunk].start <= page_start && memmap[chunk].end >= page_start + page_size) {
+					if (!stubs[chunk]) {
+						stubs[chunk] = code->cur;
+						//stack adjustment made by the dispatch code
+						code->stack_off += sizeof(void *);
+						pop_r(code, tmp_reg);
+						jmp(code, chunk_start[chunk]);
+					}
+					page_table[page] = stubs[chunk];
+				}
+				break;
+			}
+		}
+		free(stubs);
+		free(chunk_start);
+	}
 	return start;
 }
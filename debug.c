@@ -88,6 +88,18 @@ void strip_nl(char * buf)
 	}
 }
 
+#define DEFAULT_PROFILE_LINES 20
+
+//Lists the translated blocks that have run the most, param optionally limits how many
+static void print_code_profile(cpu_options *opts, char *param)
+{
+	if (!opts->profile.enabled) {
+		fputs("Code profiling is disabled, set profile_code to on in the system section of the config to enable it\n", stderr);
+		return;
+	}
+	code_profile_print(opts, param ? atoi(param) : DEFAULT_PROFILE_LINES);
+}
+
 uint16_t m68k_read_word(uint32_t address, m68k_context *context)
 {
 	return read_word(address, (void **)context->mem_pointers, &context->options->gen, context);
@@ -481,6 +493,10 @@ z80_context * zdebugger(z80_context * context, uint16_t address)
 					}
 				}
 				break;
+			case 'h':
+				param = find_param(input_buf);
+				print_code_profile(&context->options->gen, param);
+				break;
 			case 'n':
 				//TODO: Handle conditional branch instructions
 				if (inst.op == Z80_JP) {
@@ -729,6 +745,10 @@ int run_debugger_command(m68k_context *context, char *input_buf, m68kinst inst,
 			}
 			debugger_print(context, format_char, param);
 			break;
+		case 'h':
+			param = find_param(input_buf);
+			print_code_profile(&context->options->gen, param);
+			break;
 		case 'n':
 			if (inst.op == M68K_RTS) {
 				after = m68k_read_long(context->aregs[7], context);
@@ -875,6 +895,10 @@ int run_debugger_command(m68k_context *context, char *input_buf, m68kinst inst,
 					break;
 				}
 				zdebugger_print(gen->z80, input_buf[2] == '/' ? input_buf[3] : 0, param);
+				break;
+			case 'h':
+				print_code_profile(&gen->z80->options->gen, find_param(input_buf));
+				break;
 			}
 			break;
 		}
@@ -14,3 +14,12 @@ void init_code_info(code_info *code)
 	code->last = code->cur + size/sizeof(code_word) - RESERVE_WORDS;
 	code->stack_off = 0;
 }
+
+void code_chunk_add(code_chunk_list *chunks, code_ptr chunk)
+{
+	if (chunks->num == chunks->storage) {
+		chunks->storage = chunks->storage ? chunks->storage * 2 : 8;
+		chunks->list = realloc(chunks->list, chunks->storage * sizeof(code_ptr));
+	}
+	chunks->list[chunks->num++] = chunk;
+}
@@ -12,13 +12,22 @@ typedef uint32_t code_word;
 typedef code_word * code_ptr;
 #define CODE_ALLOC_SIZE (1024*1024)
 
+//every chunk check_alloc_code allocates for a code_info that points to one of these
 typedef struct {
-	code_ptr cur;
-	code_ptr last;
-	uint32_t stack_off;
+	code_ptr *list;
+	uint32_t num;
+	uint32_t storage;
+} code_chunk_list;
+
+typedef struct {
+	code_ptr        cur;
+	code_ptr        last;
+	uint32_t        stack_off;
+	code_chunk_list *chunks;
 } code_info;
 
 void check_alloc_code(code_info *code, uint32_t inst_size);
+void code_chunk_add(code_chunk_list *chunks, code_ptr chunk);
 
 void init_code_info(code_info *code);
 void call(code_info *code, code_ptr fun);
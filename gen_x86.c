@@ -42,6 +42,7 @@
 #define OP_CDQ 0x99
 #define OP_PUSHF 0x9C
 #define OP_POPF 0x9D
+#define OP_TEST_I_RAX 0xA8
 #define OP_MOV_I8R 0xB0
 #define OP_MOV_IR 0xB8
 #define OP_SHIFTROT_IR 0xC0
@@ -209,6 +210,9 @@ void check_alloc_code(code_info *code, uint32_t inst_size)
 		if (!next_code) {
 			fatal_error("Failed to allocate memory for generated code\n");
 		}
+		if (code->chunks) {
+			code_chunk_add(code->chunks, next_code);
+		}
 		if (next_code != code->last + RESERVE_WORDS) {
 			//new chunk is not contiguous with the current one
 			jmp_nocheck(code, next_code);
@@ -218,6 +222,33 @@ void check_alloc_code(code_info *code, uint32_t inst_size)
 	}
 }
 
+//writes the ModR/M byte, SIB byte if needed and displacement for a [base + disp] operand
+//base must already have had any REX adjustment applied
+code_ptr x86_modrm_disp(code_ptr out, uint8_t reg, uint8_t base, int32_t disp)
+{
+	if (!disp && base != RBP) {
+		//RBP and R13 have no encoding without a displacement, so they always get an 8-bit one
+		*(out++) = MODE_REG_INDIRECT | base | (reg << 3);
+	} else if (disp < 128 && disp >= -128) {
+		*(out++) = MODE_REG_DISPLACE8 | base | (reg << 3);
+	} else {
+		*(out++) = MODE_REG_DISPLACE32 | base | (reg << 3);
+	}
+	if (base == RSP) {
+		//add SIB byte, with no index and RSP as base
+		*(out++) = (RSP << 3) | RSP;
+	}
+	if (disp || base == RBP) {
+		*(out++) = disp;
+		if (disp >= 128 || disp < -128) {
+			*(out++) = disp >> 8;
+			*(out++) = disp >> 16;
+			*(out++) = disp >> 24;
+		}
+	}
+	return out;
+}
+
 void x86_rr_sizedir(code_info *code, uint16_t opcode, uint8_t src, uint8_t dst, uint8_t size)
 {
 	check_alloc_code(code, 5);
@@ -319,21 +350,7 @@ void x86_rrdisp_sizedir(code_info *code, uint16_t opcode, uint8_t reg, uint8_t b
 	} else {
 		*(out++) = opcode;
 	}
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | base | (reg << 3);
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | base | (reg << 3);
-	}
-	if (base == RSP) {
-		//add SIB byte, with no index and RSP as base
-		*(out++) = (RSP << 3) | RSP;
-	}
-	*(out++) = disp;
-	if (disp >= 128 || disp < -128) {
-	*(out++) = disp >> 8;
-	*(out++) = disp >> 16;
-	*(out++) = disp >> 24;
-	}
+	out = x86_modrm_disp(out, reg, base, disp);
 	code->cur = out;
 }
 
@@ -486,7 +503,7 @@ void x86_r_size(code_info *code, uint8_t opcode, uint8_t opex, uint8_t dst, uint
 
 void x86_rdisp_size(code_info *code, uint8_t opcode, uint8_t opex, uint8_t dst, int32_t disp, uint8_t size)
 {
-	check_alloc_code(code, 7);
+	check_alloc_code(code, 9);
 	code_ptr out = code->cur;
 	uint8_t tmp;
 	if (size == SZ_W) {
@@ -511,16 +528,7 @@ void x86_rdisp_size(code_info *code, uint8_t opcode, uint8_t opex, uint8_t dst,
 		opcode |= BIT_SIZE;
 	}
 	*(out++) = opcode;
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst | (opex << 3);
-	*(out++) = disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | dst | (opex << 3);
-		*(out++) = disp;
-		*(out++) = disp >> 8;
-		*(out++) = disp >> 16;
-		*(out++) = disp >> 24;
-	}
+	out = x86_modrm_disp(out, opex, dst, disp);
 	code->cur = out;
 }
 
@@ -537,17 +545,18 @@ void x86_ir(code_info *code, uint8_t opcode, uint8_t op_ex, uint8_t al_opcode, i
 		*(out++) = PRE_SIZE;
 	}
 	if (dst == RAX && !sign_extend && al_opcode) {
+		//al_opcode is the short form with the accumulator as an implicit destination
 		if (size != SZ_B) {
 			al_opcode |= BIT_SIZE;
 			if (size == SZ_Q) {
 #ifdef X86_64
-				*out = PRE_REX | REX_QUAD;
+				*(out++) = PRE_REX | REX_QUAD;
 #else
 		fatal_error("Instruction requires REX prefix but this is a 32-bit build | opcode: %X, reg: %s, size: %s\n", al_opcode, x86_reg_names[dst], x86_sizes[size]);
 #endif
 			}
 		}
-		*(out++) = al_opcode | BIT_IMMED_RAX;
+		*(out++) = al_opcode;
 	} else {
 		if (size == SZ_Q || dst >= R8 || (size == SZ_B && dst >= RSP && dst <= RDI)) {
 #ifdef X86_64
@@ -619,19 +628,7 @@ void x86_irdisp(code_info *code, uint8_t opcode, uint8_t op_ex, int32_t val, uin
 		opcode |= BIT_SIZE;
 	}
 	*(out++) = opcode;
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst | (op_ex << 3);
-	*(out++) = disp;
-	} else {
-	*(out++) = MODE_REG_DISPLACE32 | dst | (op_ex << 3);
-	*(out++) = disp;
-	disp >>= 8;
-	*(out++) = disp;
-	disp >>= 8;
-	*(out++) = disp;
-	disp >>= 8;
-	*(out++) = disp;
-	}
+	out = x86_modrm_disp(out, op_ex, dst, disp);
 	*(out++) = val;
 	if (size != SZ_B && !sign_extend) {
 		val >>= 8;
@@ -678,7 +675,7 @@ void x86_shiftrot_ir(code_info *code, uint8_t op_ex, uint8_t val, uint8_t dst, u
 
 void x86_shiftrot_irdisp(code_info *code, uint8_t op_ex, uint8_t val, uint8_t dst, int32_t disp, uint8_t size)
 {
-	check_alloc_code(code, 9);
+	check_alloc_code(code, 10);
 	code_ptr out = code->cur;
 	if (size == SZ_W) {
 		*(out++) = PRE_SIZE;
@@ -699,16 +696,7 @@ void x86_shiftrot_irdisp(code_info *code, uint8_t op_ex, uint8_t val, uint8_t ds
 	}
 
 	*(out++) = (val == 1 ? OP_SHIFTROT_1: OP_SHIFTROT_IR) | (size == SZ_B ? 0 : BIT_SIZE);
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst | (op_ex << 3);
-	*(out++) = disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | dst | (op_ex << 3);
-		*(out++) = disp;
-		*(out++) = disp >> 8;
-		*(out++) = disp >> 16;
-		*(out++) = disp >> 24;
-	}
+	out = x86_modrm_disp(out, op_ex, dst, disp);
 	if (val != 1) {
 		*(out++) = val;
 	}
@@ -744,7 +732,7 @@ void x86_shiftrot_clr(code_info *code, uint8_t op_ex, uint8_t dst, uint8_t size)
 
 void x86_shiftrot_clrdisp(code_info *code, uint8_t op_ex, uint8_t dst, int32_t disp, uint8_t size)
 {
-	check_alloc_code(code, 8);
+	check_alloc_code(code, 9);
 	code_ptr out = code->cur;
 	if (size == SZ_W) {
 		*(out++) = PRE_SIZE;
@@ -765,16 +753,7 @@ void x86_shiftrot_clrdisp(code_info *code, uint8_t op_ex, uint8_t dst, int32_t d
 	}
 
 	*(out++) = OP_SHIFTROT_CL | (size == SZ_B ? 0 : BIT_SIZE);
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst | (op_ex << 3);
-	*(out++) = disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | dst | (op_ex << 3);
-		*(out++) = disp;
-		*(out++) = disp >> 8;
-		*(out++) = disp >> 16;
-		*(out++) = disp >> 24;
-}
+	out = x86_modrm_disp(out, op_ex, dst, disp);
 	code->cur = out;
 }
 
@@ -925,7 +904,7 @@ void add_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void add_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_ADDI, OP_ADD, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_ADDI, OP_ADD | BIT_IMMED_RAX, val, dst, size);
 }
 
 void add_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -950,7 +929,7 @@ void adc_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void adc_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_ADCI, OP_ADC, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_ADCI, OP_ADC | BIT_IMMED_RAX, val, dst, size);
 }
 
 void adc_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -974,7 +953,7 @@ void or_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 }
 void or_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_ORI, OP_OR, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_ORI, OP_OR | BIT_IMMED_RAX, val, dst, size);
 }
 
 void or_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -999,7 +978,7 @@ void and_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void and_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_ANDI, OP_AND, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_ANDI, OP_AND | BIT_IMMED_RAX, val, dst, size);
 }
 
 void and_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -1024,7 +1003,7 @@ void xor_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void xor_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_XORI, OP_XOR, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_XORI, OP_XOR | BIT_IMMED_RAX, val, dst, size);
 }
 
 void xor_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -1049,7 +1028,7 @@ void sub_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void sub_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_SUBI, OP_SUB, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_SUBI, OP_SUB | BIT_IMMED_RAX, val, dst, size);
 }
 
 void sub_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -1074,7 +1053,7 @@ void sbb_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void sbb_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_SBBI, OP_SBB, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_SBBI, OP_SBB | BIT_IMMED_RAX, val, dst, size);
 }
 
 void sbb_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -1099,7 +1078,7 @@ void cmp_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void cmp_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_IMMED_ARITH, OP_EX_CMPI, OP_CMP, val, dst, size);
+	x86_ir(code, OP_IMMED_ARITH, OP_EX_CMPI, OP_CMP | BIT_IMMED_RAX, val, dst, size);
 }
 
 void cmp_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -1124,7 +1103,7 @@ void test_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 
 void test_ir(code_info *code, int32_t val, uint8_t dst, uint8_t size)
 {
-	x86_ir(code, OP_NOT_NEG, OP_EX_TEST_I, OP_TEST, val, dst, size);
+	x86_ir(code, OP_NOT_NEG, OP_EX_TEST_I, OP_TEST_I_RAX, val, dst, size);
 }
 
 void test_irdisp(code_info *code, int32_t val, uint8_t dst_base, int32_t disp, uint8_t size)
@@ -1223,6 +1202,10 @@ void idiv_rdisp(code_info *code, uint8_t dst_base, int32_t disp, uint8_t size)
 
 void mov_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t size)
 {
+	if (src == dst && size != SZ_D) {
+		//a 32-bit move to itself clears the upper half of the register, other sizes do nothing
+		return;
+	}
 	x86_rr_sizedir(code, OP_MOV, src, dst, size);
 }
 
@@ -1261,6 +1244,10 @@ void mov_ir(code_info *code, int64_t val, uint8_t dst, uint8_t size)
 	check_alloc_code(code, 14);
 	code_ptr out = code->cur;
 	uint8_t sign_extend = 0;
+	if (size == SZ_Q && val >= 0 && val <= 0xFFFFFFFF) {
+		//32-bit moves zero extend, which is shorter than either 64-bit form
+		size = SZ_D;
+	}
 	if (size == SZ_Q && val <= 0x7FFFFFFF && val >= -2147483648) {
 		sign_extend = 1;
 	}
@@ -1322,6 +1309,11 @@ uint8_t is_mov_ir(code_ptr inst)
 	return (*inst & 0xF8) == OP_MOV_I8R || (*inst & 0xF8) == OP_MOV_IR || (*inst & 0xFE) == OP_MOV_IEA;
 }
 
+uint8_t is_jmp(code_ptr inst)
+{
+	return *inst == OP_JMP;
+}
+
 void mov_irdisp(code_info *code, int32_t val, uint8_t dst, int32_t disp, uint8_t size)
 {
 	check_alloc_code(code, 12);
@@ -1344,16 +1336,7 @@ void mov_irdisp(code_info *code, int32_t val, uint8_t dst, int32_t disp, uint8_t
 		dst -= (AH-X86_AH);
 	}
 	*(out++) = OP_MOV_IEA | (size == SZ_B ? 0 : BIT_SIZE);
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst;
-	*(out++) = disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | dst;
-		*(out++) = disp;
-		*(out++) = disp >> 8;
-		*(out++) = disp >> 16;
-		*(out++) = disp >> 24;
-	}
+	out = x86_modrm_disp(out, 0, dst, disp);
 
 	*(out++) = val;
 	if (size != SZ_B) {
@@ -1467,16 +1450,7 @@ void movsx_rdispr(code_info *code, uint8_t src, int32_t disp, uint8_t dst, uint8
 		*(out++) = PRE_2BYTE;
 		*(out++) = OP2_MOVSX | (src_size == SZ_B ? 0 : BIT_SIZE);
 	}
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | src | (dst << 3);
-	*(out++) = disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | src | (dst << 3);
-		*(out++) = disp;
-		*(out++) = disp >> 8;
-		*(out++) = disp >> 16;
-		*(out++) = disp >> 24;
-	}
+	out = x86_modrm_disp(out, dst, src, disp);
 	code->cur = out;
 }
 
@@ -1510,7 +1484,7 @@ void movzx_rr(code_info *code, uint8_t src, uint8_t dst, uint8_t src_size, uint8
 
 void movzx_rdispr(code_info *code, uint8_t src, int32_t disp, uint8_t dst, uint8_t src_size, uint8_t size)
 {
-	check_alloc_code(code, 9);
+	check_alloc_code(code, 10);
 	code_ptr out = code->cur;
 	if (size == SZ_W) {
 		*(out++) = PRE_SIZE;
@@ -1532,16 +1506,7 @@ void movzx_rdispr(code_info *code, uint8_t src, int32_t disp, uint8_t dst, uint8
 	}
 	*(out++) = PRE_2BYTE;
 	*(out++) = OP2_MOVZX | (src_size == SZ_B ? 0 : BIT_SIZE);
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | src | (dst << 3);
-	*(out++) = disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | src | (dst << 3);
-		*(out++) = disp;
-		*(out++) = disp >> 8;
-		*(out++) = disp >> 16;
-		*(out++) = disp >> 24;
-	}
+	out = x86_modrm_disp(out, dst, src, disp);
 	code->cur = out;
 }
 
@@ -1688,7 +1653,7 @@ void setcc_rind(code_info *code, uint8_t cc, uint8_t dst)
 
 void setcc_rdisp(code_info *code, uint8_t cc, uint8_t dst, int32_t disp)
 {
-	check_alloc_code(code, 8);
+	check_alloc_code(code, 9);
 	code_ptr out = code->cur;
 	if (dst >= R8) {
 		*(out++) = PRE_REX | REX_RM_FIELD;
@@ -1696,16 +1661,7 @@ void setcc_rdisp(code_info *code, uint8_t cc, uint8_t dst, int32_t disp)
 	}
 	*(out++) = PRE_2BYTE;
 	*(out++) = OP2_SETCC | cc;
-	if (disp < 128 && disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst;
-	*(out++) = disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | dst;
-		*(out++) = disp;
-		*(out++) = disp >> 8;
-		*(out++) = disp >> 16;
-		*(out++) = disp >> 24;
-	}
+	out = x86_modrm_disp(out, 0, dst, disp);
 	code->cur = out;
 }
 
@@ -1739,7 +1695,7 @@ void bit_rr(code_info *code, uint8_t op2, uint8_t src, uint8_t dst, uint8_t size
 
 void bit_rrdisp(code_info *code, uint8_t op2, uint8_t src, uint8_t dst_base, int32_t dst_disp, uint8_t size)
 {
-	check_alloc_code(code, 9);
+	check_alloc_code(code, 10);
 	code_ptr out = code->cur;
 	if (size == SZ_W) {
 		*(out++) = PRE_SIZE;
@@ -1761,16 +1717,7 @@ void bit_rrdisp(code_info *code, uint8_t op2, uint8_t src, uint8_t dst_base, int
 	}
 	*(out++) = PRE_2BYTE;
 	*(out++) = op2;
-	if (dst_disp < 128 && dst_disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst_base | (src << 3);
-	*(out++) = dst_disp;
-	} else {
-	*(out++) = MODE_REG_DISPLACE32 | dst_base | (src << 3);
-	*(out++) = dst_disp;
-	*(out++) = dst_disp >> 8;
-	*(out++) = dst_disp >> 16;
-	*(out++) = dst_disp >> 24;
-	}
+	out = x86_modrm_disp(out, src, dst_base, dst_disp);
 	code->cur = out;
 }
 
@@ -1801,7 +1748,7 @@ void bit_ir(code_info *code, uint8_t op_ex, uint8_t val, uint8_t dst, uint8_t si
 
 void bit_irdisp(code_info *code, uint8_t op_ex, uint8_t val, uint8_t dst_base, int32_t dst_disp, uint8_t size)
 {
-	check_alloc_code(code, 10);
+	check_alloc_code(code, 11);
 	code_ptr out = code->cur;
 	if (size == SZ_W) {
 		*(out++) = PRE_SIZE;
@@ -1819,16 +1766,7 @@ void bit_irdisp(code_info *code, uint8_t op_ex, uint8_t val, uint8_t dst_base, i
 	}
 	*(out++) = PRE_2BYTE;
 	*(out++) = OP2_BTX_I;
-	if (dst_disp < 128 && dst_disp >= -128) {
-	*(out++) = MODE_REG_DISPLACE8 | dst_base | (op_ex << 3);
-	*(out++) = dst_disp;
-	} else {
-		*(out++) = MODE_REG_DISPLACE32 | dst_base | (op_ex << 3);
-		*(out++) = dst_disp;
-		*(out++) = dst_disp >> 8;
-		*(out++) = dst_disp >> 16;
-		*(out++) = dst_disp >> 24;
-	}
+	out = x86_modrm_disp(out, op_ex, dst_base, dst_disp);
 	*(out++) = val;
 	code->cur = out;
 }
@@ -1981,14 +1919,24 @@ void jmp_r(code_info *code, uint8_t dst)
 
 void jmp_rind(code_info *code, uint8_t dst)
 {
-	check_alloc_code(code, 3);
+	check_alloc_code(code, 4);
 	code_ptr out = code->cur;
 	if (dst >= R8) {
 		dst -= R8 - X86_R8;
 		*(out++) = PRE_REX | REX_RM_FIELD;
 	}
 	*(out++) = OP_SINGLE_EA;
-	*(out++) = MODE_REG_INDIRECT | dst | (OP_EX_JMP_EA << 3);
+	if (dst == RBP) {
+		//RBP and R13 need a dummy displacement, MODE_REG_INDIRECT selects RIP relative addressing
+		*(out++) = MODE_REG_DISPLACE8 | dst | (OP_EX_JMP_EA << 3);
+		*(out++) = 0;
+	} else {
+		*(out++) = MODE_REG_INDIRECT | dst | (OP_EX_JMP_EA << 3);
+		if (dst == RSP) {
+			//RSP and R12 need a SIB byte
+			*(out++) = (RSP << 3) | RSP;
+		}
+	}
 	code->cur = out;
 }
 
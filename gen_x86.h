@@ -217,6 +217,7 @@ void retn(code_info *code);
 void cdq(code_info *code);
 void loop(code_info *code, code_ptr dst);
 uint8_t is_mov_ir(code_ptr inst);
+uint8_t is_jmp(code_ptr inst);
 
 #endif //GEN_X86_H_
 
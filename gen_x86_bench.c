@@ -0,0 +1,407 @@
+/*
+ Copyright 2013 Michael Pavone
+ This file is part of BlastEm.
+ BlastEm is free software distributed under the terms of the GNU General Public License version 3 or greater. See COPYING for full license text.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gen_x86.h"
+#include "util.h"
+
+//util.c expects these to be provided by the frontend
+int headless = 1;
+void render_errorbox(char *title, char *message) {}
+void render_infobox(char *title, char *message) {}
+
+enum {
+	CLASS_RR,
+	CLASS_IR,
+	CLASS_IRDISP,
+	CLASS_RRDISP,
+	CLASS_RDISPR,
+	CLASS_MOV_IR,
+	CLASS_SHIFT,
+	CLASS_EXTEND,
+	CLASS_BIT,
+	CLASS_SETCC,
+	CLASS_STACK,
+	CLASS_BRANCH,
+	NUM_CLASSES
+};
+
+static char const *class_names[NUM_CLASSES] = {
+	"rr", "ir", "irdisp", "rrdisp", "rdispr", "mov_ir", "shift", "extend", "bit", "setcc", "stack", "branch"
+};
+
+static uint8_t const class_variants[NUM_CLASSES] = {8, 7, 6, 4, 4, 1, 6, 2, 4, 2, 2, 3};
+
+typedef struct {
+	uint8_t src;
+	uint8_t dst;
+	uint8_t size;
+	uint8_t cc;
+	int32_t imm;
+	int32_t disp;
+	int64_t wide;
+} operands;
+
+//src is the source register or base register for the rdispr forms,
+//dst is the destination register or base register for the irdisp/rrdisp forms
+//branch targets are disp bytes past the start of the instruction
+static void emit(code_info *code, uint8_t class, uint8_t variant, operands const *op)
+{
+	switch (class)
+	{
+	case CLASS_RR:
+		switch (variant)
+		{
+		case 0: add_rr(code, op->src, op->dst, op->size); break;
+		case 1: sub_rr(code, op->src, op->dst, op->size); break;
+		case 2: and_rr(code, op->src, op->dst, op->size); break;
+		case 3: or_rr(code, op->src, op->dst, op->size); break;
+		case 4: xor_rr(code, op->src, op->dst, op->size); break;
+		case 5: cmp_rr(code, op->src, op->dst, op->size); break;
+		case 6: mov_rr(code, op->src, op->dst, op->size); break;
+		case 7: test_rr(code, op->src, op->dst, op->size); break;
+		}
+		break;
+	case CLASS_IR:
+		switch (variant)
+		{
+		case 0: add_ir(code, op->imm, op->dst, op->size); break;
+		case 1: sub_ir(code, op->imm, op->dst, op->size); break;
+		case 2: and_ir(code, op->imm, op->dst, op->size); break;
+		case 3: or_ir(code, op->imm, op->dst, op->size); break;
+		case 4: xor_ir(code, op->imm, op->dst, op->size); break;
+		case 5: cmp_ir(code, op->imm, op->dst, op->size); break;
+		case 6: test_ir(code, op->imm, op->dst, op->size); break;
+		}
+		break;
+	case CLASS_IRDISP:
+		switch (variant)
+		{
+		case 0: add_irdisp(code, op->imm, op->dst, op->disp, op->size); break;
+		case 1: sub_irdisp(code, op->imm, op->dst, op->disp, op->size); break;
+		case 2: and_irdisp(code, op->imm, op->dst, op->disp, op->size); break;
+		case 3: or_irdisp(code, op->imm, op->dst, op->disp, op->size); break;
+		case 4: cmp_irdisp(code, op->imm, op->dst, op->disp, op->size); break;
+		case 5: mov_irdisp(code, op->imm, op->dst, op->disp, op->size); break;
+		}
+		break;
+	case CLASS_RRDISP:
+		switch (variant)
+		{
+		case 0: mov_rrdisp(code, op->src, op->dst, op->disp, op->size); break;
+		case 1: add_rrdisp(code, op->src, op->dst, op->disp, op->size); break;
+		case 2: or_rrdisp(code, op->src, op->dst, op->disp, op->size); break;
+		case 3: cmp_rrdisp(code, op->src, op->dst, op->disp, op->size); break;
+		}
+		break;
+	case CLASS_RDISPR:
+		switch (variant)
+		{
+		case 0: mov_rdispr(code, op->src, op->disp, op->dst, op->size); break;
+		case 1: add_rdispr(code, op->src, op->disp, op->dst, op->size); break;
+		case 2: and_rdispr(code, op->src, op->disp, op->dst, op->size); break;
+		case 3: cmp_rdispr(code, op->src, op->disp, op->dst, op->size); break;
+		}
+		break;
+	case CLASS_MOV_IR:
+		mov_ir(code, op->wide, op->dst, op->size);
+		break;
+	case CLASS_SHIFT:
+		switch (variant)
+		{
+		case 0: shl_ir(code, op->imm, op->dst, op->size); break;
+		case 1: shr_ir(code, op->imm, op->dst, op->size); break;
+		case 2: sar_ir(code, op->imm, op->dst, op->size); break;
+		case 3: rol_ir(code, op->imm, op->dst, op->size); break;
+		case 4: ror_ir(code, op->imm, op->dst, op->size); break;
+		case 5: shl_clr(code, op->dst, op->size); break;
+		}
+		break;
+	case CLASS_EXTEND:
+		//extends from the low byte, or the low word for SZ_Q
+		if (variant) {
+			movsx_rr(code, op->src, op->dst, op->size == SZ_Q ? SZ_W : SZ_B, op->size == SZ_Q ? SZ_Q : SZ_D);
+		} else {
+			movzx_rr(code, op->src, op->dst, op->size == SZ_Q ? SZ_W : SZ_B, SZ_D);
+		}
+		break;
+	case CLASS_BIT:
+		switch (variant)
+		{
+		case 0: bt_ir(code, op->imm, op->dst, op->size == SZ_Q ? SZ_Q : SZ_D); break;
+		case 1: bts_ir(code, op->imm, op->dst, op->size == SZ_Q ? SZ_Q : SZ_D); break;
+		case 2: btr_ir(code, op->imm, op->dst, op->size == SZ_Q ? SZ_Q : SZ_D); break;
+		case 3: bt_irdisp(code, op->imm, op->dst, op->disp, op->size == SZ_Q ? SZ_Q : SZ_D); break;
+		}
+		break;
+	case CLASS_SETCC:
+		if (variant) {
+			setcc_rdisp(code, op->cc, op->dst, op->disp);
+		} else {
+			setcc_r(code, op->cc, op->dst);
+		}
+		break;
+	case CLASS_STACK:
+		if (variant) {
+			pop_r(code, op->dst);
+		} else {
+			push_r(code, op->dst);
+		}
+		break;
+	case CLASS_BRANCH:
+		switch (variant)
+		{
+		case 0: jcc(code, op->cc, code->cur + op->disp); break;
+		case 1: jmp(code, code->cur + op->disp); break;
+		case 2: call_noalign(code, code->cur + op->disp); break;
+		}
+		break;
+	}
+}
+
+typedef struct {
+	char const *text;
+	uint8_t    class;
+	uint8_t    variant;
+	operands   op;
+	uint8_t    len;
+	uint8_t    bytes[MAX_INST_LEN];
+} encoding;
+
+#define OPS(src, dst, size) {src, dst, size, 0, 0, 0, 0}
+#define OPS_I(dst, size, imm) {0, dst, size, 0, imm, 0, 0}
+#define OPS_ID(dst, size, imm, disp) {0, dst, size, 0, imm, disp, 0}
+#define OPS_D(src, dst, size, disp) {src, dst, size, 0, 0, disp, 0}
+#define OPS_W(dst, size, wide) {0, dst, size, 0, 0, 0, wide}
+#define OPS_CC(dst, cc, disp) {0, dst, SZ_B, cc, 0, disp, 0}
+
+//expected encodings, checked against what the emitters produce before benchmarking
+static encoding const expected[] = {
+	{"add eax, ecx",              CLASS_RR, 0, OPS(RCX, RAX, SZ_D), 2, {0x01, 0xC8}},
+	{"add r9w, dx",               CLASS_RR, 0, OPS(RDX, R9, SZ_W), 4, {0x66, 0x41, 0x01, 0xD1}},
+	{"sub rbx, r10",              CLASS_RR, 1, OPS(R10, RBX, SZ_Q), 3, {0x4C, 0x29, 0xD3}},
+	{"and bl, ah",                CLASS_RR, 2, OPS(AH, RBX, SZ_B), 2, {0x20, 0xE3}},
+	{"or sil, al",                CLASS_RR, 3, OPS(RAX, RSI, SZ_B), 3, {0x40, 0x0A, 0xF0}},
+	{"xor r15d, r15d",            CLASS_RR, 4, OPS(R15, R15, SZ_D), 3, {0x45, 0x31, 0xFF}},
+	{"cmp r8b, dil",              CLASS_RR, 5, OPS(RDI, R8, SZ_B), 3, {0x41, 0x38, 0xF8}},
+	{"mov rax, r13",              CLASS_RR, 6, OPS(R13, RAX, SZ_Q), 3, {0x4C, 0x89, 0xE8}},
+	{"mov ecx, ecx",              CLASS_RR, 6, OPS(RCX, RCX, SZ_D), 2, {0x89, 0xC9}},
+	{"mov rcx, rcx (dropped)",    CLASS_RR, 6, OPS(RCX, RCX, SZ_Q), 0, {0}},
+	{"test edx, esi",             CLASS_RR, 7, OPS(RSI, RDX, SZ_D), 2, {0x85, 0xF2}},
+	{"add eax, 1",                CLASS_IR, 0, OPS_I(RAX, SZ_D, 1), 3, {0x83, 0xC0, 0x01}},
+	{"add eax, 0x1000",           CLASS_IR, 0, OPS_I(RAX, SZ_D, 0x1000), 5, {0x05, 0x00, 0x10, 0x00, 0x00}},
+	{"sub rax, 0x1000",           CLASS_IR, 1, OPS_I(RAX, SZ_Q, 0x1000), 6, {0x48, 0x2D, 0x00, 0x10, 0x00, 0x00}},
+	{"sub ecx, 0x1000",           CLASS_IR, 1, OPS_I(RCX, SZ_D, 0x1000), 6, {0x81, 0xE9, 0x00, 0x10, 0x00, 0x00}},
+	{"sub r11, -4",               CLASS_IR, 1, OPS_I(R11, SZ_Q, -4), 4, {0x49, 0x83, 0xEB, 0xFC}},
+	{"and al, 0x0F",              CLASS_IR, 2, OPS_I(RAX, SZ_B, 0x0F), 2, {0x24, 0x0F}},
+	{"and dx, 0x7FF",             CLASS_IR, 2, OPS_I(RDX, SZ_W, 0x7FF), 5, {0x66, 0x81, 0xE2, 0xFF, 0x07}},
+	{"or r12b, 0x80",             CLASS_IR, 3, OPS_I(R12, SZ_B, 0x80), 4, {0x41, 0x80, 0xCC, 0x80}},
+	{"xor ebx, -1",               CLASS_IR, 4, OPS_I(RBX, SZ_D, -1), 3, {0x83, 0xF3, 0xFF}},
+	{"cmp r14d, 0x12345678",      CLASS_IR, 5, OPS_I(R14, SZ_D, 0x12345678), 7, {0x41, 0x81, 0xFE, 0x78, 0x56, 0x34, 0x12}},
+	{"test al, 0x80",             CLASS_IR, 6, OPS_I(RAX, SZ_B, 0x80), 2, {0xA8, 0x80}},
+	{"test bh, 0x40",             CLASS_IR, 6, OPS_I(BH, SZ_B, 0x40), 3, {0xF6, 0xC7, 0x40}},
+	{"test r9d, 0x100",           CLASS_IR, 6, OPS_I(R9, SZ_D, 0x100), 7, {0x41, 0xF7, 0xC1, 0x00, 0x01, 0x00, 0x00}},
+	{"add dword [rsi+0x10], 7",   CLASS_IRDISP, 0, OPS_ID(RSI, SZ_D, 7, 0x10), 4, {0x83, 0x46, 0x10, 0x07}},
+	{"sub dword [rbp+0x200], 7",  CLASS_IRDISP, 1, OPS_ID(RBP, SZ_D, 7, 0x200), 7, {0x83, 0xAD, 0x00, 0x02, 0x00, 0x00, 0x07}},
+	{"and byte [r13+8], 0xFE",    CLASS_IRDISP, 2, OPS_ID(R13, SZ_B, 0xFE, 8), 5, {0x41, 0x80, 0x65, 0x08, 0xFE}},
+	{"or word [rdi-4], 0x100",    CLASS_IRDISP, 3, OPS_ID(RDI, SZ_W, 0x100, -4), 6, {0x66, 0x81, 0x4F, 0xFC, 0x00, 0x01}},
+	{"cmp qword [r8+0x18], 0",    CLASS_IRDISP, 4, OPS_ID(R8, SZ_Q, 0, 0x18), 5, {0x49, 0x83, 0x78, 0x18, 0x00}},
+	{"mov dword [rsi+0x40], 5",   CLASS_IRDISP, 5, OPS_ID(RSI, SZ_D, 5, 0x40), 7, {0xC7, 0x46, 0x40, 0x05, 0x00, 0x00, 0x00}},
+	{"mov [rsi+0x20], eax",       CLASS_RRDISP, 0, OPS_D(RAX, RSI, SZ_D, 0x20), 3, {0x89, 0x46, 0x20}},
+	{"mov [r12+8], r10",          CLASS_RRDISP, 0, OPS_D(R10, R12, SZ_Q, 8), 5, {0x4D, 0x89, 0x54, 0x24, 0x08}},
+	{"mov [rsi], cl",             CLASS_RRDISP, 0, OPS_D(RCX, RSI, SZ_B, 0), 2, {0x88, 0x0E}},
+	{"mov [r12], eax",            CLASS_RRDISP, 0, OPS_D(RAX, R12, SZ_D, 0), 4, {0x41, 0x89, 0x04, 0x24}},
+	{"add [rdi+0x400], bx",       CLASS_RRDISP, 1, OPS_D(RBX, RDI, SZ_W, 0x400), 7, {0x66, 0x01, 0x9F, 0x00, 0x04, 0x00, 0x00}},
+	{"or [r15+1], sil",           CLASS_RRDISP, 2, OPS_D(RSI, R15, SZ_B, 1), 4, {0x41, 0x08, 0x77, 0x01}},
+	{"cmp [rsi-0x80], edx",       CLASS_RRDISP, 3, OPS_D(RDX, RSI, SZ_D, -0x80), 3, {0x39, 0x56, 0x80}},
+	{"mov ecx, [rsi+0x30]",       CLASS_RDISPR, 0, OPS_D(RSI, RCX, SZ_D, 0x30), 3, {0x8B, 0x4E, 0x30}},
+	{"mov rcx, [r13]",            CLASS_RDISPR, 0, OPS_D(R13, RCX, SZ_Q, 0), 4, {0x49, 0x8B, 0x4D, 0x00}},
+	{"mov r9, [rbp-0x81]",        CLASS_RDISPR, 0, OPS_D(RBP, R9, SZ_Q, -0x81), 7, {0x4C, 0x8B, 0x8D, 0x7F, 0xFF, 0xFF, 0xFF}},
+	{"add al, [rsi+2]",           CLASS_RDISPR, 1, OPS_D(RSI, RAX, SZ_B, 2), 3, {0x02, 0x46, 0x02}},
+	{"and r11w, [r14+6]",         CLASS_RDISPR, 2, OPS_D(R14, R11, SZ_W, 6), 5, {0x66, 0x45, 0x23, 0x5E, 0x06}},
+	{"cmp edi, [rsi+0x7C]",       CLASS_RDISPR, 3, OPS_D(RSI, RDI, SZ_D, 0x7C), 3, {0x3B, 0x7E, 0x7C}},
+	{"mov al, 0x12",              CLASS_MOV_IR, 0, OPS_W(RAX, SZ_B, 0x12), 2, {0xB0, 0x12}},
+	{"mov r10w, 0x1234",          CLASS_MOV_IR, 0, OPS_W(R10, SZ_W, 0x1234), 5, {0x66, 0x41, 0xBA, 0x34, 0x12}},
+	{"mov ebx, 0x12345678",       CLASS_MOV_IR, 0, OPS_W(RBX, SZ_D, 0x12345678), 5, {0xBB, 0x78, 0x56, 0x34, 0x12}},
+	{"mov rax, -2",               CLASS_MOV_IR, 0, OPS_W(RAX, SZ_Q, -2), 7, {0x48, 0xC7, 0xC0, 0xFE, 0xFF, 0xFF, 0xFF}},
+	{"mov edx, 0x80000000",       CLASS_MOV_IR, 0, OPS_W(RDX, SZ_Q, 0x80000000), 5, {0xBA, 0x00, 0x00, 0x00, 0x80}},
+	{"mov r11d, 0x10",            CLASS_MOV_IR, 0, OPS_W(R11, SZ_Q, 0x10), 6, {0x41, 0xBB, 0x10, 0x00, 0x00, 0x00}},
+	{"mov r8, 0x123456789A",      CLASS_MOV_IR, 0, OPS_W(R8, SZ_Q, 0x123456789ALL), 10, {0x49, 0xB8, 0x9A, 0x78, 0x56, 0x34, 0x12, 0x00, 0x00, 0x00}},
+	{"shl eax, 1",                CLASS_SHIFT, 0, OPS_I(RAX, SZ_D, 1), 2, {0xD1, 0xE0}},
+	{"shl r12d, 4",               CLASS_SHIFT, 0, OPS_I(R12, SZ_D, 4), 4, {0x41, 0xC1, 0xE4, 0x04}},
+	{"shr dx, 8",                 CLASS_SHIFT, 1, OPS_I(RDX, SZ_W, 8), 4, {0x66, 0xC1, 0xEA, 0x08}},
+	{"sar rcx, 63",               CLASS_SHIFT, 2, OPS_I(RCX, SZ_Q, 63), 4, {0x48, 0xC1, 0xF9, 0x3F}},
+	{"rol bl, 3",                 CLASS_SHIFT, 3, OPS_I(RBX, SZ_B, 3), 3, {0xC0, 0xC3, 0x03}},
+	{"ror r9w, 8",                CLASS_SHIFT, 4, OPS_I(R9, SZ_W, 8), 5, {0x66, 0x41, 0xC1, 0xC9, 0x08}},
+	{"shl edi, cl",               CLASS_SHIFT, 5, OPS_I(RDI, SZ_D, 0), 2, {0xD3, 0xE7}},
+	{"movzx eax, bl",             CLASS_EXTEND, 0, OPS(RBX, RAX, SZ_D), 3, {0x0F, 0xB6, 0xC3}},
+	{"movzx r10d, dx",            CLASS_EXTEND, 0, OPS(RDX, R10, SZ_Q), 4, {0x44, 0x0F, 0xB7, 0xD2}},
+	{"movsx ecx, r8b",            CLASS_EXTEND, 1, OPS(R8, RCX, SZ_D), 4, {0x41, 0x0F, 0xBE, 0xC8}},
+	{"movsx rsi, ax",             CLASS_EXTEND, 1, OPS(RAX, RSI, SZ_Q), 4, {0x48, 0x0F, 0xBF, 0xF0}},
+	{"bt eax, 5",                 CLASS_BIT, 0, OPS_I(RAX, SZ_D, 5), 4, {0x0F, 0xBA, 0xE0, 0x05}},
+	{"bts r11, 40",               CLASS_BIT, 1, OPS_I(R11, SZ_Q, 40), 5, {0x49, 0x0F, 0xBA, 0xEB, 0x28}},
+	{"btr edx, 31",               CLASS_BIT, 2, OPS_I(RDX, SZ_D, 31), 4, {0x0F, 0xBA, 0xF2, 0x1F}},
+	{"bt dword [rsi+0x10], 3",    CLASS_BIT, 3, OPS_ID(RSI, SZ_D, 3, 0x10), 5, {0x0F, 0xBA, 0x66, 0x10, 0x03}},
+	{"setz al",                   CLASS_SETCC, 0, OPS_CC(RAX, CC_Z, 0), 3, {0x0F, 0x94, 0xC0}},
+	{"setc bh",                   CLASS_SETCC, 0, OPS_CC(BH, CC_C, 0), 3, {0x0F, 0x92, 0xC7}},
+	{"setnz [rsi+0x21]",          CLASS_SETCC, 1, OPS_CC(RSI, CC_NZ, 0x21), 4, {0x0F, 0x95, 0x46, 0x21}},
+	{"setz [r12+4]",              CLASS_SETCC, 1, OPS_CC(R12, CC_Z, 4), 6, {0x41, 0x0F, 0x94, 0x44, 0x24, 0x04}},
+	{"sets [r9+0x100]",           CLASS_SETCC, 1, OPS_CC(R9, CC_S, 0x100), 8, {0x41, 0x0F, 0x98, 0x81, 0x00, 0x01, 0x00, 0x00}},
+	{"push rbx",                  CLASS_STACK, 0, OPS(0, RBX, SZ_Q), 1, {0x53}},
+	{"push r15",                  CLASS_STACK, 0, OPS(0, R15, SZ_Q), 2, {0x41, 0x57}},
+	{"pop rbp",                   CLASS_STACK, 1, OPS(0, RBP, SZ_Q), 1, {0x5D}},
+	{"pop r12",                   CLASS_STACK, 1, OPS(0, R12, SZ_Q), 2, {0x41, 0x5C}},
+	{"jz $+0x10",                 CLASS_BRANCH, 0, OPS_CC(0, CC_Z, 0x10), 2, {0x74, 0x0E}},
+	{"jnc $+0x400",               CLASS_BRANCH, 0, OPS_CC(0, CC_NC, 0x400), 6, {0x0F, 0x83, 0xFA, 0x03, 0x00, 0x00}},
+	{"jmp $",                     CLASS_BRANCH, 1, OPS_CC(0, 0, 0), 2, {0xEB, 0xFE}},
+	{"jmp $+0x1000",              CLASS_BRANCH, 1, OPS_CC(0, 0, 0x1000), 5, {0xE9, 0xFB, 0x0F, 0x00, 0x00}},
+	{"call $+0x20",               CLASS_BRANCH, 2, OPS_CC(0, 0, 0x20), 5, {0xE8, 0x1B, 0x00, 0x00, 0x00}},
+};
+
+static int check_encodings(code_info *code)
+{
+	int failed = 0;
+	code_ptr start = code->cur;
+	for (uint32_t i = 0; i < sizeof(expected)/sizeof(*expected); i++)
+	{
+		encoding const *enc = expected + i;
+		code->cur = start;
+		emit(code, enc->class, enc->variant, &enc->op);
+		uint32_t len = code->cur - start;
+		if (len != enc->len || memcmp(start, enc->bytes, len)) {
+			printf("encoding mismatch for %s\n  expected:", enc->text);
+			for (uint32_t j = 0; j < enc->len; j++)
+			{
+				printf(" %02X", enc->bytes[j]);
+			}
+			printf("\n  got:     ");
+			for (uint32_t j = 0; j < len; j++)
+			{
+				printf(" %02X", start[j]);
+			}
+			puts("");
+			failed++;
+		}
+	}
+	code->cur = start;
+	return failed;
+}
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+#define NUM_OPERANDS 4096
+//leaves room for the furthest branch target so it always falls inside the buffer
+#define BRANCH_RANGE 0x8000
+
+static uint8_t const data_regs[] = {RAX, RCX, RDX, RBX, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15};
+static uint8_t const base_regs[] = {RBP, RSI, RDI, R8, R9, R10, R11, R13, R14, R15};
+
+static void random_operands(operands *ops)
+{
+	for (uint32_t i = 0; i < NUM_OPERANDS; i++)
+	{
+		operands *op = ops + i;
+		op->size = rnd() % 4;
+		op->src = data_regs[rnd() % sizeof(data_regs)];
+		op->dst = data_regs[rnd() % sizeof(data_regs)];
+		op->cc = rnd() % (CC_G + 1);
+		//mostly small values, as in translated code
+		op->imm = rnd() % 4 ? (int8_t)rnd() : (int32_t)(rnd() << 8);
+		op->disp = rnd() % 4 ? rnd() % 128 : rnd() % 0x1000;
+		op->wide = rnd() % 4 ? (int64_t)(int32_t)(rnd() << 8) : (int64_t)rnd() << 24;
+	}
+}
+
+static void fixup_operands(operands *ops, uint8_t class)
+{
+	for (uint32_t i = 0; i < NUM_OPERANDS; i++)
+	{
+		operands *op = ops + i;
+		switch (class)
+		{
+		case CLASS_IRDISP:
+		case CLASS_BIT:
+		case CLASS_SETCC:
+			op->dst = base_regs[op->dst % sizeof(base_regs)];
+			break;
+		case CLASS_RDISPR:
+			op->src = base_regs[op->src % sizeof(base_regs)];
+			break;
+		case CLASS_RRDISP:
+			op->dst = base_regs[op->dst % sizeof(base_regs)];
+			break;
+		case CLASS_SHIFT:
+			op->imm &= op->size == SZ_Q ? 63 : 31;
+			break;
+		case CLASS_BRANCH:
+			op->disp %= BRANCH_RANGE;
+			break;
+		}
+		if (class == CLASS_BIT) {
+			op->imm &= 31;
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000000;
+	code_info code;
+	init_code_info(&code);
+	code_ptr start = code.cur;
+	int failed = check_encodings(&code);
+	if (failed) {
+		printf("%d of %d encodings did not match\n", failed, (int)(sizeof(expected)/sizeof(*expected)));
+	}
+
+	static operands ops[NUM_OPERANDS];
+	code_ptr limit = code.last - BRANCH_RANGE;
+	uint64_t total_bytes = 0, total_insts = 0;
+	double total_ns = 0;
+	printf("%-8s %12s %10s %8s\n", "class", "insts", "bytes/inst", "ns/inst");
+	for (uint8_t class = 0; class < NUM_CLASSES; class++)
+	{
+		random_operands(ops);
+		fixup_operands(ops, class);
+		uint64_t bytes = 0;
+		uint8_t variant = 0;
+		code.cur = start;
+		double begin = now();
+		for (uint32_t i = 0; i < iterations; i++)
+		{
+			if (code.cur > limit) {
+				bytes += code.cur - start;
+				code.cur = start;
+			}
+			emit(&code, class, variant, ops + (i & (NUM_OPERANDS-1)));
+			if (++variant == class_variants[class]) {
+				variant = 0;
+			}
+		}
+		double elapsed = now() - begin;
+		bytes += code.cur - start;
+		printf("%-8s %12u %10.2f %8.2f\n", class_names[class], iterations, (double)bytes / iterations, elapsed / iterations);
+		total_bytes += bytes;
+		total_insts += iterations;
+		total_ns += elapsed;
+	}
+	printf("%-8s %12llu %10.2f %8.2f\n", "all", (unsigned long long)total_insts, (double)total_bytes / total_insts, total_ns / total_insts);
+	return failed ? 1 : 0;
+}
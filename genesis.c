@@ -15,6 +15,7 @@
 #include "util.h"
 #include "debug.h"
 #include "gdb_remote.h"
+#include "hash.h"
 #define MCLKS_NTSC 53693175
 #define MCLKS_PAL  53203395
 
@@ -23,6 +24,9 @@ uint32_t MCLKS_PER_68K;
 #define MCLKS_PER_Z80 15
 #define MCLKS_PER_PSG (MCLKS_PER_Z80*16)
 #define Z80_INT_PULSE_MCLKS 2573 //measured value is ~171.5 Z80 clocks
+//TODO: This is an estimate based on the time between 68K !BG goes low and Z80 !MREQ goes high
+//      Needs a new logic analyzer capture to get the actual delay on the 68K side
+#define Z80_BANK_68K_DELAY (8 * MCLKS_PER_68K)
 #define DEFAULT_SYNC_INTERVAL MCLKS_LINE
 #define DEFAULT_LOWPASS_CUTOFF 3390
 
@@ -107,13 +111,18 @@ static void zram_deserialize(deserialize_buffer *buf, void *vgen)
 	z80_invalidate_code_range(gen->z80, 0, 0x4000);
 }
 
-static void update_z80_bank_pointer(genesis_context *gen)
+static uint8_t *z80_bank_pointer(genesis_context *gen)
 {
 	if (gen->z80->bank_reg < 0x100) {
-		gen->z80->mem_pointers[1] = get_native_pointer(gen->z80->bank_reg << 15, (void **)gen->m68k->mem_pointers, &gen->m68k->options->gen);
-	} else {
-		gen->z80->mem_pointers[1] = NULL;
+		return get_native_pointer(gen->z80->bank_reg << 15, (void **)gen->m68k->mem_pointers, &gen->m68k->options->gen);
 	}
+	return NULL;
+}
+
+static void update_z80_bank_pointer(genesis_context *gen)
+{
+	//while the 68K holds the bus, bank reads need to stall in z80_read_bank
+	gen->z80->mem_pointers[1] = gen->bus_busy ? NULL : z80_bank_pointer(gen);
 }
 
 static void bus_arbiter_deserialize(deserialize_buffer *buf, void *vgen)
@@ -248,7 +257,17 @@ static void sync_z80(z80_context * z_context, uint32_t mclks)
 {
 #ifndef NO_Z80
 	if (z80_enabled) {
+		genesis_context *gen = z_context->system;
+		if (gen->bus_busy) {
+			z_context->mem_pointers[1] = NULL;
+		}
 		z80_run(z_context, mclks);
+		//reads of the bank window that didn't go through z80_read_bank still held up the 68K
+		gen->m68k->current_cycle += z_context->bank_reads * Z80_BANK_68K_DELAY;
+		z_context->bank_reads = 0;
+		if (gen->bus_busy) {
+			z_context->mem_pointers[1] = z80_bank_pointer(gen);
+		}
 	} else
 #endif
 	{
@@ -605,9 +624,7 @@ static uint8_t z80_vdp_port_read(uint32_t vdp_port, void * vcontext)
 	//typical delay from bus arbitration
 	context->current_cycle += 3 * MCLKS_PER_Z80;
 	//TODO: add cycle for an access right after a previous one
-	//TODO: Below cycle time is an estimate based on the time between 68K !BG goes low and Z80 !MREQ goes high
-	//      Needs a new logic analyzer capture to get the actual delay on the 68K side
-	gen->m68k->current_cycle += 8 * MCLKS_PER_68K;
+	gen->m68k->current_cycle += Z80_BANK_68K_DELAY;
 
 
 	vdp_port &= 0x1F;
@@ -643,7 +660,8 @@ static m68k_context * io_write(uint32_t location, m68k_context * context, uint8_
 			if (location < 0x4000) {
 				gen->zram[location & 0x1FFF] = value;
 #ifndef NO_Z80
-				z80_handle_code_write(location & 0x1FFF, gen->z80);
+				//the Z80 can't run while the 68K has access to its RAM so invalidation can wait
+				z80_defer_code_write(gen->z80, location & 0x1FFF);
 #endif
 			} else if (location < 0x6000) {
 				sync_sound(gen, context->current_cycle);
@@ -656,11 +674,7 @@ static m68k_context * io_write(uint32_t location, m68k_context * context, uint8_
 				}
 			} else if (location == 0x6000) {
 				gen->z80->bank_reg = (gen->z80->bank_reg >> 1 | value << 8) & 0x1FF;
-				if (gen->z80->bank_reg < 0x80) {
-					gen->z80->mem_pointers[1] = (gen->z80->bank_reg << 15) + ((char *)gen->z80->mem_pointers[2]);
-				} else {
-					gen->z80->mem_pointers[1] = NULL;
-				}
+				update_z80_bank_pointer(gen);
 			} else {
 				fatal_error("68K write to unhandled Z80 address %X\n", location);
 			}
@@ -905,6 +919,18 @@ static uint8_t z80_read_ym(uint32_t location, void * vcontext)
 	return ym_read_status(gen->ym);
 }
 
+static uint32_t z80_idle_read_limit(z80_context * context, uint32_t address)
+{
+	if (address >= 0x4000 && address < 0x6000) {
+		//the YM hasn't been run since the last status read, so this is relative to that read
+		genesis_context * gen = context->system;
+		uint32_t limit = ym_status_stable_until(gen->ym);
+		return limit > context->current_cycle ? limit : context->current_cycle;
+	}
+	//bank area reads steal cycles from the 68K and the VDP ports can have side effects
+	return 0;
+}
+
 static uint8_t z80_read_bank(uint32_t location, void * vcontext)
 {
 	z80_context * context = vcontext;
@@ -915,13 +941,13 @@ static uint8_t z80_read_bank(uint32_t location, void * vcontext)
 	//typical delay from bus arbitration
 	context->current_cycle += 3 * MCLKS_PER_Z80;
 	//TODO: add cycle for an access right after a previous one
-	//TODO: Below cycle time is an estimate based on the time between 68K !BG goes low and Z80 !MREQ goes high
-	//      Needs a new logic analyzer capture to get the actual delay on the 68K side
-	gen->m68k->current_cycle += 8 * MCLKS_PER_68K;
+	gen->m68k->current_cycle += Z80_BANK_68K_DELAY;
 
 	location &= 0x7FFF;
-	if (context->mem_pointers[1]) {
-		return context->mem_pointers[1][location ^ 1];
+	//mem_pointers[1] is only cleared while the bus is busy or the bank isn't memory
+	uint8_t *bank = z80_bank_pointer(gen);
+	if (bank) {
+		return bank[location ^ 1];
 	}
 	uint32_t address = context->bank_reg << 15 | location;
 	if (address >= 0xC00000 && address < 0xE00000) {
@@ -942,9 +968,7 @@ static void *z80_write_bank(uint32_t location, void * vcontext, uint8_t value)
 	//typical delay from bus arbitration
 	context->current_cycle += 3 * MCLKS_PER_Z80;
 	//TODO: add cycle for an access right after a previous one
-	//TODO: Below cycle time is an estimate based on the time between 68K !BG goes low and Z80 !MREQ goes high
-	//      Needs a new logic analyzer capture to get the actual delay on the 68K side
-	gen->m68k->current_cycle += 8 * MCLKS_PER_68K;
+	gen->m68k->current_cycle += Z80_BANK_68K_DELAY;
 
 	location &= 0x7FFF;
 	uint32_t address = context->bank_reg << 15 | location;
@@ -1061,6 +1085,9 @@ static void start_genesis(system_header *system, char *statefile)
 	genesis_context *gen = (genesis_context *)system;
 	set_keybindings(&gen->io);
 	render_set_video_standard((gen->version_reg & HZ50) ? VID_PAL : VID_NTSC);
+	if (gen->trans_cache_path) {
+		m68k_load_trans_cache(gen->m68k, gen->trans_cache_path);
+	}
 	if (statefile) {
 		//first try loading as a native format savestate
 		deserialize_buffer state;
@@ -1180,6 +1207,7 @@ static void free_genesis(system_header *system)
 	psg_free(gen->psg);
 	free(gen->save_storage);
 	free(gen->header.save_dir);
+	free(gen->trans_cache_path);
 	free(gen->lock_on);
 	free(gen);
 }
@@ -1187,11 +1215,11 @@ static void free_genesis(system_header *system)
 genesis_context *alloc_init_genesis(rom_info *rom, void *main_rom, void *lock_on, uint32_t system_opts, uint8_t force_region)
 {
 	static memmap_chunk z80_map[] = {
-		{ 0x0000, 0x4000,  0x1FFF, 0, 0, MMAP_READ | MMAP_WRITE | MMAP_CODE, NULL, NULL, NULL, NULL,              NULL },
-		{ 0x8000, 0x10000, 0x7FFF, 0, 0, 0,                                  NULL, NULL, NULL, z80_read_bank,     z80_write_bank},
-		{ 0x4000, 0x6000,  0x0003, 0, 0, 0,                                  NULL, NULL, NULL, z80_read_ym,       z80_write_ym},
-		{ 0x6000, 0x6100,  0xFFFF, 0, 0, 0,                                  NULL, NULL, NULL, NULL,              z80_write_bank_reg},
-		{ 0x7F00, 0x8000,  0x00FF, 0, 0, 0,                                  NULL, NULL, NULL, z80_vdp_port_read, z80_vdp_port_write}
+		{ 0x0000, 0x4000,  0x1FFF, 0, 0, MMAP_READ | MMAP_WRITE | MMAP_CODE,                                          NULL, NULL, NULL, NULL,              NULL },
+		{ 0x8000, 0x10000, 0x7FFF, 0, 1, MMAP_READ | MMAP_PTR_IDX | MMAP_FUNC_NULL | MMAP_BYTESWAP | MMAP_ARBITRATED, NULL, NULL, NULL, z80_read_bank,     z80_write_bank },
+		{ 0x4000, 0x6000,  0x0003, 0, 0, 0,                                                                           NULL, NULL, NULL, z80_read_ym,       z80_write_ym },
+		{ 0x6000, 0x6100,  0xFFFF, 0, 0, 0,                                                                           NULL, NULL, NULL, NULL,              z80_write_bank_reg },
+		{ 0x7F00, 0x8000,  0x00FF, 0, 0, 0,                                                                           NULL, NULL, NULL, z80_vdp_port_read, z80_vdp_port_write }
 	};
 	genesis_context *gen = calloc(1, sizeof(genesis_context));
 	gen->header.set_speed_percent = set_speed_percent;
@@ -1217,6 +1245,7 @@ genesis_context *alloc_init_genesis(rom_info *rom, void *main_rom, void *lock_on
 	gen->max_cycles = config_cycles ? atoi(config_cycles) : DEFAULT_SYNC_INTERVAL;
 	gen->int_latency_prev1 = MCLKS_PER_68K * 32;
 	gen->int_latency_prev2 = MCLKS_PER_68K * 16;
+	uint8_t profile_code = !strcmp("on", tern_find_path_default(config, "system\0profile_code\0", (tern_val){.ptrval = "off"}, TVAL_PTR).ptrval);
 
 	char * lowpass_cutoff_str = tern_find_path(config, "audio\0lowpass_cutoff\0", TVAL_PTR).ptrval;
 	uint32_t lowpass_cutoff = lowpass_cutoff_str ? atoi(lowpass_cutoff_str) : DEFAULT_LOWPASS_CUTOFF;
@@ -1232,8 +1261,10 @@ genesis_context *alloc_init_genesis(rom_info *rom, void *main_rom, void *lock_on
 #ifndef NO_Z80
 	z80_options *z_opts = malloc(sizeof(z80_options));
 	init_z80_opts(z_opts, z80_map, 5, NULL, 0, MCLKS_PER_Z80, 0xFFFF);
+	z_opts->gen.profile.enabled = profile_code;
 	gen->z80 = init_z80_context(z_opts);
 	gen->z80->next_int_pulse = z80_next_int_pulse;
+	gen->z80->idle_read_limit = z80_idle_read_limit;
 	z80_assert_reset(gen->z80, 0);
 #else
 	gen->z80 = calloc(1, sizeof(z80_context));
@@ -1261,6 +1292,7 @@ genesis_context *alloc_init_genesis(rom_info *rom, void *main_rom, void *lock_on
 		{
 			gen->vdp->vdpmem[i] = rand();
 		}
+		vdp_invalidate_tile_cache(gen->vdp);
 		for (int i = 0; i < SAT_CACHE_SIZE; i++)
 		{
 			gen->vdp->sat_cache[i] = rand();
@@ -1274,6 +1306,9 @@ genesis_context *alloc_init_genesis(rom_info *rom, void *main_rom, void *lock_on
 			gen->vdp->vsram[i] = rand();
 		}
 	}
+	if (!strcmp("on", tern_find_path_default(config, "video\0vdp_render_thread\0", (tern_val){.ptrval = "off"}, TVAL_PTR).ptrval)) {
+		vdp_start_render_thread(gen->vdp);
+	}
 	setup_io_devices(config, rom, &gen->io);
 
 	gen->mapper_type = rom->mapper_type;
@@ -1304,6 +1339,7 @@ genesis_context *alloc_init_genesis(rom_info *rom, void *main_rom, void *lock_on
 
 	m68k_options *opts = malloc(sizeof(m68k_options));
 	init_m68k_opts(opts, rom->map, rom->map_chunks, MCLKS_PER_68K);
+	opts->gen.profile.enabled = profile_code;
 	//TODO: make this configurable
 	opts->gen.flags |= M68K_OPT_BROKEN_READ_MODIFY;
 	gen->m68k = init_68k_context(opts, NULL);
@@ -1329,6 +1365,29 @@ genesis_context *alloc_init_genesis(rom_info *rom, void *main_rom, void *lock_on
 	return gen;
 }
 
+static char *get_trans_cache_path(void *rom, uint32_t rom_size)
+{
+	char const *userdata = get_userdata_dir();
+	if (!userdata) {
+		return NULL;
+	}
+	char const *dir_parts[] = {userdata, PATH_SEP "blastem" PATH_SEP "transcache"};
+	char *cache_dir = alloc_concat_m(2, dir_parts);
+	if (!ensure_dir_exists(cache_dir)) {
+		warning("Failed to create translation cache directory %s\n", cache_dir);
+		free(cache_dir);
+		return NULL;
+	}
+	uint8_t raw_hash[20];
+	sha1(rom, rom_size, raw_hash);
+	uint8_t hex_hash[41];
+	bin_to_hex(hex_hash, raw_hash, 20);
+	char const *parts[] = {cache_dir, PATH_SEP, (char *)hex_hash, ".68k"};
+	char *path = alloc_concat_m(4, parts);
+	free(cache_dir);
+	return path;
+}
+
 genesis_context *alloc_config_genesis(void *rom, uint32_t rom_size, void *lock_on, uint32_t lock_on_size, uint32_t ym_opts, uint8_t force_region, rom_info *info_out)
 {
 	static memmap_chunk base_map[] = {
@@ -1348,6 +1407,10 @@ genesis_context *alloc_config_genesis(void *rom, uint32_t rom_size, void *lock_o
 	*info_out = configure_rom(rom_db, rom, rom_size, lock_on, lock_on_size, base_map, sizeof(base_map)/sizeof(base_map[0]));
 	rom = info_out->rom;
 	rom_size = info_out->rom_size;
+	char *trans_cache_path = NULL;
+	if (!lock_on && !strcmp("on", tern_find_path_default(config, "system\0translation_cache\0", (tern_val){.ptrval = "off"}, TVAL_PTR).ptrval)) {
+		trans_cache_path = get_trans_cache_path(rom, rom_size);
+	}
 #ifndef BLASTEM_BIG_ENDIAN
 	byteswap_rom(rom_size, rom);
 	if (lock_on) {
@@ -1362,5 +1425,7 @@ genesis_context *alloc_config_genesis(void *rom, uint32_t rom_size, void *lock_o
 	if (!MCLKS_PER_68K) {
 		MCLKS_PER_68K = 7;
 	}
-	return alloc_init_genesis(info_out, rom, lock_on, ym_opts, force_region);
+	genesis_context *gen = alloc_init_genesis(info_out, rom, lock_on, ym_opts, force_region);
+	gen->trans_cache_path = trans_cache_path;
+	return gen;
 }
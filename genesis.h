@@ -34,6 +34,7 @@ struct genesis_context {
 	void            *extra;
 	uint8_t         *save_storage;
 	void            *mapper_temp;
+	char            *trans_cache_path;
 	eeprom_map      *eeprom_map;
 	uint32_t        num_eeprom;
 	uint32_t        save_size;
@@ -0,0 +1,162 @@
+/*
+ Copyright 2013 Michael Pavone
+ This file is part of BlastEm.
+ BlastEm is free software distributed under the terms of the GNU General Public License version 3 or greater. See COPYING for full license text.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "m68k_core.h"
+#include "util.h"
+
+//util.c expects these to be provided by the frontend
+int headless = 1;
+void render_errorbox(char *title, char *message) {}
+void render_infobox(char *title, char *message) {}
+
+#define ROM_SIZE (1024*1024)
+#define RAM_BASE 0xFF0000
+#define BODY_START 0x200
+//cycles run between calls to sync_components
+#define SYNC_PERIOD 100000
+
+static uint16_t rom[ROM_SIZE/2];
+static uint16_t ram[0x8000];
+static uint32_t budget;
+
+m68k_context * sync_components(m68k_context * context, uint32_t address)
+{
+	if (context->current_cycle >= budget) {
+		context->should_return = 1;
+	}
+	context->sync_cycle = context->current_cycle + SYNC_PERIOD;
+	context->target_cycle = context->should_return ? context->current_cycle : context->sync_cycle;
+	return context;
+}
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+static uint32_t emit(uint32_t pc, uint16_t word)
+{
+	rom[pc/2] = word;
+	return pc + 2;
+}
+
+//Emits one instruction picked from a mix of the register, RAM and branch forms
+//that make up most game code. A0 points at RAM for the whole run
+static uint32_t emit_random(uint32_t pc)
+{
+	uint16_t dx = (rnd() & 7) << 9, dy = rnd() & 7;
+	switch (rnd() % 16)
+	{
+	case 0: return emit(pc, 0xD080 | dx | dy); //add.l Dy, Dx
+	case 1: return emit(pc, 0x9080 | dx | dy); //sub.l Dy, Dx
+	case 2: return emit(pc, 0xC080 | dx | dy); //and.l Dy, Dx
+	case 3: return emit(pc, 0x8080 | dx | dy); //or.l Dy, Dx
+	case 4: return emit(pc, 0xB180 | dx | dy); //eor.l Dx, Dy
+	case 5: return emit(pc, 0xB080 | dx | dy); //cmp.l Dy, Dx
+	case 6: return emit(pc, 0x2000 | dx | dy); //move.l Dy, Dx
+	case 7: return emit(pc, 0x5080 | dx | dy); //addq.l #q, Dy
+	case 8: return emit(pc, 0x5180 | dx | dy); //subq.l #q, Dy
+	case 9: return emit(pc, 0x7000 | dx | (rnd() & 0xFF)); //moveq #imm, Dx
+	case 10: return emit(pc, 0xE188 | dx | dy); //lsl.l #q, Dy
+	case 11: return emit(pc, 0xE088 | dx | dy); //lsr.l #q, Dy
+	case 12: return emit(pc, 0x4840 | dy); //swap Dy
+	case 13:
+		//move.w Dy, d16(A0)
+		pc = emit(pc, 0x3140 | dy);
+		return emit(pc, rnd() & 0x7FFE);
+	case 14:
+		//move.w d16(A0), Dx
+		pc = emit(pc, 0x3028 | dx);
+		return emit(pc, rnd() & 0x7FFE);
+	default:
+		//tst.l Dy, then a bne.s that skips the next instruction
+		pc = emit(pc, 0x4A80 | dy);
+		pc = emit(pc, 0x6602);
+		return emit(pc, 0x5280 | dy); //addq.l #1, Dy
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t num_insts = argc > 1 ? strtoul(argv[1], NULL, 0) : 4096;
+	uint32_t passes = argc > 2 ? strtoul(argv[2], NULL, 0) : 10000;
+	uint32_t reps = argc > 3 ? strtoul(argv[3], NULL, 0) : 5;
+	if (num_insts > (ROM_SIZE - BODY_START) / 8) {
+		fatal_error("%u instructions don't fit in ROM\n", num_insts);
+	}
+	if ((uint64_t)passes * num_insts * 6 * 7 > 0xF0000000) {
+		fatal_error("%u passes over %u instructions would overflow the cycle counter\n", passes, num_insts);
+	}
+	//reset vectors
+	rom[0] = 0x0100;
+	rom[1] = 0x0000;
+	rom[2] = BODY_START >> 16;
+	rom[3] = BODY_START;
+	uint32_t pc = BODY_START;
+	//lea RAM_BASE, A0
+	pc = emit(pc, 0x41F9);
+	pc = emit(pc, RAM_BASE >> 16);
+	pc = emit(pc, RAM_BASE & 0xFFFF);
+	uint32_t loop = pc;
+	for (uint32_t i = 0; i < num_insts; i++)
+	{
+		pc = emit_random(pc);
+	}
+	//jmp loop
+	pc = emit(pc, 0x4EF9);
+	pc = emit(pc, loop >> 16);
+	pc = emit(pc, loop);
+	uint32_t body_size = pc - loop;
+
+	memmap_chunk map[] = {
+		{0, ROM_SIZE, ROM_SIZE-1, 0, 0, MMAP_READ, rom, NULL, NULL, NULL, NULL},
+		{RAM_BASE, 0x1000000, 0xFFFF, 0, 0, MMAP_READ | MMAP_WRITE | MMAP_CODE, ram, NULL, NULL, NULL, NULL},
+	};
+	m68k_options opts;
+	init_m68k_opts(&opts, map, sizeof(map)/sizeof(*map), 7);
+	m68k_context *context = init_68k_context(&opts, NULL);
+	context->int_cycle = CYCLE_NEVER;
+
+	//a first short run goes around the loop at least once so the timed run only executes
+	budget = num_insts * 100;
+	context->sync_cycle = context->target_cycle = SYNC_PERIOD;
+	code_ptr hot_start = opts.gen.code.cur;
+	m68k_reset(context);
+	uint32_t hot_bytes = opts.gen.code.cur - hot_start;
+	printf("68K body:    %u instructions, %u bytes\n", num_insts + 1, body_size);
+	printf("native code: %u bytes, %.2f bytes/inst, %u cache lines\n", hot_bytes, (double)hot_bytes / (num_insts + 1), (hot_bytes + 63) / 64);
+
+	//the body averages about 6 68K cycles per instruction, so this is roughly passes trips around it
+	budget = passes * num_insts * 6 * 7;
+	double best = 0;
+	uint32_t cycles = 0;
+	for (uint32_t i = 0; i < reps; i++)
+	{
+		context->current_cycle = 0;
+		context->sync_cycle = context->target_cycle = SYNC_PERIOD;
+		double begin = now();
+		resume_68k(context);
+		double elapsed = now() - begin;
+		if (!i || elapsed < best) {
+			best = elapsed;
+		}
+		cycles = context->current_cycle / 7;
+	}
+	printf("run:         best of %u %.3f s for %u 68K cycles, %.3f ns/cycle\n", reps, best / 1e9, cycles, best / cycles);
+	return 0;
+}
@@ -227,8 +227,7 @@ static void translate_m68k_jmp_jsr(m68k_options * opts, m68kinst * inst)
 			push_const(opts, inst->address+2);
 		}
 		areg_to_native(opts, inst->src.params.regs.pri, opts->gen.scratch1);
-		call(code, opts->native_addr);
-		jmp_r(code, opts->gen.scratch1);
+		jump_m68k_indirect(opts);
 		break;
 	case MODE_AREG_DISPLACE:
 		cycles(&opts->gen, BUS*2);
@@ -236,8 +235,7 @@ static void translate_m68k_jmp_jsr(m68k_options * opts, m68kinst * inst)
 			push_const(opts, inst->address+4);
 		}
 		calc_areg_displace(opts, &inst->src, opts->gen.scratch1);
-		call(code, opts->native_addr);
-		jmp_r(code, opts->gen.scratch1);
+		jump_m68k_indirect(opts);
 		break;
 	case MODE_AREG_INDEX_DISP8:
 		cycles(&opts->gen, BUS*3);//TODO: CHeck that this is correct
@@ -245,8 +243,7 @@ static void translate_m68k_jmp_jsr(m68k_options * opts, m68kinst * inst)
 			push_const(opts, inst->address+4);
 		}
 		calc_areg_index_disp8(opts, &inst->src, opts->gen.scratch1);
-		call(code, opts->native_addr);
-		jmp_r(code, opts->gen.scratch1);
+		jump_m68k_indirect(opts);
 		break;
 	case MODE_PC_DISPLACE:
 		//TODO: Add cycles in the right place relative to pushing the return address on the stack
@@ -263,8 +260,7 @@ static void translate_m68k_jmp_jsr(m68k_options * opts, m68kinst * inst)
 		}
 		ldi_native(opts, inst->address+2, opts->gen.scratch1);
 		calc_index_disp8(opts, &inst->src, opts->gen.scratch1);
-		call(code, opts->native_addr);
-		jmp_r(code, opts->gen.scratch1);
+		jump_m68k_indirect(opts);
 		break;
 	case MODE_ABSOLUTE:
 	case MODE_ABSOLUTE_SHORT:
@@ -316,8 +312,7 @@ static void translate_m68k_rts(m68k_options * opts, m68kinst * inst)
 	addi_areg(opts, 4, 7);
 	call(code, opts->read_32);
 	cycles(&opts->gen, 2*BUS);
-	call(code, opts->native_addr);
-	jmp_r(code, opts->gen.scratch1);
+	jump_m68k_return(opts);
 }
 
 static void translate_m68k_rtr(m68k_options *opts, m68kinst * inst)
@@ -333,8 +328,7 @@ static void translate_m68k_rtr(m68k_options *opts, m68kinst * inst)
 	call(code, opts->read_32);
 	addi_areg(opts, 4, 7);
 	//Get native address and jump to it
-	call(code, opts->native_addr);
-	jmp_r(code, opts->gen.scratch1);
+	jump_m68k_return(opts);
 }
 
 static void translate_m68k_trap(m68k_options *opts, m68kinst *inst)
@@ -641,8 +635,6 @@ static void translate_m68k_rte(m68k_options *opts, m68kinst *inst)
 
 code_ptr get_native_address(m68k_options *opts, uint32_t address)
 {
-	native_map_slot * native_code_map = opts->gen.native_code_map;
-	
 	memmap_chunk const *mem_chunk = find_map_chunk(address, &opts->gen, 0, NULL);
 	if (mem_chunk) {
 		//calculate the lowest alias for this address
@@ -650,15 +642,7 @@ code_ptr get_native_address(m68k_options *opts, uint32_t address)
 	} else {
 		address &= opts->gen.address_mask;
 	}
-	uint32_t chunk = address / NATIVE_CHUNK_SIZE;
-	if (!native_code_map[chunk].base) {
-		return NULL;
-	}
-	uint32_t offset = address % NATIVE_CHUNK_SIZE;
-	if (native_code_map[chunk].offsets[offset] == INVALID_OFFSET || native_code_map[chunk].offsets[offset] == EXTENSION_WORD) {
-		return NULL;
-	}
-	return native_code_map[chunk].base + native_code_map[chunk].offsets[offset];
+	return native_map_lookup(&opts->gen.native_code_map, address);
 }
 
 code_ptr get_native_from_context(m68k_context * context, uint32_t address)
@@ -668,7 +652,6 @@ code_ptr get_native_from_context(m68k_context * context, uint32_t address)
 
 uint32_t get_instruction_start(m68k_options *opts, uint32_t address)
 {
-	native_map_slot * native_code_map = opts->gen.native_code_map;
 	memmap_chunk const *mem_chunk = find_map_chunk(address, &opts->gen, 0, NULL);
 	if (mem_chunk) {
 		//calculate the lowest alias for this address
@@ -677,19 +660,14 @@ uint32_t get_instruction_start(m68k_options *opts, uint32_t address)
 		address &= opts->gen.address_mask;
 	}
 	
-	uint32_t chunk = address / NATIVE_CHUNK_SIZE;
-	if (!native_code_map[chunk].base) {
-		return 0;
-	}
-	uint32_t offset = address % NATIVE_CHUNK_SIZE;
-	if (native_code_map[chunk].offsets[offset] == INVALID_OFFSET) {
+	uint32_t offset = native_map_offset(&opts->gen.native_code_map, address);
+	if (offset == INVALID_OFFSET) {
 		return 0;
 	}
-	while (native_code_map[chunk].offsets[offset] == EXTENSION_WORD)
+	while (offset == EXTENSION_WORD)
 	{
 		--address;
-		chunk = address / NATIVE_CHUNK_SIZE;
-		offset = address % NATIVE_CHUNK_SIZE;
+		offset = native_map_offset(&opts->gen.native_code_map, address);
 	}
 	return address;
 }
@@ -697,15 +675,12 @@ uint32_t get_instruction_start(m68k_options *opts, uint32_t address)
 static void map_native_address(m68k_context * context, uint32_t address, code_ptr native_addr, uint8_t size, uint8_t native_size)
 {
 	m68k_options * opts = context->options;
-	native_map_slot * native_code_map = opts->gen.native_code_map;
 	uint32_t meta_off;
 	memmap_chunk const *mem_chunk = find_map_chunk(address, &opts->gen, MMAP_CODE, &meta_off);
 	if (mem_chunk) {
 		if (mem_chunk->flags & MMAP_CODE) {
 			uint32_t masked = (address - mem_chunk->start) & mem_chunk->mask;
 			uint32_t final_off = masked + meta_off;
-			uint32_t ram_flags_off = final_off >> (opts->gen.ram_flags_shift + 3);
-			context->ram_code_flags[ram_flags_off] |= 1 << ((final_off >> opts->gen.ram_flags_shift) & 7);
 
 			uint32_t slot = final_off / 1024;
 			if (!opts->gen.ram_inst_sizes[slot]) {
@@ -713,11 +688,23 @@ static void map_native_address(m68k_context * context, uint32_t address, code_pt
 			}
 			opts->gen.ram_inst_sizes[slot][(final_off/2) & 511] = native_size;
 
+			//flag every word of the instruction and keep a copy of it so writes that
+			//don't actually change anything can be ignored
 			//TODO: Deal with case in which end of instruction is in a different memory chunk
-			masked = (address + size - 1) & mem_chunk->mask;
-			final_off = masked + meta_off;
-			ram_flags_off = final_off >> (opts->gen.ram_flags_shift + 3);
-			context->ram_code_flags[ram_flags_off] |= 1 << ((final_off >> opts->gen.ram_flags_shift) & 7);
+			for (uint32_t cur = address; cur < address + size; cur += 2)
+			{
+				final_off = ((cur - mem_chunk->start) & mem_chunk->mask) + meta_off;
+				uint32_t ram_flags_off = final_off >> (opts->gen.ram_flags_shift + 3);
+				context->ram_code_flags[ram_flags_off] |= 1 << ((final_off >> opts->gen.ram_flags_shift) & 7);
+				uint16_t *word = get_native_pointer(cur, (void **)context->mem_pointers, &opts->gen);
+				if (word) {
+					slot = final_off / 1024;
+					if (!opts->ram_code_copy[slot]) {
+						opts->ram_code_copy[slot] = malloc(sizeof(uint16_t) * 512);
+					}
+					opts->ram_code_copy[slot][(final_off/2) & 511] = *word;
+				}
+			}
 		}
 		//calculate the lowest alias for this address
 		address = mem_chunk->start + ((address - mem_chunk->start) & mem_chunk->mask);
@@ -725,27 +712,11 @@ static void map_native_address(m68k_context * context, uint32_t address, code_pt
 		address &= opts->gen.address_mask;
 	}
 	
-	uint32_t chunk = address / NATIVE_CHUNK_SIZE;
-	if (!native_code_map[chunk].base) {
-		native_code_map[chunk].base = native_addr;
-		native_code_map[chunk].offsets = malloc(sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-		memset(native_code_map[chunk].offsets, 0xFF, sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-	}
-	uint32_t offset = address % NATIVE_CHUNK_SIZE;
-	native_code_map[chunk].offsets[offset] = native_addr-native_code_map[chunk].base;
+	native_map_set(&opts->gen.native_code_map, address, native_addr);
 	for(address++,size-=1; size; address++,size-=1) {
 		address &= opts->gen.address_mask;
-		chunk = address / NATIVE_CHUNK_SIZE;
-		offset = address % NATIVE_CHUNK_SIZE;
-		if (!native_code_map[chunk].base) {
-			native_code_map[chunk].base = native_addr;
-			native_code_map[chunk].offsets = malloc(sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-			memset(native_code_map[chunk].offsets, 0xFF, sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-		}
-		if (native_code_map[chunk].offsets[offset] == INVALID_OFFSET) {
-			//TODO: Better handling of overlapping instructions
-			native_code_map[chunk].offsets[offset] = EXTENSION_WORD;
-		}
+		//TODO: Better handling of overlapping instructions
+		native_map_set_extension(&opts->gen.native_code_map, address);
 	}
 }
 
@@ -760,6 +731,46 @@ static uint8_t get_native_inst_size(m68k_options * opts, uint32_t address)
 	return opts->gen.ram_inst_sizes[slot][(meta_off/2)%512];
 }
 
+uint8_t m68k_code_word_changed(m68k_context *context, uint32_t address)
+{
+	m68k_options *opts = context->options;
+	address &= ~1;
+	uint32_t meta_off;
+	memmap_chunk const *chunk = find_map_chunk(address, &opts->gen, MMAP_CODE, &meta_off);
+	if (!chunk || !(chunk->flags & MMAP_CODE)) {
+		return 1;
+	}
+	meta_off += (address - chunk->start) & chunk->mask;
+	uint16_t *copy = opts->ram_code_copy[meta_off/1024];
+	uint16_t *word = get_native_pointer(address, (void **)context->mem_pointers, &opts->gen);
+	return !copy || !word || copy[(meta_off/2) & 511] != *word;
+}
+
+uint32_t m68k_inst_end(m68k_options *opts, uint32_t inst_start)
+{
+	uint32_t address = inst_start + 1;
+	while (native_map_offset(&opts->gen.native_code_map, address & opts->gen.address_mask) == EXTENSION_WORD)
+	{
+		address++;
+	}
+	//extension words are not recorded where a later translation overlaps this instruction
+	//so decode the copy of it as well
+	uint32_t meta_off;
+	memmap_chunk const *chunk = find_map_chunk(inst_start, &opts->gen, MMAP_CODE, &meta_off);
+	if (!chunk || !(chunk->flags & MMAP_CODE)) {
+		return inst_start + M68K_MAX_INST_SIZE;
+	}
+	meta_off += (inst_start - chunk->start) & chunk->mask;
+	uint16_t *copy = opts->ram_code_copy[meta_off/1024];
+	uint32_t word_off = (meta_off/2) & 511;
+	if (!copy || word_off + M68K_MAX_INST_SIZE/2 > 512) {
+		return inst_start + M68K_MAX_INST_SIZE;
+	}
+	m68kinst instbuf;
+	uint32_t decoded_end = inst_start + (m68k_decode(copy + word_off, &instbuf, inst_start) - (copy + word_off)) * 2;
+	return decoded_end > address ? decoded_end : address;
+}
+
 uint8_t m68k_is_terminal(m68kinst * inst)
 {
 	return inst->op == M68K_RTS || inst->op == M68K_RTE || inst->op == M68K_RTR || inst->op == M68K_JMP
@@ -787,6 +798,40 @@ uint16_t m68k_get_ir(m68k_context *context)
 	return 0xFFFF;
 }
 
+//Code in fixed, read-only areas is never invalidated or retranslated
+//RAM and bank-switched areas can hold different code from one session to the next
+static uint8_t is_fixed_rom(m68k_options *opts, uint32_t address)
+{
+	memmap_chunk const *chunk = find_map_chunk(address, &opts->gen, 0, NULL);
+	return chunk && chunk->buffer
+		&& (chunk->flags & (MMAP_READ | MMAP_WRITE | MMAP_CODE | MMAP_PTR_IDX | MMAP_ONLY_ODD | MMAP_ONLY_EVEN)) == MMAP_READ;
+}
+
+//Gives an instruction that was translated as part of a group its own entry point
+//by translating the group again. The groups are only formed in fixed ROM so
+//the old translation can safely be redirected to the new one
+static void m68k_split_group(m68k_context *context, uint32_t address)
+{
+	m68k_options *opts = context->options;
+	uint32_t inst_start = get_instruction_start(opts, address);
+	if (!inst_start || inst_start == address || !is_fixed_rom(opts, inst_start)) {
+		return;
+	}
+	m68kinst instbuf;
+	uint16_t *encoded = get_native_pointer(inst_start, (void **)context->mem_pointers, &opts->gen);
+	if (!encoded || inst_start + (m68k_decode(encoded, &instbuf, inst_start) - encoded) * 2 > address) {
+		//address is inside a normal instruction
+		return;
+	}
+	code_ptr old_native = get_native_address(opts, inst_start);
+	memmap_chunk const *mem_chunk = find_map_chunk(inst_start, &opts->gen, 0, NULL);
+	inst_start = mem_chunk->start + ((inst_start - mem_chunk->start) & mem_chunk->mask);
+	native_map_clear(&opts->gen.native_code_map, inst_start);
+	translate_m68k_stream(inst_start, context);
+	code_info code = {old_native, old_native + 16, 0};
+	jmp(&code, get_native_address(opts, inst_start));
+}
+
 static m68k_debug_handler find_breakpoint(m68k_context *context, uint32_t address)
 {
 	for (uint32_t i = 0; i < context->num_breakpoints; i++)
@@ -812,6 +857,7 @@ void insert_breakpoint(m68k_context * context, uint32_t address, m68k_debug_hand
 			.handler = bp_handler,
 			.address = address
 		};
+		m68k_split_group(context, address);
 		m68k_breakpoint_patch(context, address, bp_handler, NULL);
 	}
 }
@@ -945,7 +991,7 @@ static impl_info m68k_impls[] = {
 	RAW_IMPL(M68K_TAS, translate_m68k_tas),
 };
 
-static void translate_m68k(m68k_context *context, m68kinst * inst)
+static void translate_m68k(m68k_context *context, m68kinst * inst, m68kinst *flags_from, uint8_t nzvc_dead)
 {
 	m68k_options * opts = context->options;
 	if (inst->address & 1) {
@@ -953,7 +999,12 @@ static void translate_m68k(m68k_context *context, m68kinst * inst)
 		return;
 	}
 	code_ptr start = opts->gen.code.cur;
-	check_cycles_int(&opts->gen, inst->address);
+	if (flags_from) {
+		m68k_check_cycles_int_flags(opts, inst->address, flags_from);
+	} else {
+		check_cycles_int(&opts->gen, inst->address);
+	}
+	opts->nzvc_dead = nzvc_dead;
 	
 	m68k_debug_handler bp;
 	if ((bp = find_breakpoint(context, inst->address))) {
@@ -972,6 +1023,7 @@ static void translate_m68k(m68k_context *context, m68kinst * inst)
 	impl_info * info = m68k_impls + inst->op;
 	if (info->itype == RAW_FUNC) {
 		info->impl.raw(opts, inst);
+		opts->nzvc_dead = 0;
 		return;
 	}
 
@@ -996,12 +1048,345 @@ static void translate_m68k(m68k_context *context, m68kinst * inst)
 		m68k_disasm(inst, disasm_buf);
 		fatal_error("%X: %s\ninstruction %d not yet implemented\n", inst->address, disasm_buf, inst->op);
 	}
+	opts->nzvc_dead = 0;
 	if (opts->gen.code.stack_off) {
 		m68k_disasm(inst, disasm_buf);
 		fatal_error("Stack offset is %X after %X: %s\n", opts->gen.code.stack_off, inst->address, disasm_buf);
 	}
 }
 
+//Returns the data register operand that N and Z are derived from for instructions
+//that set those flags based on their result and clear V and C
+static m68k_op_info *nzvc_source(m68kinst *inst)
+{
+	switch (inst->op)
+	{
+	case M68K_MOVE:
+	case M68K_AND:
+	case M68K_OR:
+	case M68K_EOR:
+	case M68K_NOT:
+	case M68K_CLR:
+	case M68K_EXT:
+	case M68K_MULS:
+	case M68K_MULU:
+		return inst->dst.addr_mode == MODE_REG ? &inst->dst : NULL;
+	case M68K_TST:
+	case M68K_SWAP:
+		return inst->src.addr_mode == MODE_REG ? &inst->src : NULL;
+	default:
+		return NULL;
+	}
+}
+
+static uint8_t is_reg_or_immed(m68k_op_info *op)
+{
+	return op->addr_mode == MODE_REG || op->addr_mode == MODE_AREG || op->addr_mode == MODE_IMMEDIATE
+		|| op->addr_mode == MODE_IMMEDIATE_WORD || op->addr_mode == MODE_UNUSED;
+}
+
+//Instructions that write all of N, Z, V and C without reading any flags first
+//and that cannot take an exception or touch memory before doing so
+static uint8_t overwrites_nzvc(m68kinst *inst)
+{
+	switch (inst->op)
+	{
+	case M68K_MOVE:
+	case M68K_ADD:
+	case M68K_SUB:
+		if (inst->dst.addr_mode == MODE_AREG) {
+			return 0;
+		}
+		break;
+	case M68K_AND:
+	case M68K_OR:
+	case M68K_EOR:
+	case M68K_CMP:
+	case M68K_NOT:
+	case M68K_NEG:
+	case M68K_CLR:
+	case M68K_TST:
+	case M68K_EXT:
+	case M68K_SWAP:
+	case M68K_MULS:
+	case M68K_MULU:
+		break;
+	default:
+		return 0;
+	}
+	return is_reg_or_immed(&inst->src) && is_reg_or_immed(&inst->dst);
+}
+
+//Gets the destination of an unconditional branch or jump that can be resolved at translation time
+static uint8_t m68k_static_branch(m68kinst *inst, uint32_t *target)
+{
+	switch (inst->op)
+	{
+	case M68K_BCC:
+		if (inst->extra.cond != COND_TRUE) {
+			return 0;
+		}
+		//fallthrough
+	case M68K_BSR:
+		*target = inst->address + 2 + inst->src.params.immed;
+		return 1;
+	case M68K_JMP:
+	case M68K_JSR:
+		if (inst->src.addr_mode == MODE_PC_DISPLACE) {
+			*target = inst->address + 2 + inst->src.params.regs.displacement;
+			return 1;
+		}
+		if (inst->src.addr_mode == MODE_ABSOLUTE || inst->src.addr_mode == MODE_ABSOLUTE_SHORT) {
+			*target = inst->src.params.immed;
+			return 1;
+		}
+		break;
+	}
+	return 0;
+}
+
+//Checks whether the N, Z, V and C results of inst are dead because the instruction at next
+//overwrites them. When they are, inst skips its flag update and next is translated right after
+//it with a prologue that recalculates the flags if an interrupt or sync needs them. That copy
+//of next can only be entered from inst so it is not given an entry in the native map
+static uint8_t m68k_nzvc_dead(m68k_context *context, m68kinst *inst, uint32_t next, uint8_t group_size)
+{
+	m68k_options *opts = context->options;
+	if (!nzvc_source(inst) || (next & 1) || group_size > 64 || !is_fixed_rom(opts, inst->address) || !is_fixed_rom(opts, next)) {
+		return 0;
+	}
+	if (get_native_address(opts, next) || find_breakpoint(context, next)) {
+		return 0;
+	}
+	uint16_t *encoded = get_native_pointer(next, (void **)context->mem_pointers, &opts->gen);
+	if (!encoded) {
+		return 0;
+	}
+	m68kinst nextbuf;
+	m68k_decode(encoded, &nextbuf, next);
+	return overwrites_nzvc(&nextbuf);
+}
+
+//Bytes of each data register an idle loop body has written so far in the current pass,
+//writes anywhere in the body and the lowest byte read before it was written in a pass
+typedef struct {
+	uint8_t written[8];
+	uint8_t write_max[8];
+	uint8_t carried[8];
+} idle_dregs;
+
+static void idle_read_dreg(idle_dregs *regs, uint8_t reg, uint8_t bytes)
+{
+	if (bytes > regs->written[reg] && regs->written[reg] < regs->carried[reg]) {
+		regs->carried[reg] = regs->written[reg];
+	}
+}
+
+static void idle_write_dreg(idle_dregs *regs, uint8_t reg, uint8_t bytes)
+{
+	if (bytes > regs->written[reg]) {
+		regs->written[reg] = bytes;
+	}
+	if (bytes > regs->write_max[reg]) {
+		regs->write_max[reg] = bytes;
+	}
+}
+
+static uint8_t m68k_idle_read_stable(m68k_context *context, uint32_t address)
+{
+	memmap_chunk const *chunk = find_map_chunk(address, &context->options->gen, 0, NULL);
+	if (!chunk || !(chunk->flags & MMAP_READ)) {
+		return 0;
+	}
+	return !(chunk->flags & MMAP_PTR_IDX && chunk->flags & MMAP_FUNC_NULL) || context->mem_pointers[chunk->ptr_index];
+}
+
+//Records the data registers read by an operand of an idle loop body instruction.
+//If check_reads is set, the memory it reads is resolved with the current register
+//values and must not go through a handler. Returns 0 for modes with side effects
+static uint8_t m68k_idle_operand(m68k_context *context, m68kinst *inst, m68k_op_info *op, uint8_t bytes, idle_dregs *regs, uint8_t check_reads)
+{
+	uint32_t address, index = 0;
+	switch (op->addr_mode)
+	{
+	case MODE_REG:
+		idle_read_dreg(regs, op->params.regs.pri, bytes);
+		return 1;
+	case MODE_AREG:
+	case MODE_IMMEDIATE:
+	case MODE_IMMEDIATE_WORD:
+	case MODE_UNUSED:
+		return 1;
+	case MODE_AREG_INDEX_DISP8:
+	case MODE_PC_INDEX_DISP8: {
+		uint8_t sec_reg = (op->params.regs.sec >> 1) & 0x7;
+		if (op->params.regs.sec & 0x10) {
+			index = context->aregs[sec_reg];
+		} else {
+			index = context->dregs[sec_reg];
+			//the runtime check uses the register value at the end of a pass
+			regs->carried[sec_reg] = 0;
+		}
+		if (!(op->params.regs.sec & 1)) {
+			index = (int16_t)index;
+		}
+		address = index + op->params.regs.displacement;
+		address += op->addr_mode == MODE_PC_INDEX_DISP8 ? inst->address + 2 : context->aregs[op->params.regs.pri];
+		break;
+	}
+	case MODE_AREG_INDIRECT:
+		address = context->aregs[op->params.regs.pri];
+		break;
+	case MODE_AREG_DISPLACE:
+		address = context->aregs[op->params.regs.pri] + op->params.regs.displacement;
+		break;
+	case MODE_PC_DISPLACE:
+		address = inst->address + 2 + op->params.regs.displacement;
+		break;
+	case MODE_ABSOLUTE:
+	case MODE_ABSOLUTE_SHORT:
+		address = op->params.immed;
+		break;
+	default:
+		return 0;
+	}
+	if (!check_reads) {
+		return 1;
+	}
+	if (bytes > 1 && (address & 1)) {
+		//address error
+		return 0;
+	}
+	return m68k_idle_read_stable(context, address) && m68k_idle_read_stable(context, address + bytes - 1);
+}
+
+//Checks a single instruction of an idle loop body. Only instructions that read
+//memory and registers and write nothing but data registers and flags are accepted
+static uint8_t m68k_idle_inst(m68k_context *context, m68kinst *inst, idle_dregs *regs, uint8_t check_reads)
+{
+	uint8_t bytes = 1 << inst->extra.size;
+	switch (inst->op)
+	{
+	case M68K_NOP:
+		return 1;
+	case M68K_TST:
+		return m68k_idle_operand(context, inst, &inst->src, bytes, regs, check_reads);
+	case M68K_CMP:
+		return m68k_idle_operand(context, inst, &inst->src, bytes, regs, check_reads)
+			&& m68k_idle_operand(context, inst, &inst->dst, bytes, regs, check_reads);
+	case M68K_BTST:
+		//bit numbers are taken modulo 32 or 8 so only the low byte of a register is used
+		return m68k_idle_operand(context, inst, &inst->src, 1, regs, check_reads)
+			&& m68k_idle_operand(context, inst, &inst->dst, inst->dst.addr_mode == MODE_REG ? 4 : 1, regs, check_reads);
+	case M68K_MOVE:
+	case M68K_AND:
+	case M68K_OR:
+	case M68K_EOR:
+		if (inst->dst.addr_mode != MODE_REG || !m68k_idle_operand(context, inst, &inst->src, bytes, regs, check_reads)) {
+			return 0;
+		}
+		if (inst->op != M68K_MOVE) {
+			idle_read_dreg(regs, inst->dst.params.regs.pri, bytes);
+		}
+		idle_write_dreg(regs, inst->dst.params.regs.pri, bytes);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+//Checks that the Bcc at branch closes a short straight-line loop that only reads
+//memory and leaves the same state behind on every pass apart from the cycle count.
+//If check_reads is set, the memory reads are resolved with the current register values
+static uint8_t m68k_is_idle_loop(m68k_context *context, m68kinst *branch, uint8_t check_reads)
+{
+	m68k_options *opts = context->options;
+	if (branch->op != M68K_BCC || branch->extra.cond == COND_FALSE) {
+		return 0;
+	}
+	uint32_t end = branch->address;
+	uint32_t head = end + 2 + branch->src.params.immed;
+	if ((head & 1) || head > end || end - head > M68K_IDLE_LOOP_BYTES) {
+		return 0;
+	}
+	uint16_t *encoded = get_native_pointer(head, (void **)context->mem_pointers, &opts->gen);
+	if (!encoded || get_native_pointer(end, (void **)context->mem_pointers, &opts->gen) != encoded + (end - head) / 2) {
+		return 0;
+	}
+	idle_dregs regs;
+	memset(&regs, 0, sizeof(regs));
+	memset(regs.carried, 4, sizeof(regs.carried));
+	uint32_t address = head;
+	for (;;)
+	{
+		if (find_breakpoint(context, address)) {
+			return 0;
+		}
+		if (address == end) {
+			break;
+		}
+		m68kinst inst;
+		uint16_t *after = m68k_decode(encoded + (address - head) / 2, &inst, address);
+		address = head + (after - encoded) * 2;
+		if (address > end || !m68k_idle_inst(context, &inst, &regs, check_reads)) {
+			return 0;
+		}
+	}
+	//a register byte the body reads before writing it is an input to every pass, so
+	//no instruction may write that byte or the passes would no longer be identical
+	for (int i = 0; i < 8; i++)
+	{
+		if (regs.write_max[i] > regs.carried[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//Called through opts->idle_loop each time the Bcc at branch is taken. Two consecutive
+//calls for the same Bcc give the length of one iteration in 68K cycles, current_cycle
+//is then moved forward by whole iterations as long as it stays below target_cycle,
+//which is where the next interrupt or sync has to be handled
+void m68k_idle_loop(m68k_context *context, uint32_t branch)
+{
+	if (context->idle_branch != branch) {
+		context->idle_branch = branch;
+		context->idle_cycle = context->current_cycle;
+		return;
+	}
+	uint32_t period = context->current_cycle - context->idle_cycle;
+	context->idle_cycle = context->current_cycle;
+	//translation only checked the instructions, the memory they read depends on the
+	//address registers at this point and the body may be in RAM that has changed
+	m68k_options *opts = context->options;
+	uint16_t *encoded = get_native_pointer(branch, (void **)context->mem_pointers, &opts->gen);
+	m68kinst inst;
+	if (encoded) {
+		m68k_decode(encoded, &inst, branch);
+	}
+	if (!encoded || !m68k_is_idle_loop(context, &inst, 1)) {
+		//the code emitted by m68k_idle_check stops calling here until the Bcc falls through
+		context->idle_branch = branch | IDLE_BRANCH_REJECTED;
+		return;
+	}
+	if (context->target_cycle <= context->current_cycle || !period) {
+		return;
+	}
+	uint32_t skip = (context->target_cycle - context->current_cycle - 1) / period;
+	context->current_cycle += skip * period;
+	context->idle_cycle = context->current_cycle;
+}
+
+//marks an entry point as recorded in the translation cache, returns whether it already was
+static uint8_t trans_cache_seen(m68k_options *opts, uint32_t address)
+{
+	uint32_t word = (address & 0xFFFFFF) >> 1;
+	uint8_t mask = 1 << (word & 7);
+	uint8_t seen = opts->trans_cache_seen[word >> 3] & mask;
+	opts->trans_cache_seen[word >> 3] |= mask;
+	return seen;
+}
+
 void translate_m68k_stream(uint32_t address, m68k_context * context)
 {
 	m68kinst instbuf;
@@ -1010,19 +1395,28 @@ void translate_m68k_stream(uint32_t address, m68k_context * context)
 	if(get_native_address(opts, address)) {
 		return;
 	}
+	if (opts->trans_cache && is_fixed_rom(opts, address) && !trans_cache_seen(opts, address)) {
+		fprintf(opts->trans_cache, "%X\n", address);
+	}
 	uint16_t *encoded, *next;
 	do {
 		if (opts->address_log) {
 			fprintf(opts->address_log, "%X\n", address);
 			fflush(opts->address_log);
 		}
+		m68kinst prevbuf;
+		uint8_t nzvc_dead = 0, group_size = 0, follow;
+		uint32_t group_address, branch_target;
+		code_ptr group_start;
 		do {
 			encoded = get_native_pointer(address, (void **)context->mem_pointers, &opts->gen);
 			if (!encoded) {
 				code_ptr start = code->cur;
+				code_profile_block_start(&opts->gen, address);
 				translate_out_of_bounds(opts, address);
 				code_ptr after = code->cur;
 				map_native_address(context, address, start, 2, after-start);
+				code_profile_block_size(&opts->gen, after-start);
 				break;
 			}
 			code_ptr existing = get_native_address(opts, address);
@@ -1043,10 +1437,43 @@ void translate_m68k_stream(uint32_t address, m68k_context * context)
 			//make sure the beginning of the code for an instruction is contiguous
 			check_code_prologue(code);
 			code_ptr start = code->cur;
-			translate_m68k(context, &instbuf);
+			uint8_t follows_dead = nzvc_dead;
+			nzvc_dead = m68k_nzvc_dead(context, &instbuf, address, group_size);
+			if (!follows_dead) {
+				//every native map entry is a possible branch target so each gets its own counter
+				code_profile_block_start(&opts->gen, instbuf.address);
+			}
+			opts->idle_back_edge = m68k_is_idle_loop(context, &instbuf, 0);
+			translate_m68k(context, &instbuf, follows_dead ? &prevbuf : NULL, nzvc_dead);
+			opts->idle_back_edge = 0;
+			//continue with the destination of a static branch instead of jumping to it
+			//if it hasn't been translated yet
+			follow = 0;
+			if (m68k_static_branch(&instbuf, &branch_target) && !(branch_target & 1)) {
+				branch_target &= opts->gen.address_mask;
+				follow = m68k_fall_through_to(opts, branch_target);
+			}
 			code_ptr after = code->cur;
-			map_native_address(context, instbuf.address, start, m68k_size, after-start);
-		} while(!m68k_is_terminal(&instbuf) && !(address & 1));
+			if (follows_dead) {
+				//extend the entry of the first instruction in the group to cover this one
+				group_size += m68k_size;
+				map_native_address(context, group_address, group_start, group_size, after-group_start);
+				code_profile_block_size(&opts->gen, after-group_start);
+			} else {
+				group_address = instbuf.address;
+				group_start = start;
+				group_size = m68k_size;
+				map_native_address(context, instbuf.address, start, m68k_size, after-start);
+				code_profile_block_size(&opts->gen, after-start);
+			}
+			prevbuf = instbuf;
+			if (follow) {
+				address = branch_target;
+				nzvc_dead = 0;
+			}
+		} while((follow || !m68k_is_terminal(&instbuf)) && !(address & 1));
+		code_profile_stream_end(&opts->gen);
+		code_cache_track(&opts->gen);
 		process_deferred(&opts->gen.deferred, context, (native_addr_func)get_native_from_context);
 		if (opts->gen.deferred) {
 			address = opts->gen.deferred->address;
@@ -1054,6 +1481,21 @@ void translate_m68k_stream(uint32_t address, m68k_context * context)
 	} while(opts->gen.deferred);
 }
 
+void m68k_flush_code_cache(m68k_context *context)
+{
+	m68k_options *opts = context->options;
+	flush_code_cache(&opts->gen);
+	if (opts->trans_cache) {
+		fflush(opts->trans_cache);
+	}
+	memset(context->ram_code_flags, 0, ram_size(&opts->gen) / (1 << opts->gen.ram_flags_shift) / 8);
+	for (int i = 0; i < RET_CACHE_SIZE; i++)
+	{
+		context->ret_cache[i].address = 0;
+		context->ret_cache[i].native = opts->ret_cache_miss;
+	}
+}
+
 void * m68k_retranslate_inst(uint32_t address, m68k_context * context)
 {
 	m68k_options * opts = context->options;
@@ -1071,7 +1513,7 @@ void * m68k_retranslate_inst(uint32_t address, m68k_context * context)
 		//make sure we have enough code space for the max size instruction
 		check_alloc_code(code, MAX_NATIVE_SIZE);
 		code_ptr native_start = code->cur;
-		translate_m68k(context, &instbuf);
+		translate_m68k(context, &instbuf, NULL, 0);
 		code_ptr native_end = code->cur;
 		/*uint8_t is_terminal = m68k_is_terminal(&instbuf);
 		if ((native_end - native_start) <= orig_size) {
@@ -1087,7 +1529,7 @@ void * m68k_retranslate_inst(uint32_t address, m68k_context * context)
 				tmp.last = code->last;
 				code->cur = orig_code.cur;
 				code->last = orig_code.last;
-				translate_m68k(context, &instbuf);
+				translate_m68k(context, &instbuf, NULL, 0);
 				native_end = orig_code.cur = code->cur;
 				code->cur = tmp.cur;
 				code->last = tmp.last;
@@ -1120,9 +1562,11 @@ void * m68k_retranslate_inst(uint32_t address, m68k_context * context)
 	} else {
 		code_info tmp = *code;
 		*code = orig_code;
-		translate_m68k(context, &instbuf);
+		translate_m68k(context, &instbuf, NULL, 0);
 		orig_code = *code;
 		*code = tmp;
+		//refresh the extension words and the copy used to filter out redundant writes
+		map_native_address(context, instbuf.address, orig_start, (after-inst)*2, MAX_NATIVE_SIZE);
 		if (!m68k_is_terminal(&instbuf)) {
 			jmp(&orig_code, get_native_address_trans(context, orig + (after-inst)*2));
 		}
@@ -1169,6 +1613,7 @@ void start_68k_context(m68k_context * context, uint32_t address)
 	code_ptr addr = get_native_address_trans(context, address);
 	m68k_options * options = context->options;
 	context->should_return = 0;
+	context->idle_branch = IDLE_BRANCH_NONE;
 	options->start_context(addr, context);
 }
 
@@ -1178,6 +1623,8 @@ void resume_68k(m68k_context *context)
 	context->resume_pc = NULL;
 	m68k_options * options = context->options;
 	context->should_return = 0;
+	//memory and registers may have changed while the 68K was stopped
+	context->idle_branch = IDLE_BRANCH_NONE;
 	options->start_context(addr, context);
 }
 
@@ -1190,10 +1637,235 @@ void m68k_reset(m68k_context * context)
 	start_68k_context(context, address);
 }
 
+void m68k_load_trans_cache(m68k_context *context, char *path)
+{
+	m68k_options *opts = context->options;
+	//one bit per 68K word so an entry point is only written once, even when it gets translated again after a flush
+	opts->trans_cache_seen = calloc(1, (1 << 24) / 16);
+	uint32_t *entries = NULL;
+	uint32_t count = 0, storage = 0;
+	FILE *f = fopen(path, "r");
+	if (f) {
+		uint32_t address;
+		char end;
+		//a line cut short by a crash while appending has no newline and is dropped
+		while (fscanf(f, "%X%c", &address, &end) == 2 && end == '\n')
+		{
+			if (!(address & 1) && is_fixed_rom(opts, address) && !trans_cache_seen(opts, address)) {
+				translate_m68k_stream(address, context);
+				if (count == storage) {
+					storage = storage ? storage * 2 : 1024;
+					entries = realloc(entries, storage * sizeof(uint32_t));
+				}
+				entries[count++] = address;
+			}
+		}
+		fclose(f);
+		printf("Translated %u entry points from %s\n", count, path);
+	}
+	//the list is rewritten without duplicates to a temporary file that replaces the old one once it is complete,
+	//so dying part way through leaves the old list intact. New entry points are appended as they are translated
+	//and flushed along with the code cache or on exit
+	char *tmp_path = alloc_concat(path, ".tmp");
+	FILE *tmp = fopen(tmp_path, "w");
+	uint8_t failed = !tmp;
+	if (tmp) {
+		for (uint32_t i = 0; i < count; i++)
+		{
+			fprintf(tmp, "%X\n", entries[i]);
+		}
+		failed = fclose(tmp) != 0;
+#ifdef _WIN32
+		//rename won't replace an existing file on Windows
+		failed = failed || (f && remove(path) != 0);
+#endif
+		failed = failed || rename(tmp_path, path) != 0;
+		if (failed) {
+			remove(tmp_path);
+		}
+	}
+	free(tmp_path);
+	if (failed) {
+		//appending to a list that still has a partial last line would corrupt the next entry
+		warning("Failed to rewrite translation cache %s\n", path);
+	} else {
+		opts->trans_cache = fopen(path, "a");
+		if (!opts->trans_cache) {
+			warning("Failed to open translation cache %s for writing\n", path);
+		}
+	}
+	free(entries);
+}
+
+#define REG_SCAN_MAX_INSTS 0x10000
+#define REG_SCAN_LOOP_BYTES 256
+#define REG_SCAN_LOOP_WEIGHT 16
+
+static void count_reg_uses(m68k_op_info *op, uint32_t *uses, uint32_t weight)
+{
+	switch (op->addr_mode)
+	{
+	case MODE_REG:
+		uses[op->params.regs.pri] += weight;
+		break;
+	case MODE_AREG_INDEX_DISP8:
+		uses[8 + op->params.regs.pri] += weight;
+		//fallthrough
+	case MODE_PC_INDEX_DISP8:
+		uses[(op->params.regs.sec & 0x10 ? 8 : 0) + (op->params.regs.sec >> 1 & 0x7)] += weight;
+		break;
+	case MODE_AREG:
+	case MODE_AREG_INDIRECT:
+	case MODE_AREG_POSTINC:
+	case MODE_AREG_PREDEC:
+	case MODE_AREG_DISPLACE:
+		uses[8 + op->params.regs.pri] += weight;
+		break;
+	}
+}
+
+static uint32_t *scan_push(uint32_t *pending, uint32_t *num_pending, uint32_t *storage, uint32_t address)
+{
+	if (*num_pending == *storage) {
+		*storage *= 2;
+		pending = realloc(pending, *storage * sizeof(uint32_t));
+	}
+	pending[(*num_pending)++] = address;
+	return pending;
+}
+
+//Walks the code reachable from the vector table in fixed ROM and tallies how often
+//each register is referenced, D0-D7 in uses[0-7] and A0-A7 in uses[8-15].
+//References inside short backward branches, typically copy and fill loops, count extra
+static uint32_t m68k_scan_reg_uses(m68k_options *opts, uint32_t *uses)
+{
+	uint32_t words = (opts->gen.address_mask + 1) / 2;
+	uint8_t *visited = calloc(words / 8, 1);
+	uint8_t *in_loop = calloc(words / 8, 1);
+	uint32_t *insts = malloc(REG_SCAN_MAX_INSTS * sizeof(uint32_t));
+	uint32_t num_insts = 0;
+	uint32_t pending_storage = 64, num_pending = 0;
+	uint32_t *pending = malloc(pending_storage * sizeof(uint32_t));
+	for (uint32_t vector = VECTOR_RESET_PC; vector < VECTOR_USER0; vector++)
+	{
+		if (is_fixed_rom(opts, vector * 4)) {
+			uint16_t *entry = get_native_pointer(vector * 4, NULL, &opts->gen);
+			pending = scan_push(pending, &num_pending, &pending_storage, (entry[0] << 16 | entry[1]) & opts->gen.address_mask);
+		}
+	}
+	m68kinst inst;
+	while (num_pending && num_insts < REG_SCAN_MAX_INSTS)
+	{
+		uint32_t address = pending[--num_pending];
+		while (num_insts < REG_SCAN_MAX_INSTS && !(address & 1) && is_fixed_rom(opts, address))
+		{
+			uint32_t word = address / 2;
+			if (visited[word / 8] & (1 << (word % 8))) {
+				break;
+			}
+			visited[word / 8] |= 1 << (word % 8);
+			insts[num_insts++] = address;
+			uint16_t *encoded = get_native_pointer(address, NULL, &opts->gen);
+			uint32_t next = address + (m68k_decode(encoded, &inst, address) - encoded) * 2;
+			if (m68k_is_branch(&inst) && (
+				inst.op == M68K_BCC || inst.op == M68K_BSR || inst.op == M68K_DBCC
+				|| inst.src.addr_mode == MODE_PC_DISPLACE || inst.src.addr_mode == MODE_ABSOLUTE
+				|| inst.src.addr_mode == MODE_ABSOLUTE_SHORT
+			)) {
+				uint32_t target = m68k_branch_target(&inst, NULL, NULL) & opts->gen.address_mask;
+				if (inst.op != M68K_BSR && target < address && address - target <= REG_SCAN_LOOP_BYTES) {
+					for (uint32_t cur = target / 2; cur <= word; cur++)
+					{
+						in_loop[cur / 8] |= 1 << (cur % 8);
+					}
+				}
+				pending = scan_push(pending, &num_pending, &pending_storage, target);
+			}
+			if (m68k_is_terminal(&inst)) {
+				break;
+			}
+			address = next;
+		}
+	}
+	for (uint32_t i = 0; i < num_insts; i++)
+	{
+		uint32_t word = insts[i] / 2;
+		uint32_t weight = in_loop[word / 8] & (1 << (word % 8)) ? REG_SCAN_LOOP_WEIGHT : 1;
+		uint16_t *encoded = get_native_pointer(insts[i], NULL, &opts->gen);
+		m68k_decode(encoded, &inst, insts[i]);
+		//the register list operand of movem is decoded as MODE_REG
+		if (inst.op != M68K_MOVEM || inst.src.addr_mode != MODE_REG) {
+			count_reg_uses(&inst.src, uses, weight);
+		}
+		if (inst.op != M68K_MOVEM || inst.dst.addr_mode != MODE_REG) {
+			count_reg_uses(&inst.dst, uses, weight);
+		}
+	}
+	free(pending);
+	free(insts);
+	free(in_loop);
+	free(visited);
+	return num_insts;
+}
+
+//Hands the host registers the backend set aside for 68K registers to the ones the ROM
+//uses the most. A7 keeps its host register as nearly everything touches the stack
+void m68k_assign_host_regs(m68k_options *opts)
+{
+	uint32_t uses[16] = {0};
+	if (!m68k_scan_reg_uses(opts, uses)) {
+		return;
+	}
+	int8_t *slots[15];
+	int8_t pool[15];
+	uint8_t ranked[15];
+	uint8_t pool_size = 0, num_ranked = 0;
+	for (uint8_t i = 0; i < 15; i++)
+	{
+		slots[i] = i < 8 ? opts->dregs + i : opts->aregs + i - 8;
+		if (*slots[i] >= 0) {
+			pool[pool_size++] = *slots[i];
+			//registers with a default assignment win ties
+			ranked[num_ranked++] = i;
+		}
+	}
+	for (uint8_t i = 0; i < 15; i++)
+	{
+		if (*slots[i] < 0) {
+			ranked[num_ranked++] = i;
+		}
+	}
+	for (uint8_t i = 1; i < 15; i++)
+	{
+		uint8_t reg = ranked[i];
+		uint8_t j;
+		for (j = i; j > 0 && uses[ranked[j-1]] < uses[reg]; j--)
+		{
+			ranked[j] = ranked[j-1];
+		}
+		ranked[j] = reg;
+	}
+	for (uint8_t i = 0; i < 15; i++)
+	{
+		*slots[ranked[i]] = i < pool_size ? pool[i] : -1;
+	}
+}
+
 void m68k_options_free(m68k_options *opts)
 {
-	free(opts->gen.native_code_map);
+	if (opts->trans_cache) {
+		fclose(opts->trans_cache);
+	}
+	free(opts->trans_cache_seen);
+	free_native_map(&opts->gen.native_code_map);
+	free(opts->gen.code_cache.chunks.list);
+	code_profile_free(&opts->gen);
 	free(opts->gen.ram_inst_sizes);
+	for (uint32_t i = 0; i < ram_size(&opts->gen) / 1024; i++)
+	{
+		free(opts->ram_code_copy[i]);
+	}
+	free(opts->ram_code_copy);
 	free(opts);
 }
 
@@ -1206,6 +1878,12 @@ m68k_context * init_68k_context(m68k_options * opts, m68k_reset_handler reset_ha
 	context->options = opts;
 	context->int_cycle = CYCLE_NEVER;
 	context->status = 0x27;
+	context->idle_branch = IDLE_BRANCH_NONE;
+	for (int i = 0; i < RET_CACHE_SIZE; i++)
+	{
+		//empty entries send any hit through the miss path which fills them in
+		context->ret_cache[i].native = opts->ret_cache_miss;
+	}
 	context->reset_handler = (code_ptr)reset_handler;
 	return context;
 }
@@ -19,6 +19,8 @@ struct m68kinst;
 
 #define M68K_OPT_BROKEN_READ_MODIFY 1
 
+#define RET_CACHE_SIZE 64
+
 #define INT_PENDING_SR_CHANGE 254
 #define INT_PENDING_NONE 255
 
@@ -41,6 +43,8 @@ typedef struct {
 	int8_t          aregs[8];
 	int8_t			flag_regs[5];
 	FILE            *address_log;
+	FILE            *trans_cache;
+	uint8_t         *trans_cache_seen;
 	code_ptr        read_16;
 	code_ptr        write_16;
 	code_ptr        read_8;
@@ -55,17 +59,31 @@ typedef struct {
 	code_ptr        retrans_stub;
 	code_ptr        native_addr;
 	code_ptr        native_addr_and_sync;
+	code_ptr        native_addr_site;
+	code_ptr        native_addr_ret;
+	code_ptr        ret_cache_miss;
 	code_ptr		get_sr;
 	code_ptr		set_sr;
 	code_ptr		set_ccr;
 	code_ptr        bp_stub;
+	code_ptr        idle_loop;
 	code_info       extra_code;
+	uint16_t        **ram_code_copy;
 	movem_fun       *big_movem;
 	uint32_t        num_movem;
 	uint32_t        movem_storage;
 	code_word       prologue_start;
+	uint8_t         prologue_ret_off;
+	uint8_t         prologue_size;
+	uint8_t         nzvc_dead;
+	uint8_t         idle_back_edge;
 } m68k_options;
 
+typedef struct {
+	code_ptr native;
+	uint32_t address;
+} m68k_ret_cache_entry;
+
 typedef struct m68k_context m68k_context;
 typedef void (*m68k_debug_handler)(m68k_context *context, uint32_t pc);
 
@@ -97,6 +115,10 @@ struct m68k_context {
 	uint8_t         int_pending;
 	uint8_t         trace_pending;
 	uint8_t         should_return;
+	uint8_t         in_bp_stub;   //set while the breakpoint stub has an extra return address on the stack
+	uint32_t        idle_branch; //address of the back edge of the idle loop being measured
+	uint32_t        idle_cycle;
+	m68k_ret_cache_entry ret_cache[RET_CACHE_SIZE];
 	uint8_t         ram_code_flags[];
 };
 
@@ -110,6 +132,7 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 m68k_context * init_68k_context(m68k_options * opts, m68k_reset_handler reset_handler);
 void m68k_reset(m68k_context * context);
 void m68k_options_free(m68k_options *opts);
+void m68k_load_trans_cache(m68k_context *context, char *path);
 void insert_breakpoint(m68k_context * context, uint32_t address, m68k_debug_handler bp_handler);
 void remove_breakpoint(m68k_context * context, uint32_t address);
 m68k_context * m68k_handle_code_write(uint32_t address, m68k_context * context);
@@ -117,6 +140,7 @@ uint32_t get_instruction_start(m68k_options *opts, uint32_t address);
 uint16_t m68k_get_ir(m68k_context *context);
 void m68k_print_regs(m68k_context * context);
 void m68k_invalidate_code_range(m68k_context *context, uint32_t start, uint32_t end);
+void m68k_flush_code_cache(m68k_context *context);
 void m68k_serialize(m68k_context *context, uint32_t pc, serialize_buffer *buf);
 void m68k_deserialize(deserialize_buffer *buf, void *vcontext);
 
@@ -108,6 +108,10 @@ void flag_to_flag(m68k_options *opts, uint8_t flag1, uint8_t flag2)
 void update_flags(m68k_options *opts, uint32_t update_mask)
 {
 	uint8_t native_flags[] = {0, CC_S, CC_Z, CC_O, CC_C};
+	if (opts->nzvc_dead && !(update_mask & X)) {
+		//next instruction overwrites N, Z, V and C before anything reads them
+		update_mask &= X0 | X1;
+	}
 	for (int8_t flag = FLAG_C; flag >= FLAG_X; --flag)
 	{
 		if (update_mask & X0 << (flag*3)) {
@@ -357,15 +361,97 @@ void m68k_check_cycles_int_latch(m68k_options *opts)
 	uint8_t cc;
 	if (opts->gen.limit < 0) {
 		cmp_ir(code, 1, opts->gen.cycles, SZ_D);
-		cc = CC_NS;
+		cc = CC_S;
 	} else {
 		cmp_rr(code, opts->gen.cycles, opts->gen.limit, SZ_D);
-		cc = CC_A;
+		cc = CC_BE;
 	}
-	code_ptr jmp_off = code->cur+1;
-	jcc(code, cc, jmp_off+1);
+	code_info hot;
+	jcc_cold(&opts->gen, cc, &hot);
 	call(code, opts->handle_int_latch);
-	*jmp_off = code->cur - (jmp_off+1);
+	jmp(code, hot.cur);
+	cold_code_end(&opts->gen, &hot);
+}
+
+//Prologue for an instruction that can only be reached from the one before it when that
+//instruction skipped its flag update. Flags are recalculated from its destination register
+//in the cold path before handle_cycle_limit_int gets a chance to look at them
+void m68k_check_cycles_int_flags(m68k_options *opts, uint32_t address, m68kinst *flags_from)
+{
+	code_info *code = &opts->gen.code;
+	code_info hot;
+	code_ptr flags_stub = cold_code_start(&opts->gen, &hot);
+	m68k_op_info *op = flags_from->dst.addr_mode == MODE_REG ? &flags_from->dst : &flags_from->src;
+	uint8_t size = flags_from->op == M68K_SWAP || flags_from->op == M68K_MULS || flags_from->op == M68K_MULU
+		? OPSIZE_LONG : flags_from->extra.size;
+	int8_t reg = native_reg(op, opts);
+	if (reg >= 0) {
+		cmp_ir(code, 0, reg, size);
+	} else {
+		cmp_irdisp(code, 0, opts->gen.context_reg, dreg_offset(op->params.regs.pri), size);
+	}
+	update_flags(opts, N|Z|V0|C0);
+	jmp(code, opts->gen.handle_cycle_limit_int);
+	cold_code_end(&opts->gen, &hot);
+	//the stub is called like handle_cycle_limit_int so the prologue has the same layout as any other
+	check_cycles_int_call(&opts->gen, address, flags_stub);
+}
+
+//Reads from an address known at translation time. Plain RAM and ROM chunks are read
+//with a direct load, but the cycle checks the memory functions do are kept so syncs
+//still happen at the same points
+static void m68k_read_const(m68k_options *opts, uint32_t address, uint8_t size, uint8_t dst)
+{
+	code_info *code = &opts->gen.code;
+	uint32_t bytes = size == OPSIZE_LONG ? 4 : size == OPSIZE_WORD ? 2 : 1;
+	memmap_chunk const *chunk = find_map_chunk(address, &opts->gen, 0, NULL);
+	uint32_t offset = chunk ? address & chunk->mask : 0;
+	uint32_t masked = address & opts->gen.address_mask;
+	if (
+		!chunk || !(chunk->flags & MMAP_READ) || (chunk->flags & (MMAP_ONLY_ODD | MMAP_ONLY_EVEN | MMAP_FUNC_NULL))
+		|| (!(chunk->flags & MMAP_PTR_IDX) && !chunk->buffer)
+		|| (bytes > 1 && (address & 1)) || masked + bytes > chunk->end || offset + bytes - 1 > chunk->mask
+	) {
+		mov_ir(code, address, opts->gen.scratch1, SZ_D);
+		if (dst) {
+			push_r(code, opts->gen.scratch1);
+		}
+		m68k_read_size(opts, size);
+		if (dst) {
+			pop_r(code, opts->gen.scratch2);
+		}
+		return;
+	}
+	for (uint32_t i = 0; i < bytes; i += 2)
+	{
+		check_cycles(&opts->gen);
+		cycles(&opts->gen, BUS);
+	}
+	if (chunk->flags & MMAP_PTR_IDX) {
+		mov_rdispr(code, opts->gen.context_reg, opts->gen.mem_ptr_off + sizeof(void*) * chunk->ptr_index, opts->gen.scratch1, SZ_PTR);
+	} else {
+		mov_ir(code, (intptr_t)chunk->buffer, opts->gen.scratch1, SZ_PTR);
+	}
+	switch (size)
+	{
+	case OPSIZE_BYTE:
+		if (opts->gen.byte_swap || (chunk->flags & MMAP_BYTESWAP)) {
+			offset ^= 1;
+		}
+		movzx_rdispr(code, opts->gen.scratch1, offset, opts->gen.scratch1, SZ_B, SZ_D);
+		break;
+	case OPSIZE_WORD:
+		movzx_rdispr(code, opts->gen.scratch1, offset, opts->gen.scratch1, SZ_W, SZ_D);
+		break;
+	case OPSIZE_LONG:
+		//memory is stored as native words so the halves need to be swapped
+		mov_rdispr(code, opts->gen.scratch1, offset, opts->gen.scratch1, SZ_D);
+		rol_ir(code, 16, opts->gen.scratch1, SZ_D);
+		break;
+	}
+	if (dst) {
+		mov_ir(code, address, opts->gen.scratch2, SZ_D);
+	}
 }
 
 uint8_t translate_m68k_op(m68kinst * inst, host_ea * ea, m68k_options * opts, uint8_t dst)
@@ -477,14 +563,7 @@ uint8_t translate_m68k_op(m68kinst * inst, host_ea * ea, m68k_options * opts, ui
 		break;
 	case MODE_PC_DISPLACE:
 		cycles(&opts->gen, BUS);
-		mov_ir(code, op->params.regs.displacement + inst->address+2, opts->gen.scratch1, SZ_D);
-		if (dst) {
-			push_r(code, opts->gen.scratch1);
-		}
-		m68k_read_size(opts, inst->extra.size);
-		if (dst) {
-			pop_r(code, opts->gen.scratch2);
-		}
+		m68k_read_const(opts, op->params.regs.displacement + inst->address+2, inst->extra.size, dst);
 
 		ea->mode = MODE_REG_DIRECT;
 		ea->base = opts->gen.scratch1;
@@ -507,14 +586,7 @@ uint8_t translate_m68k_op(m68kinst * inst, host_ea * ea, m68k_options * opts, ui
 	case MODE_ABSOLUTE:
 	case MODE_ABSOLUTE_SHORT:
 		cycles(&opts->gen, op->addr_mode == MODE_ABSOLUTE ? BUS*2 : BUS);
-		mov_ir(code, op->params.immed, opts->gen.scratch1, SZ_D);
-		if (dst) {
-			push_r(code, opts->gen.scratch1);
-		}
-		m68k_read_size(opts, inst->extra.size);
-		if (dst) {
-			pop_r(code, opts->gen.scratch2);
-		}
+		m68k_read_const(opts, op->params.immed, inst->extra.size, dst);
 
 		ea->mode = MODE_REG_DIRECT;
 		ea->base = opts->gen.scratch1;
@@ -746,10 +818,14 @@ void translate_m68k_clr(m68k_options * opts, m68kinst * inst)
 {
 	code_info *code = &opts->gen.code;
 	update_flags(opts, N0|V0|C0|Z1);
-	int8_t reg = native_reg(&(inst->dst), opts);
-	if (reg >= 0) {
+	if (inst->dst.addr_mode == MODE_REG) {
 		cycles(&opts->gen, (inst->extra.size == OPSIZE_LONG ? 6 : 4));
-		xor_rr(code, reg, reg, inst->extra.size);
+		int8_t reg = native_reg(&(inst->dst), opts);
+		if (reg >= 0) {
+			xor_rr(code, reg, reg, inst->extra.size);
+		} else {
+			mov_irdisp(code, 0, opts->gen.context_reg, reg_offset(&(inst->dst)), inst->extra.size);
+		}
 		return;
 	}
 	host_ea dst_op;
@@ -830,6 +906,20 @@ uint8_t m68k_eval_cond(m68k_options * opts, uint8_t cc)
 	return cond;
 }
 
+//Emits the call into m68k_idle_loop for the Bcc at address. The call is skipped once
+//idle_branch holds address | IDLE_BRANCH_REJECTED, which m68k_idle_loop sets when it
+//finds the body can't be skipped
+static void m68k_idle_check(m68k_options *opts, uint32_t address)
+{
+	code_info *code = &opts->gen.code;
+	cmp_irdisp(code, address | IDLE_BRANCH_REJECTED, opts->gen.context_reg, offsetof(m68k_context, idle_branch), SZ_D);
+	code_ptr rejected = code->cur + 1;
+	jcc(code, CC_Z, rejected);
+	mov_ir(code, address, opts->gen.scratch1, SZ_D);
+	call(code, opts->idle_loop);
+	*rejected = code->cur - (rejected + 1);
+}
+
 void translate_m68k_bcc(m68k_options * opts, m68kinst * inst)
 {
 	code_info *code = &opts->gen.code;
@@ -838,6 +928,9 @@ void translate_m68k_bcc(m68k_options * opts, m68kinst * inst)
 	uint32_t after = inst->address + 2;
 	if (inst->extra.cond == COND_TRUE) {
 		cycles(&opts->gen, 10);
+		if (opts->idle_back_edge) {
+			m68k_idle_check(opts, inst->address);
+		}
 		jump_m68k_abs(opts, after + disp);
 	} else {
 		uint8_t cond = m68k_eval_cond(opts, inst->extra.cond);
@@ -845,11 +938,18 @@ void translate_m68k_bcc(m68k_options * opts, m68kinst * inst)
 		jcc(code, cond, do_branch);
 		
 		cycles(&opts->gen, inst->variant == VAR_BYTE ? 8 : 12);
+		if (opts->idle_back_edge) {
+			//the next time the Bcc is taken it has to record a fresh starting cycle
+			mov_irdisp(code, IDLE_BRANCH_NONE, opts->gen.context_reg, offsetof(m68k_context, idle_branch), SZ_D);
+		}
 		code_ptr done = code->cur + 1;
 		jmp(code, done);
 		
 		*do_branch = code->cur - (do_branch + 1);
 		cycles(&opts->gen, 10);
+		if (opts->idle_back_edge) {
+			m68k_idle_check(opts, inst->address);
+		}
 		code_ptr dest_addr = get_native_address(opts, after + disp);
 		if (!dest_addr) {
 			opts->gen.deferred = defer_address(opts->gen.deferred, after + disp, code->cur + 1);
@@ -2492,15 +2592,31 @@ void nop_fill_or_jmp_next(code_info *code, code_ptr old_end, code_ptr next_inst)
 	}
 }
 
-#define M68K_MAX_INST_SIZE (2*(1+2+2))
-
 m68k_context * m68k_handle_code_write(uint32_t address, m68k_context * context)
 {
 	m68k_options * options = context->options;
+	if (!m68k_code_word_changed(context, address)) {
+		return context;
+	}
 	uint32_t inst_start = get_instruction_start(options, address);
-	while (inst_start && (address - inst_start) < M68K_MAX_INST_SIZE) {
-		code_ptr dst = get_native_address(context->options, inst_start);
-		patch_for_retranslate(&options->gen, dst, options->retrans_stub);
+	if (!inst_start) {
+		return context;
+	}
+	uint32_t word = address & ~1;
+	memmap_chunk const *mem_chunk = find_map_chunk(word, &options->gen, 0, NULL);
+	if (mem_chunk) {
+		//calculate the lowest alias for this address
+		word = mem_chunk->start + ((word - mem_chunk->start) & mem_chunk->mask);
+	}
+	code_ptr dst = get_native_address(context->options, inst_start);
+	patch_for_retranslate(&options->gen, dst, options->retrans_stub);
+	//earlier instructions only need to be retranslated if they actually overlap the written word
+	inst_start = get_instruction_start(options, inst_start - 2);
+	while (inst_start && (word - inst_start) < M68K_MAX_INST_SIZE) {
+		if (m68k_inst_end(options, inst_start) > word) {
+			dst = get_native_address(context->options, inst_start);
+			patch_for_retranslate(&options->gen, dst, options->retrans_stub);
+		}
 		inst_start = get_instruction_start(options, inst_start - 2);
 	}
 	return context;
@@ -2509,7 +2625,6 @@ m68k_context * m68k_handle_code_write(uint32_t address, m68k_context * context)
 void m68k_invalidate_code_range(m68k_context *context, uint32_t start, uint32_t end)
 {
 	m68k_options *opts = context->options;
-	native_map_slot *native_code_map = opts->gen.native_code_map;
 	memmap_chunk const *mem_chunk = find_map_chunk(start, &opts->gen, 0, NULL);
 	if (mem_chunk) {
 		//calculate the lowest alias for this address
@@ -2523,15 +2638,17 @@ void m68k_invalidate_code_range(m68k_context *context, uint32_t start, uint32_t
 	uint32_t start_chunk = start / NATIVE_CHUNK_SIZE, end_chunk = end / NATIVE_CHUNK_SIZE;
 	for (uint32_t chunk = start_chunk; chunk <= end_chunk; chunk++)
 	{
-		if (native_code_map[chunk].base) {
+		native_map_slot *slot = find_native_slot(&opts->gen.native_code_map, chunk * NATIVE_CHUNK_SIZE);
+		if (slot) {
 			uint32_t start_offset = chunk == start_chunk ? start % NATIVE_CHUNK_SIZE : 0;
 			uint32_t end_offset = chunk == end_chunk ? end % NATIVE_CHUNK_SIZE : NATIVE_CHUNK_SIZE;
 			for (uint32_t offset = start_offset; offset < end_offset; offset++)
 			{
-				if (native_code_map[chunk].offsets[offset] != INVALID_OFFSET && native_code_map[chunk].offsets[offset] != EXTENSION_WORD) {
-					patch_for_retranslate(&opts->gen, native_code_map[chunk].base + native_code_map[chunk].offsets[offset], opts->retrans_stub);
+				uint32_t native_off = native_slot_offset(slot, offset);
+				if (native_off != INVALID_OFFSET && native_off != EXTENSION_WORD) {
+					patch_for_retranslate(&opts->gen, slot->base + (int32_t)native_off, opts->retrans_stub);
 					/*code_info code;
-					code.cur = native_code_map[chunk].base + native_code_map[chunk].offsets[offset];
+					code.cur = slot->base + native_off;
 					code.last = code.cur + 32;
 					code.stack_off = 0;
 					mov_ir(&code, chunk * NATIVE_CHUNK_SIZE + offset, opts->gen.scratch2, SZ_D);
@@ -2542,6 +2659,113 @@ void m68k_invalidate_code_range(m68k_context *context, uint32_t start, uint32_t
 	}
 }
 
+//Inline cache layout for indirect jumps:
+//	cmp scratch1, imm32 ; last 68K target seen at this site
+//	jnz miss            ; 2 byte jcc
+//	jmp rel32           ; native address of that target
+//miss:
+//	mov scratch2, miss
+//	call native_addr_site
+//	jmp scratch1
+//The miss address passed to native_addr_site is enough to find the fields that need patching
+#define IC_EMPTY 0x7FFFFFFF
+#define IC_JMP_SIZE 5
+#define IC_JCC_SIZE 2
+
+static void ic_write32(code_ptr dst, uint32_t val)
+{
+	for (int i = 0; i < 4; i++, val >>= 8)
+	{
+		dst[i] = val;
+	}
+}
+
+extern code_ptr m68k_indirect_cache_miss(m68k_context *context, uint32_t address, code_ptr site) asm("m68k_indirect_cache_miss");
+code_ptr m68k_indirect_cache_miss(m68k_context *context, uint32_t address, code_ptr site)
+{
+	code_ptr native = get_native_address_trans(context, address);
+	ptrdiff_t disp = native - site;
+	if (native && disp == (int32_t)disp) {
+		ic_write32(site - IC_JMP_SIZE - IC_JCC_SIZE - sizeof(uint32_t), address);
+		ic_write32(site - sizeof(int32_t), disp);
+	}
+	return native;
+}
+
+extern code_ptr m68k_ret_cache_miss(m68k_context *context, uint32_t address) asm("m68k_ret_cache_miss");
+code_ptr m68k_ret_cache_miss(m68k_context *context, uint32_t address)
+{
+	code_ptr native = get_native_address_trans(context, address);
+	if (native) {
+		m68k_ret_cache_entry *entry = context->ret_cache + ((address >> 1) & (RET_CACHE_SIZE - 1));
+		entry->address = address;
+		entry->native = native;
+	}
+	return native;
+}
+
+//Called from the sync path of handle_cycle_limit_int when a flush is pending.
+//Returns the return address for the prologue of the fresh translation of the
+//instruction at address or NULL if the flush has to wait
+extern code_ptr m68k_sync_flush(m68k_context *context, uint32_t address) asm("m68k_sync_flush");
+code_ptr m68k_sync_flush(m68k_context *context, uint32_t address)
+{
+	//breakpoint stubs call handle_cycle_limit_int with an extra return address on the stack.
+	//A breakpoint can be removed during the sync, so the breakpoint count doesn't tell
+	if (context->in_bp_stub) {
+		return NULL;
+	}
+	m68k_flush_code_cache(context);
+	code_ptr native = get_native_address_trans(context, address);
+	return check_cycles_int_stub(&context->options->gen, native) + context->options->prologue_ret_off;
+}
+
+//Removes the jump a static branch just emitted when it goes to address and nothing has been
+//translated there yet so translation can continue with address instead
+uint8_t m68k_fall_through_to(m68k_options *opts, uint32_t address)
+{
+	code_info *code = &opts->gen.code;
+	deferred_addr *deferred = opts->gen.deferred;
+	code_ptr jmp_start = code->cur - (1 + sizeof(int32_t));
+	if (!deferred || deferred->address != address || deferred->dest != jmp_start + 1 || !is_jmp(jmp_start)) {
+		return 0;
+	}
+	opts->gen.deferred = deferred->next;
+	free(deferred);
+	code->cur = jmp_start;
+	return 1;
+}
+
+void jump_m68k_indirect(m68k_options *opts)
+{
+	code_info *code = &opts->gen.code;
+	//the patchable fields need to be in one contiguous piece of code
+	check_alloc_code(code, 64);
+	cmp_ir(code, IC_EMPTY, opts->gen.scratch1, SZ_D);
+	jcc(code, CC_NZ, code->cur + IC_JCC_SIZE + IC_JMP_SIZE);
+	//force a 32-bit displacement, it will be pointed at the miss path below
+	jmp(code, code->cur + 256);
+	code_ptr miss = code->cur;
+	ic_write32(miss - sizeof(int32_t), 0);
+	mov_ir(code, (uintptr_t)miss, opts->gen.scratch2, SZ_PTR);
+	call(code, opts->native_addr_site);
+	jmp_r(code, opts->gen.scratch1);
+}
+
+void jump_m68k_return(m68k_options *opts)
+{
+	code_info *code = &opts->gen.code;
+	//return targets are looked up in a small direct mapped table indexed by bits 1-6 of the address
+	mov_rr(code, opts->gen.scratch1, opts->gen.scratch2, SZ_D);
+	and_ir(code, (RET_CACHE_SIZE - 1) << 1, opts->gen.scratch2, SZ_D);
+	shl_ir(code, sizeof(m68k_ret_cache_entry) == 16 ? 3 : 2, opts->gen.scratch2, SZ_D);
+	add_rr(code, opts->gen.context_reg, opts->gen.scratch2, SZ_PTR);
+	cmp_rrdisp(code, opts->gen.scratch1, opts->gen.scratch2, offsetof(m68k_context, ret_cache) + offsetof(m68k_ret_cache_entry, address), SZ_D);
+	jcc(code, CC_NZ, opts->ret_cache_miss);
+	mov_rdispr(code, opts->gen.scratch2, offsetof(m68k_context, ret_cache) + offsetof(m68k_ret_cache_entry, native), opts->gen.scratch2, SZ_PTR);
+	jmp_r(code, opts->gen.scratch2);
+}
+
 void m68k_breakpoint_patch(m68k_context *context, uint32_t address, m68k_debug_handler bp_handler, code_ptr native_addr)
 {
 	m68k_options * opts = context->options;
@@ -2558,11 +2782,17 @@ void m68k_breakpoint_patch(m68k_context *context, uint32_t address, m68k_debug_h
 	}
 	native.last = native.cur + 128;
 	native.stack_off = 0;
-	code_ptr start_native = native.cur;
-	mov_ir(&native, address, opts->gen.scratch1, SZ_D);
-	
-	
-	call(&native, opts->bp_stub);
+	//the check is too short for the call to the breakpoint stub, so it goes in a cold stub
+	//that jumps back to the body of the instruction when the breakpoint handler is done
+	code_info hot;
+	code_ptr stub = cold_code_start(&opts->gen, &hot);
+	code_info *code = &opts->gen.code;
+	code->stack_off = 0;
+	mov_ir(code, address, opts->gen.scratch1, SZ_D);
+	call(code, opts->bp_stub);
+	jmp(code, native.cur + opts->prologue_size);
+	cold_code_end(&opts->gen, &hot);
+	jmp(&native, stub);
 }
 
 void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chunks, uint32_t clock_divider)
@@ -2578,7 +2808,7 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	opts->gen.clock_divider = clock_divider;
 	opts->gen.mem_ptr_off = offsetof(m68k_context, mem_pointers);
 	opts->gen.ram_flags_off = offsetof(m68k_context, ram_code_flags);
-	opts->gen.ram_flags_shift = 11;
+	opts->gen.ram_flags_shift = 1;
 	for (int i = 0; i < 8; i++)
 	{
 		opts->dregs[i] = opts->aregs[i] = -1;
@@ -2610,6 +2840,8 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	}
 	opts->gen.scratch2 = RBX;
 #endif
+	m68k_assign_host_regs(opts);
+
 	opts->gen.context_reg = RSI;
 	opts->gen.cycles = RAX;
 	opts->gen.limit = RBP;
@@ -2617,13 +2849,13 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	opts->gen.align_error_mask = 1;
 
 
-	opts->gen.native_code_map = malloc(sizeof(native_map_slot) * NATIVE_MAP_CHUNKS);
-	memset(opts->gen.native_code_map, 0, sizeof(native_map_slot) * NATIVE_MAP_CHUNKS);
+	init_native_map(&opts->gen.native_code_map, NATIVE_MAP_CHUNKS, NATIVE_CHUNK_SIZE);
 	opts->gen.deferred = NULL;
 
 	uint32_t inst_size_size = sizeof(uint8_t *) * ram_size(&opts->gen) / 1024;
 	opts->gen.ram_inst_sizes = malloc(inst_size_size);
 	memset(opts->gen.ram_inst_sizes, 0, inst_size_size);
+	opts->ram_code_copy = calloc(ram_size(&opts->gen) / 1024, sizeof(uint16_t *));
 
 	code_info *code = &opts->gen.code;
 	init_code_info(code);
@@ -2690,6 +2922,42 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	call(code, opts->gen.load_context);
 	retn(code);
 
+	opts->native_addr_site = code->cur;
+	call(code, opts->gen.save_context);
+	push_r(code, opts->gen.context_reg);
+	//flags are saved at this point so RDX is free, passing the site in it avoids a chain of swaps in prep_args
+	mov_rr(code, opts->gen.scratch2, RDX, SZ_PTR);
+	call_args(code, (code_ptr)m68k_indirect_cache_miss, 3, opts->gen.context_reg, opts->gen.scratch1, RDX);
+	mov_rr(code, RAX, opts->gen.scratch1, SZ_PTR);
+	pop_r(code, opts->gen.context_reg);
+	call(code, opts->gen.load_context);
+	retn(code);
+
+	opts->native_addr_ret = code->cur;
+	call(code, opts->gen.save_context);
+	push_r(code, opts->gen.context_reg);
+	call_args(code, (code_ptr)m68k_ret_cache_miss, 2, opts->gen.context_reg, opts->gen.scratch1);
+	mov_rr(code, RAX, opts->gen.scratch1, SZ_PTR);
+	pop_r(code, opts->gen.context_reg);
+	call(code, opts->gen.load_context);
+	retn(code);
+
+	opts->idle_loop = code->cur;
+	call(code, opts->gen.save_context);
+	push_r(code, opts->gen.context_reg);
+	call_args(code, (code_ptr)m68k_idle_loop, 2, opts->gen.context_reg, opts->gen.scratch1);
+	pop_r(code, opts->gen.context_reg);
+	call(code, opts->gen.load_context);
+	retn(code);
+
+	//jumped to from translated code when the return cache misses
+	opts->ret_cache_miss = code->cur;
+	uint32_t miss_stack_off = code->stack_off;
+	code->stack_off = 0;
+	call(code, opts->native_addr_ret);
+	jmp_r(code, opts->gen.scratch1);
+	code->stack_off = miss_stack_off;
+
 	opts->native_addr_and_sync = code->cur;
 	call(code, opts->gen.save_context);
 	push_r(code, opts->gen.scratch1);
@@ -2709,6 +2977,7 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	code_ptr skip_sync = code->cur + 1;
 	jcc(code, CC_C, code->cur + 2);
 	opts->do_sync = code->cur;
+	mov_irdisp(code, IDLE_BRANCH_NONE, opts->gen.context_reg, offsetof(m68k_context, idle_branch), SZ_D);
 	push_r(code, opts->gen.scratch1);
 	push_r(code, opts->gen.scratch2);
 	call(code, opts->gen.save_context);
@@ -2963,6 +3232,8 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	add_ir(code, 16-sizeof(void*), RSP, SZ_PTR);
 	uint32_t adjust_size = code->cur - opts->gen.handle_cycle_limit_int;
 	code->cur = opts->gen.handle_cycle_limit_int;
+	//an interrupt or sync can change what an idle loop sees, so measurements start over
+	mov_irdisp(code, IDLE_BRANCH_NONE, opts->gen.context_reg, offsetof(m68k_context, idle_branch), SZ_D);
 	//handle trace mode
 	cmp_irdisp(code, 0, opts->gen.context_reg, offsetof(m68k_context, trace_pending), SZ_B);
 	code_ptr do_trace = code->cur + 1;
@@ -2981,8 +3252,22 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	skip_sync = code->cur + 1;
 	jcc(code, CC_C, code->cur + 2);
 	call(code, opts->gen.save_context);
+	push_r(code, opts->gen.scratch1);
 	call_args_abi(code, (code_ptr)sync_components, 2, opts->gen.context_reg, opts->gen.scratch1);
 	mov_rr(code, RAX, opts->gen.context_reg, SZ_PTR);
+	pop_r(code, opts->gen.scratch1);
+	//this is the only place we come back from C with nothing but a return address
+	//into translated code on the stack, so pending code cache flushes happen here
+	mov_rdispr(code, opts->gen.context_reg, offsetof(m68k_context, options), opts->gen.scratch2, SZ_PTR);
+	cmp_irdisp(code, 0, opts->gen.scratch2, offsetof(m68k_options, gen.code_cache.flush_pending), SZ_B);
+	jcc(code, CC_Z, opts->gen.load_context);
+	push_r(code, opts->gen.context_reg);
+	call_args_abi(code, (code_ptr)m68k_sync_flush, 2, opts->gen.context_reg, opts->gen.scratch1);
+	pop_r(code, opts->gen.context_reg);
+	cmp_ir(code, 0, RAX, SZ_PTR);
+	jcc(code, CC_Z, opts->gen.load_context);
+	//the code the return address points to is gone, resume in the new copy of the prologue
+	mov_rrind(code, RAX, RSP, SZ_PTR);
 	jmp(code, opts->gen.load_context);
 	*skip_sync = code->cur - (skip_sync+1);
 	cmp_irdisp(code, 0, opts->gen.context_reg, offsetof(m68k_context, should_return), SZ_B);
@@ -3194,14 +3479,14 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	tmp_stack_off = code->stack_off;
 	//Calculate length of prologue
 	check_cycles_int(&opts->gen, 0x1234);
-	int check_int_size = code->cur-opts->bp_stub;
+	opts->prologue_size = code->cur - opts->bp_stub;
 	code->cur = opts->bp_stub;
 	code->stack_off = tmp_stack_off;
 	opts->prologue_start = *opts->bp_stub;
-	//Calculate length of patch
+	//Calculate return offset of the call in the cold part of the prologue
 	mov_ir(code, 0x1234, opts->gen.scratch1, SZ_D);
-	call(code, opts->bp_stub);
-	int patch_size = code->cur - opts->bp_stub;
+	call(code, opts->gen.handle_cycle_limit_int);
+	opts->prologue_ret_off = code->cur - opts->bp_stub - adjust_size;
 	code->cur = opts->bp_stub;
 	code->stack_off = tmp_stack_off;
 
@@ -3217,13 +3502,14 @@ void init_m68k_opts(m68k_options * opts, memmap_chunk * memmap, uint32_t num_chu
 	cmp_rr(code, opts->gen.cycles, opts->gen.limit, SZ_D);
 	code_ptr jmp_off = code->cur + 1;
 	jcc(code, CC_NC, code->cur + 7);
+	mov_irdisp(code, 1, opts->gen.context_reg, offsetof(m68k_context, in_bp_stub), SZ_B);
 	call(code, opts->gen.handle_cycle_limit_int);
+	mov_irdisp(code, 0, opts->gen.context_reg, offsetof(m68k_context, in_bp_stub), SZ_B);
 	*jmp_off = code->cur - (jmp_off+1);
-	//jump back to body of translated instruction
-	pop_r(code, opts->gen.scratch1);
-	add_ir(code, check_int_size - patch_size, opts->gen.scratch1, SZ_PTR);
-	jmp_r(code, opts->gen.scratch1);
+	//return to the breakpoint's cold stub, which jumps back to the body of the translated instruction
+	retn(code);
 	code->stack_off = tmp_stack_off;
 	
 	retranslate_calc(&opts->gen);
+	init_code_cache(&opts->gen, DEFAULT_CODE_CACHE_SIZE);
 }
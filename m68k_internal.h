@@ -38,6 +38,10 @@ void m68k_trap_if_not_supervisor(m68k_options *opts, m68kinst *inst);
 void m68k_breakpoint_patch(m68k_context *context, uint32_t address, m68k_debug_handler bp_handler, code_ptr native_addr);
 void m68k_check_cycles_int_latch(m68k_options *opts);
 uint8_t translate_m68k_op(m68kinst * inst, host_ea * ea, m68k_options * opts, uint8_t dst);
+void jump_m68k_indirect(m68k_options *opts);
+void jump_m68k_return(m68k_options *opts);
+void m68k_check_cycles_int_flags(m68k_options *opts, uint32_t address, m68kinst *flags_from);
+uint8_t m68k_fall_through_to(m68k_options *opts, uint32_t address);
 
 //functions implemented in m68k_core.c
 int8_t native_reg(m68k_op_info * op, m68k_options * opts);
@@ -50,10 +54,14 @@ void m68k_save_result(m68kinst * inst, m68k_options * opts);
 void jump_m68k_abs(m68k_options * opts, uint32_t address);
 void swap_ssp_usp(m68k_options * opts);
 code_ptr get_native_address(m68k_options *opts, uint32_t address);
+uint8_t m68k_code_word_changed(m68k_context *context, uint32_t address);
+uint32_t m68k_inst_end(m68k_options *opts, uint32_t inst_start);
 uint8_t m68k_is_terminal(m68kinst * inst);
 code_ptr get_native_address_trans(m68k_context * context, uint32_t address);
 void * m68k_retranslate_inst(uint32_t address, m68k_context * context);
 m68k_context *m68k_bp_dispatcher(m68k_context *context, uint32_t address);
+void m68k_assign_host_regs(m68k_options *opts);
+void m68k_idle_loop(m68k_context *context, uint32_t branch);
 
 //individual instructions
 void translate_m68k_bcc(m68k_options * opts, m68kinst * inst);
@@ -105,6 +113,11 @@ void translate_m68k_reset(m68k_options *opts, m68kinst *inst);
 
 #define BUS 4
 #define PREDEC_PENALTY 2
+#define M68K_MAX_INST_SIZE (2*(1+2+2))
+//longest loop body considered for idle loop skipping
+#define M68K_IDLE_LOOP_BYTES 32
+#define IDLE_BRANCH_NONE 0xFFFFFFFF
+#define IDLE_BRANCH_REJECTED 0x80000000
 extern char disasm_buf[1024];
 
 m68k_context * sync_components(m68k_context * context, uint32_t address);
@@ -4,12 +4,22 @@
  BlastEm is free software distributed under the terms of the GNU General Public License version 3 or greater. See COPYING for full license text.
 */
 
+#include <stdint.h>
 #include "mem.h"
+#include "arena.h"
 #include <windows.h>
 
 void * alloc_code(size_t *size)
 {
+	uint8_t *ret = try_alloc_arena();
+	if (ret) {
+		return ret;
+	}
 	*size += PAGE_SIZE - (*size & (PAGE_SIZE - 1));
 
-	return VirtualAlloc(NULL, *size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	ret = VirtualAlloc(NULL, *size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	if (ret) {
+		track_block(ret);
+	}
+	return ret;
 }
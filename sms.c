@@ -109,17 +109,24 @@ static uint8_t io_read(uint32_t location, void *vcontext)
 	return 0xFF;
 }
 
+//translations are only kept around for ROM banks, cartridge RAM can change
+//while it's switched out
+static uint8_t *cacheable_bank(sms_context *sms, uint8_t *bank)
+{
+	return bank >= sms->rom && bank < sms->rom + sms->rom_size ? bank : NULL;
+}
+
 static void update_mem_map(uint32_t location, sms_context *sms, uint8_t value)
 {
 	z80_context *z80 = sms->z80;
-	void *old_value;
+	uint8_t *old_value;
 	if (location) {
 		uint32_t idx = location - 1;
 		old_value = z80->mem_pointers[idx];
 		z80->mem_pointers[idx] = sms->rom + (value << 14 & (sms->rom_size-1));
 		if (old_value != z80->mem_pointers[idx]) {
-			//invalidate any code we translated for the relevant bank
-			z80_invalidate_code_range(z80, idx ? idx * 0x4000 : 0x400, idx * 0x4000 + 0x4000);
+			//swap out any code we translated for the relevant bank
+			z80_switch_code_bank(z80, idx ? idx * 0x4000 : 0x400, idx * 0x4000 + 0x4000, cacheable_bank(sms, old_value), z80->mem_pointers[idx]);
 		}
 	} else {
 		old_value = z80->mem_pointers[2];
@@ -131,8 +138,8 @@ static void update_mem_map(uint32_t location, sms_context *sms, uint8_t value)
 			z80->mem_pointers[2] = sms->rom + (sms->bank_regs[3] << 14 & (sms->rom_size-1));
 		}
 		if (old_value != z80->mem_pointers[2]) {
-			//invalidate any code we translated for the relevant bank
-			z80_invalidate_code_range(z80, 0x8000, 0xC000);
+			//swap out any code we translated for the relevant bank
+			z80_switch_code_bank(z80, 0x8000, 0xC000, cacheable_bank(sms, old_value), cacheable_bank(sms, z80->mem_pointers[2]));
 		}
 	}
 }
@@ -498,6 +505,7 @@ sms_context *alloc_configure_sms(system_media *media, uint32_t opts, uint8_t for
 	memcpy(info_out->map, memory_map, sizeof(memmap_chunk) * info_out->map_chunks);
 	z80_options *zopts = malloc(sizeof(z80_options));
 	init_z80_opts(zopts, info_out->map, info_out->map_chunks, io_map, 4, 15, 0xFF);
+	zopts->gen.profile.enabled = !strcmp("on", tern_find_path_default(config, "system\0profile_code\0", (tern_val){.ptrval = "off"}, TVAL_PTR).ptrval);
 	sms->z80 = init_z80_context(zopts);
 	sms->z80->system = sms;
 	sms->z80->options->gen.debug_cmd_handler = debug_commands;
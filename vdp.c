@@ -10,6 +10,9 @@
 #include <string.h>
 #include "render.h"
 #include "util.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define NTSC_INACTIVE_START 224
 #define PAL_INACTIVE_START 240
@@ -61,6 +64,9 @@ enum {
 	ACTIVE
 };
 
+//pixel generation is left to the render thread when the VDP has been split with vdp_start_render_thread
+#define SKIP_ON_TIMING_THREAD if (context->thread_role == VDP_THREAD_TIMING) { return; }
+
 static int32_t color_map[1 << 12];
 static uint16_t mode4_address_map[0x4000];
 static uint32_t planar_to_chunky[256];
@@ -74,6 +80,130 @@ static uint8_t debug_base[][3] = {
 	{127, 0, 127}    //Sprites
 };
 
+#define VDP_LOG_SIZE (1 << 16)
+
+enum {
+	VDP_LOG_VRAM,
+	VDP_LOG_SAT,
+	VDP_LOG_CRAM,
+	VDP_LOG_VSRAM,
+	//the entries above are memory writes made from an access slot, the ones below are made between runs
+	VDP_LOG_RUN,
+	VDP_LOG_REG,
+	VDP_LOG_TEST_PORT,
+	VDP_LOG_DEBUG,
+	VDP_LOG_ADJUST,
+	VDP_LOG_SYNC,
+	VDP_LOG_QUIT
+};
+#define VDP_LOG_LAST_SLOT VDP_LOG_VSRAM
+
+typedef struct {
+	uint32_t cycle;
+	uint32_t value;
+	uint16_t address;
+	uint8_t  type;
+} vdp_log_entry;
+
+struct vdp_thread {
+	vdp_log_entry *log;
+	vdp_context   *render;
+	SDL_Thread    *thread;
+	SDL_sem       *wake;
+	SDL_sem       *done;
+	SDL_sem       *resume;
+	SDL_atomic_t  tail; //entries published by the emulation thread
+	SDL_atomic_t  head; //entries consumed by the render thread
+	SDL_atomic_t  sleeping;
+	uint32_t      write_pos;
+	uint32_t      published;
+	uint32_t      read_pos;
+	uint8_t       frame_pending;
+	uint8_t       frame_waiting;
+	uint8_t       active_run;   //active display has been run since sprite status was last collected from the render thread
+	uint8_t       debug;
+	uint8_t       debug_pal;
+};
+
+static void vdp_swap_framebuffer(vdp_context *context)
+{
+	render_framebuffer_updated(context->cur_buffer, context->h40_lines > (context->inactive_start + context->border_top) / 2 ? LINEBUF_SIZE : (256+HORIZ_BORDER));
+	context->cur_buffer = context->flags2 & FLAG2_EVEN_FIELD ? FRAMEBUFFER_EVEN : FRAMEBUFFER_ODD;
+	context->fb = render_get_framebuffer(context->cur_buffer, &context->output_pitch);
+}
+
+static vdp_log_entry *vdp_log_append(vdp_thread *thread, uint8_t type, uint32_t cycle)
+{
+	vdp_log_entry *entry = thread->log + (thread->write_pos++ & (VDP_LOG_SIZE-1));
+	entry->type = type;
+	entry->cycle = cycle;
+	return entry;
+}
+
+static void vdp_log_publish(vdp_thread *thread)
+{
+	SDL_AtomicAdd(&thread->tail, thread->write_pos - thread->published);
+	thread->published = thread->write_pos;
+	if (SDL_AtomicCAS(&thread->sleeping, 1, 0)) {
+		SDL_SemPost(thread->wake);
+	}
+}
+
+//waits for the render thread to catch up with everything logged so far
+//frames it completes in the meantime are presented from here as the frontend belongs to this thread
+static void vdp_thread_wait(vdp_context *context)
+{
+	vdp_thread *thread = context->thread;
+	vdp_log_append(thread, VDP_LOG_SYNC, context->cycles);
+	vdp_log_publish(thread);
+	thread->frame_pending = 0;
+	for (;;)
+	{
+		SDL_SemWait(thread->done);
+		if (!thread->frame_waiting) {
+			break;
+		}
+		thread->frame_waiting = 0;
+		vdp_swap_framebuffer(thread->render);
+		SDL_SemPost(thread->resume);
+	}
+}
+
+static vdp_log_entry *vdp_log(vdp_context *context, uint8_t type)
+{
+	vdp_thread *thread = context->thread;
+	//leave room for the run and sync entries below
+	if (thread->write_pos - (uint32_t)SDL_AtomicGet(&thread->head) >= VDP_LOG_SIZE - 2) {
+		//the render thread can only stop at a slot boundary, so writes already logged for the
+		//current slot need to go after the partial run that lets it catch up
+		vdp_log_entry slot_writes[8];
+		uint32_t num_slot = 0;
+		while (thread->write_pos != thread->published && num_slot < 8)
+		{
+			vdp_log_entry *last = thread->log + ((thread->write_pos - 1) & (VDP_LOG_SIZE-1));
+			if (last->type > VDP_LOG_LAST_SLOT || last->cycle != context->cycles) {
+				break;
+			}
+			slot_writes[num_slot++] = *last;
+			thread->write_pos--;
+		}
+		vdp_log_append(thread, VDP_LOG_RUN, context->cycles)->value = context->cycles;
+		vdp_thread_wait(context);
+		while (num_slot)
+		{
+			thread->log[thread->write_pos++ & (VDP_LOG_SIZE-1)] = slot_writes[--num_slot];
+		}
+	}
+	return vdp_log_append(thread, type, context->cycles);
+}
+
+static void vdp_log_write(vdp_context *context, uint8_t type, uint16_t address, uint16_t value)
+{
+	vdp_log_entry *entry = vdp_log(context, type);
+	entry->address = address;
+	entry->value = value;
+}
+
 static void update_video_params(vdp_context *context)
 {
 	if (context->regs[REG_MODE_2] & BIT_MODE_5) {
@@ -143,6 +273,8 @@ void init_vdp_context(vdp_context * context, uint8_t region_pal)
 	memset(context, 0, sizeof(*context));
 	context->vdpmem = malloc(VRAM_SIZE);
 	memset(context->vdpmem, 0, VRAM_SIZE);
+	context->tile_cache = malloc(TILE_CACHE_SIZE);
+	vdp_invalidate_tile_cache(context);
 	/*
 	*/
 	if (headless) {
@@ -254,7 +386,23 @@ void init_vdp_context(vdp_context * context, uint8_t region_pal)
 
 void vdp_free(vdp_context *context)
 {
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_thread *thread = context->thread;
+		//make sure the render thread isn't stuck waiting for a frame to be presented
+		vdp_thread_wait(context);
+		vdp_log(context, VDP_LOG_QUIT);
+		vdp_log_publish(thread);
+		SDL_WaitThread(thread->thread, NULL);
+		SDL_DestroySemaphore(thread->wake);
+		SDL_DestroySemaphore(thread->done);
+		SDL_DestroySemaphore(thread->resume);
+		vdp_free(thread->render);
+		free(thread->log);
+		free(thread);
+		free(context->output);
+	}
 	free(context->vdpmem);
+	free(context->tile_cache);
 	free(context->linebuf);
 	free(context);
 }
@@ -280,40 +428,55 @@ static void increment_address(vdp_context *context)
 	}
 }
 
+void vdp_invalidate_tile_cache(vdp_context *context)
+{
+	memset(context->tile_dirty, 0xFF, sizeof(context->tile_dirty));
+}
+
+static void mark_tile_dirty(vdp_context *context, uint32_t address)
+{
+	context->tile_dirty[address >> 10] |= 1U << (address >> 5 & 31);
+}
+
+//returns the 8 pixels of the pattern row at address in normal order followed by the same row H-flipped
+static uint8_t *tile_cache_row(vdp_context *context, uint16_t address)
+{
+	uint32_t pattern = address >> 5;
+	if (context->tile_dirty[pattern >> 5] & (1U << (pattern & 31))) {
+		context->tile_dirty[pattern >> 5] &= ~(1U << (pattern & 31));
+		uint8_t *src = context->vdpmem + pattern * 32;
+		uint8_t *dst = context->tile_cache + pattern * 32 * 4;
+		for (uint32_t row = 0; row < 8; row++, dst += 16)
+		{
+			for (uint32_t i = 0; i < 4; i++, src++)
+			{
+				dst[i*2] = dst[15 - i*2] = *src >> 4;
+				dst[i*2 + 1] = dst[14 - i*2] = *src & 0xF;
+			}
+		}
+	}
+	return context->tile_cache + (address & ~3) * 4;
+}
+
 static void render_sprite_cells(vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	sprite_draw * d = context->sprite_draw_list + context->cur_slot;
 	context->serial_address = d->address;
 	if (context->cur_slot >= context->sprite_draws) {
-
-		uint16_t dir;
-		int16_t x;
-		if (d->h_flip) {
-			x = d->x_pos + 7;
-			dir = -1;
-		} else {
-			x = d->x_pos;
-			dir = 1;
-		}
-		//printf("Draw Slot %d of %d, Rendering sprite cell from %X to x: %d\n", context->cur_slot, context->sprite_draws, d->address, x);
+		//printf("Draw Slot %d of %d, Rendering sprite cell from %X to x: %d\n", context->cur_slot, context->sprite_draws, d->address, d->x_pos);
 		context->cur_slot--;
-		for (uint16_t address = d->address; address != ((d->address+4) & 0xFFFF); address++) {
-			if (x >= 0 && x < 320) {
-				if (!(context->linebuf[x] & 0xF)) {
-					context->linebuf[x] = (context->vdpmem[address] >> 4) | d->pal_priority;
-				} else if (context->vdpmem[address] >> 4) {
-					context->flags2 |= FLAG2_SPRITE_COLLIDE;
-				}
-			}
-			x += dir;
-			if (x >= 0 && x < 320) {
-				if (!(context->linebuf[x] & 0xF)) {
-					context->linebuf[x] = (context->vdpmem[address] & 0xF)  | d->pal_priority;
-				} else if (context->vdpmem[address] & 0xF) {
-					context->flags2 |= FLAG2_SPRITE_COLLIDE;
-				}
+		uint8_t *pixels = tile_cache_row(context, d->address) + (d->h_flip ? 8 : 0);
+		int16_t start = d->x_pos < 0 ? -d->x_pos : 0;
+		int16_t end = d->x_pos > 320 - 8 ? 320 - d->x_pos : 8;
+		for (int16_t i = start; i < end; i++)
+		{
+			uint8_t *dst = context->linebuf + d->x_pos + i;
+			if (!(*dst & 0xF)) {
+				*dst = pixels[i] | d->pal_priority;
+			} else if (pixels[i]) {
+				context->flags2 |= FLAG2_SPRITE_COLLIDE;
 			}
-			x += dir;
 		}
 	} else {
 		context->cur_slot--;
@@ -322,6 +485,7 @@ static void render_sprite_cells(vdp_context * context)
 
 static void fetch_sprite_cells_mode4(vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	if (context->sprite_index >= context->sprite_draws) {
 		sprite_draw * d = context->sprite_draw_list + context->sprite_index;
 		uint32_t address = mode4_address_map[d->address & 0x3FFF];
@@ -332,6 +496,7 @@ static void fetch_sprite_cells_mode4(vdp_context * context)
 
 static void render_sprite_cells_mode4(vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	if (context->sprite_index >= context->sprite_draws) {
 		sprite_draw * d = context->sprite_draw_list + context->sprite_index;
 		uint32_t pixels = planar_to_chunky[context->fetch_tmp[0]] << 1;
@@ -552,6 +717,7 @@ static uint8_t is_active(vdp_context *context)
 
 static void scan_sprite_table(uint32_t line, vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	if (context->sprite_index && ((uint8_t)context->slot_counter) < context->max_sprites_line) {
 		line += 1;
 		uint16_t ymask, ymin;
@@ -611,6 +777,7 @@ static void scan_sprite_table(uint32_t line, vdp_context * context)
 
 static void scan_sprite_table_mode4(vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	if (context->sprite_index < MAX_SPRITES_FRAME_H32) {
 		uint32_t line = context->vcounter;
 		line &= 0xFF;
@@ -661,6 +828,7 @@ static void scan_sprite_table_mode4(vdp_context * context)
 
 static void read_sprite_x(uint32_t line, vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	if (context->cur_slot == context->max_sprites_line) {
 		context->cur_slot = 0;
 	}
@@ -753,6 +921,7 @@ static void read_sprite_x(uint32_t line, vdp_context * context)
 
 static void read_sprite_x_mode4(vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	if (context->cur_slot >= context->slot_counter) {
 		uint32_t address = (context->regs[REG_SAT] << 7 & 0x3F00) + 0x80 + context->sprite_info_list[context->cur_slot].index * 2;
 		address = mode4_address_map[address];
@@ -791,6 +960,9 @@ void write_cram_internal(vdp_context * context, uint16_t addr, uint16_t value)
 
 static void write_cram(vdp_context * context, uint16_t address, uint16_t value)
 {
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_log_write(context, VDP_LOG_CRAM, address, value);
+	}
 	uint16_t addr;
 	if (context->regs[REG_MODE_2] & BIT_MODE_5) {
 		addr = (address/2) & (CRAM_SIZE-1);
@@ -828,6 +1000,14 @@ static void vdp_advance_dma(vdp_context * context)
 	}
 }
 
+static void write_sat_cache(vdp_context *context, uint16_t cache_address, uint8_t value)
+{
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_log_write(context, VDP_LOG_SAT, cache_address, value);
+	}
+	context->sat_cache[cache_address] = value;
+}
+
 static void vdp_check_update_sat(vdp_context *context, uint32_t address, uint16_t value)
 {
 	if (context->regs[REG_MODE_2] & BIT_MODE_5) {
@@ -836,8 +1016,8 @@ static void vdp_check_update_sat(vdp_context *context, uint32_t address, uint16_
 			if(address >= sat_address && address < (sat_address + SAT_CACHE_SIZE*2)) {
 				uint16_t cache_address = address - sat_address;
 				cache_address = (cache_address & 3) | (cache_address >> 1 & 0x1FC);
-				context->sat_cache[cache_address] = value >> 8;
-				context->sat_cache[cache_address^1] = value;
+				write_sat_cache(context, cache_address, value >> 8);
+				write_sat_cache(context, cache_address^1, value);
 			}
 		}
 	}
@@ -851,18 +1031,35 @@ void vdp_check_update_sat_byte(vdp_context *context, uint32_t address, uint8_t v
 			if(address >= sat_address && address < (sat_address + SAT_CACHE_SIZE*2)) {
 				uint16_t cache_address = address - sat_address;
 				cache_address = (cache_address & 3) | (cache_address >> 1 & 0x1FC);
-				context->sat_cache[cache_address] = value;
+				write_sat_cache(context, cache_address, value);
 			}
 		}
 	}
 }
 
+static void write_vdpmem(vdp_context *context, uint16_t address, uint8_t value)
+{
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_log_write(context, VDP_LOG_VRAM, address, value);
+	}
+	context->vdpmem[address] = value;
+	mark_tile_dirty(context, address);
+}
+
+static void write_vsram(vdp_context *context, uint16_t index, uint16_t value)
+{
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_log_write(context, VDP_LOG_VSRAM, index, value);
+	}
+	context->vsram[index] = value;
+}
+
 static void write_vram_word(vdp_context *context, uint32_t address, uint16_t value)
 {
 	address = (address & 0x3FC) | (address >> 1 & 0xFC01) | (address >> 9 & 0x2);
 	address ^= 1;
 	//TODO: Support an option to actually have 128KB of VRAM
-	context->vdpmem[address] = value;
+	write_vdpmem(context, address, value);
 }
 
 static void write_vram_byte(vdp_context *context, uint32_t address, uint8_t value)
@@ -872,11 +1069,65 @@ static void write_vram_byte(vdp_context *context, uint32_t address, uint8_t valu
 	} else {
 		address = mode4_address_map[address & 0x3FFF];
 	}
-	context->vdpmem[address] = value;
+	write_vdpmem(context, address, value);
+}
+
+static void replay_slot_write(vdp_context *context, vdp_log_entry *entry)
+{
+	switch (entry->type)
+	{
+	case VDP_LOG_VRAM:
+		write_vdpmem(context, entry->address, entry->value);
+		break;
+	case VDP_LOG_SAT:
+		context->sat_cache[entry->address] = entry->value;
+		break;
+	case VDP_LOG_CRAM:
+		write_cram(context, entry->address, entry->value);
+		break;
+	case VDP_LOG_VSRAM:
+		context->vsram[entry->address] = entry->value;
+		break;
+	}
+}
+
+//the render thread sees the FIFO and DMA only through the writes they made on the emulation thread
+static void replay_external_slot(vdp_context *context)
+{
+	vdp_thread *thread = context->thread;
+	for (;;)
+	{
+		vdp_log_entry *entry = thread->log + (thread->read_pos & (VDP_LOG_SIZE-1));
+		if (entry->type > VDP_LOG_LAST_SLOT || entry->cycle != context->cycles) {
+			return;
+		}
+		replay_slot_write(context, entry);
+		thread->read_pos++;
+	}
+}
+
+static void dma_copy_slot(vdp_context *context)
+{
+	if (context->flags & FLAG_READ_FETCHED) {
+		write_vram_byte(context, context->address ^ 1, context->prefetch);
+		
+		//Update DMA state
+		vdp_advance_dma(context);
+		
+		context->flags &= ~FLAG_READ_FETCHED;
+	} else {
+		context->prefetch = context->vdpmem[(context->regs[REG_DMASRC_M] << 8) | context->regs[REG_DMASRC_L] ^ 1];
+		
+		context->flags |= FLAG_READ_FETCHED;
+	}
 }
 
 static void external_slot(vdp_context * context)
 {
+	if (context->thread_role == VDP_THREAD_RENDER) {
+		replay_external_slot(context);
+		return;
+	}
 	if ((context->flags & FLAG_DMA_RUN) && (context->regs[REG_DMASRC_H] & 0xC0) == 0x80 && context->fifo_read < 0) {
 		context->fifo_read = (context->fifo_write-1) & (FIFO_SIZE-1);
 		fifo_entry * cur = context->fifo + context->fifo_read;
@@ -928,16 +1179,15 @@ static void external_slot(vdp_context * context)
 		case VSRAM_WRITE:
 			if (((start->address/2) & 63) < VSRAM_SIZE) {
 				//printf("VSRAM Write: %X to %X @ frame: %d, vcounter: %d, hslot: %d, cycle: %d\n", start->value, start->address, context->frame, context->vcounter, context->hslot, context->cycles);
+				uint16_t index = (start->address/2) & 63;
 				if (start->partial == 3) {
 					if (start->address & 1) {
-						context->vsram[(start->address/2) & 63] &= 0xFF;
-						context->vsram[(start->address/2) & 63] |= start->value << 8;
+						write_vsram(context, index, (context->vsram[index] & 0xFF) | start->value << 8);
 					} else {
-						context->vsram[(start->address/2) & 63] &= 0xFF00;
-						context->vsram[(start->address/2) & 63] |= start->value;
+						write_vsram(context, index, (context->vsram[index] & 0xFF00) | start->value);
 					}
 				} else {
-					context->vsram[(start->address/2) & 63] = start->partial == 2 ? context->fifo[context->fifo_write].value : start->value;
+					write_vsram(context, index, start->partial == 2 ? context->fifo[context->fifo_write].value : start->value);
 				}
 			}
 
@@ -951,24 +1201,13 @@ static void external_slot(vdp_context * context)
 			context->fifo_read = -1;
 		}
 	} else if ((context->flags & FLAG_DMA_RUN) && (context->regs[REG_DMASRC_H] & 0xC0) == 0xC0) {
-		if (context->flags & FLAG_READ_FETCHED) {
-			write_vram_byte(context, context->address ^ 1, context->prefetch);
-			
-			//Update DMA state
-			vdp_advance_dma(context);
-			
-			context->flags &= ~FLAG_READ_FETCHED;
-		} else {
-			context->prefetch = context->vdpmem[(context->regs[REG_DMASRC_M] << 8) | context->regs[REG_DMASRC_L] ^ 1];
-			
-			context->flags |= FLAG_READ_FETCHED;
-		}
+		dma_copy_slot(context);
 	} else if (!(context->cd & 1) && !(context->flags & (FLAG_READ_FETCHED|FLAG_PENDING))) {
 		switch(context->cd & 0xF)
 		{
 		case VRAM_READ:
 			if (context->flags2 & FLAG2_READ_PENDING) {
-				context->prefetch |= context->vdpmem[context->address | 1];
+				context->prefetch |= context->vdpmem[(context->address | 1) & 0xFFFF];
 				context->flags |= FLAG_READ_FETCHED;
 				context->flags2 &= ~FLAG2_READ_PENDING;
 				//Should this happen after the prefetch or after the read?
@@ -980,7 +1219,7 @@ static void external_slot(vdp_context * context)
 			}
 			break;
 		case VRAM_READ8: {
-			uint32_t address = context->address ^ 1;
+			uint32_t address = (context->address ^ 1) & 0xFFFF;
 			if (!(context->regs[REG_MODE_2] & BIT_MODE_5)) {
 				address = mode4_address_map[address & 0x3FFF];
 			}
@@ -1018,7 +1257,7 @@ static void run_dma_src(vdp_context * context, int32_t slot)
 {
 	//TODO: Figure out what happens if CD bit 4 is not set in DMA copy mode
 	//TODO: Figure out what happens when CD:0-3 is not set to a write mode in DMA operations
-	if (context->fifo_write == context->fifo_read) {
+	if (context->fifo_write == context->fifo_read || context->thread_role == VDP_THREAD_RENDER) {
 		return;
 	}
 	fifo_entry * cur = NULL;
@@ -1046,6 +1285,7 @@ static void run_dma_src(vdp_context * context, int32_t slot)
 
 static void read_map_scroll(uint16_t column, uint16_t vsram_off, uint32_t line, uint16_t address, uint16_t hscroll_val, vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	uint16_t window_line_shift, v_offset_mask, vscroll_shift;
 	if (context->double_res) {
 		line *= 2;
@@ -1184,6 +1424,7 @@ static void read_map_scroll_b(uint16_t column, uint32_t line, vdp_context * cont
 
 static void read_map_mode4(uint16_t column, uint32_t line, vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	uint32_t address = (context->regs[REG_SCROLL_A] & 0xE) << 10;
 	//add row
 	uint32_t vscroll = line;
@@ -1203,6 +1444,7 @@ static void read_map_mode4(uint16_t column, uint32_t line, vdp_context * context
 
 static void render_map(uint16_t col, uint8_t * tmp_buf, uint8_t offset, vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	uint16_t address;
 	uint16_t vflip_base;
 	if (context->double_res) {
@@ -1218,6 +1460,14 @@ static void render_map(uint16_t col, uint8_t * tmp_buf, uint8_t offset, vdp_cont
 		address += 4 * context->v_offset;
 	}
 	uint16_t pal_priority = (col >> 9) & 0x70;
+	uint8_t *pixels = tile_cache_row(context, address);
+	if (offset <= SCROLL_BUFFER_SIZE - 8) {
+		uint64_t row;
+		memcpy(&row, pixels + ((col & MAP_BIT_H_FLIP) ? 8 : 0), sizeof(row));
+		row |= pal_priority * 0x0101010101010101ULL;
+		memcpy(tmp_buf + offset, &row, sizeof(row));
+		return;
+	}
 	int32_t dir;
 	if (col & MAP_BIT_H_FLIP) {
 		offset += 7;
@@ -1226,12 +1476,9 @@ static void render_map(uint16_t col, uint8_t * tmp_buf, uint8_t offset, vdp_cont
 	} else {
 		dir = 1;
 	}
-	for (uint32_t i=0; i < 4; i++, address++)
+	for (uint32_t i=0; i < 8; i++)
 	{
-		tmp_buf[offset] = pal_priority | (context->vdpmem[address] >> 4);
-		offset += dir;
-		offset &= SCROLL_BUFFER_MASK;
-		tmp_buf[offset] = pal_priority | (context->vdpmem[address] & 0xF);
+		tmp_buf[offset] = pal_priority | pixels[i];
 		offset += dir;
 		offset &= SCROLL_BUFFER_MASK;
 	}
@@ -1254,6 +1501,7 @@ static void render_map_3(vdp_context * context)
 
 static void fetch_map_mode4(uint16_t col, uint32_t line, vdp_context *context)
 {
+	SKIP_ON_TIMING_THREAD
 	//calculate pixel row to fetch
 	uint32_t vscroll = line;
 	if (col < 24 || !(context->regs[REG_MODE_1] & BIT_VSCRL_LOCK)) {
@@ -1272,8 +1520,105 @@ static void fetch_map_mode4(uint16_t col, uint32_t line, vdp_context *context)
 	context->fetch_tmp[1] = context->vdpmem[address+1];
 }
 
+#ifdef __SSE2__
+//Loads 16 bytes of a scroll buffer starting at off, wrapping around its end if needed
+static __m128i load_scroll_buf(uint8_t *buf, int off)
+{
+	off &= SCROLL_BUFFER_MASK;
+	if (off <= SCROLL_BUFFER_SIZE - 16) {
+		return _mm_loadu_si128((__m128i *)(buf + off));
+	}
+	uint8_t tmp[16];
+	memcpy(tmp, buf + off, SCROLL_BUFFER_SIZE - off);
+	memcpy(tmp + SCROLL_BUFFER_SIZE - off, buf, off - (SCROLL_BUFFER_SIZE - 16));
+	return _mm_loadu_si128((__m128i *)tmp);
+}
+
+static __m128i select_bytes(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+//Composites a 16 pixel column pair the same way the scalar loops in render_map_output do,
+//but with the priority and transparency checks done for all 16 pixels at once.
+//Doesn't handle the test register layer select, which is left to the scalar code
+static uint32_t *composite_16_sse2(vdp_context *context, uint32_t *dst, int plane_a_off, int plane_b_off, uint8_t *sprite_buf, uint8_t a_src, uint8_t output_disabled)
+{
+	__m128i plane_a = load_scroll_buf(context->tmp_buf_a, plane_a_off);
+	__m128i plane_b = load_scroll_buf(context->tmp_buf_b, plane_b_off);
+	__m128i sprite = _mm_loadu_si128((__m128i *)sprite_buf);
+	__m128i zero = _mm_setzero_si128();
+	__m128i low_nibble = _mm_set1_epi8(0xF);
+	__m128i priority = _mm_set1_epi8(BUF_BIT_PRIORITY);
+	__m128i pixel = _mm_set1_epi8(context->regs[REG_BG_COLOR]);
+	__m128i src = _mm_set1_epi8(DBG_SRC_BG);
+	__m128i shadow = zero, hilight = zero;
+	uint8_t hilight_mode = (context->regs[REG_MODE_4] & BIT_HILIGHT) != 0;
+	if (hilight_mode || !output_disabled) {
+		__m128i opaque = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(plane_b, low_nibble), zero), _mm_set1_epi8(-1));
+		pixel = select_bytes(opaque, plane_b, pixel);
+		src = select_bytes(opaque, _mm_set1_epi8(DBG_SRC_B), src);
+		__m128i intensity = _mm_and_si128(plane_b, priority);
+
+		//a layer wins unless it's transparent or it's low priority and what's below isn't
+		__m128i pixel_pri = _mm_and_si128(pixel, priority);
+		__m128i low_pri = _mm_cmpeq_epi8(_mm_and_si128(plane_a, priority), zero);
+		opaque = _mm_cmpeq_epi8(_mm_and_si128(plane_a, low_nibble), zero);
+		__m128i wins = _mm_andnot_si128(_mm_or_si128(opaque, _mm_and_si128(low_pri, _mm_cmpeq_epi8(pixel_pri, priority))), _mm_set1_epi8(-1));
+		pixel = select_bytes(wins, plane_a, pixel);
+		src = select_bytes(wins, _mm_set1_epi8(a_src), src);
+		intensity = _mm_or_si128(intensity, _mm_and_si128(plane_a, priority));
+
+		pixel_pri = _mm_and_si128(pixel, priority);
+		low_pri = _mm_cmpeq_epi8(_mm_and_si128(sprite, priority), zero);
+		opaque = _mm_cmpeq_epi8(_mm_and_si128(sprite, low_nibble), zero);
+		wins = _mm_andnot_si128(_mm_or_si128(opaque, _mm_and_si128(low_pri, _mm_cmpeq_epi8(pixel_pri, priority))), _mm_set1_epi8(-1));
+		if (hilight_mode) {
+			//palette 3 colors 14 and 15 are the highlight and shadow operators rather than colors
+			__m128i color = _mm_and_si128(sprite, _mm_set1_epi8(0x3F));
+			__m128i op_hilight = _mm_and_si128(wins, _mm_cmpeq_epi8(color, _mm_set1_epi8(0x3E)));
+			__m128i op_shadow = _mm_and_si128(wins, _mm_cmpeq_epi8(color, _mm_set1_epi8(0x3F)));
+			wins = _mm_andnot_si128(_mm_or_si128(op_hilight, op_shadow), wins);
+			intensity = _mm_add_epi8(intensity, _mm_and_si128(op_hilight, priority));
+			intensity = _mm_andnot_si128(op_shadow, intensity);
+			__m128i normal = _mm_cmpeq_epi8(_mm_and_si128(sprite, low_nibble), _mm_set1_epi8(0xE));
+			__m128i sprite_intensity = select_bytes(normal, priority, _mm_or_si128(intensity, _mm_and_si128(sprite, priority)));
+			intensity = select_bytes(wins, sprite_intensity, intensity);
+			shadow = _mm_cmpeq_epi8(intensity, zero);
+			hilight = _mm_cmpeq_epi8(intensity, _mm_set1_epi8(BUF_BIT_PRIORITY*2));
+		}
+		pixel = select_bytes(wins, sprite, pixel);
+		src = select_bytes(wins, _mm_set1_epi8(DBG_SRC_S), src);
+	}
+	if (output_disabled) {
+		pixel = _mm_set1_epi8(0x3F);
+	}
+	uint8_t out[16];
+	uint32_t *colors;
+	if (context->debug) {
+		src = _mm_or_si128(src, _mm_and_si128(shadow, _mm_set1_epi8(DBG_SHADOW)));
+		src = _mm_or_si128(src, _mm_and_si128(hilight, _mm_set1_epi8(DBG_HILIGHT)));
+		_mm_storeu_si128((__m128i *)out, src);
+		colors = context->debugcolors;
+	} else {
+		//shadow and highlight colors follow the normal ones in colors
+		pixel = _mm_and_si128(pixel, _mm_set1_epi8(0x3F));
+		pixel = _mm_or_si128(pixel, _mm_and_si128(shadow, _mm_set1_epi8(CRAM_SIZE)));
+		pixel = _mm_or_si128(pixel, _mm_and_si128(hilight, _mm_set1_epi8(CRAM_SIZE*2)));
+		_mm_storeu_si128((__m128i *)out, pixel);
+		colors = context->colors;
+	}
+	for (int i = 0; i < 16; i++)
+	{
+		*(dst++) = colors[out[i]];
+	}
+	return dst;
+}
+#endif
+
 static void render_map_output(uint32_t line, int32_t col, vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	uint32_t *dst;
 	uint8_t output_disabled = (context->test_port & TEST_BIT_DISABLE) != 0;
 	uint8_t test_layer = context->test_port >> 7 & 3;
@@ -1320,6 +1665,11 @@ static void render_map_output(uint32_t line, int32_t col, vdp_context * context)
 			plane_b_off = context->buf_b_off - (context->hscroll_b & 0xF);
 			//printf("A | tmp_buf offset: %d\n", 8 - (context->hscroll_a & 0x7));
 
+#ifdef __SSE2__
+			if (!test_layer) {
+				dst = composite_16_sse2(context, dst, plane_a_off, plane_b_off, sprite_buf, a_src, output_disabled);
+			} else
+#endif
 			if (context->regs[REG_MODE_4] & BIT_HILIGHT) {
 				for (int i = 0; i < 16; ++plane_a_off, ++plane_b_off, ++sprite_buf, ++i) {
 					plane_a = context->tmp_buf_a + (plane_a_off & SCROLL_BUFFER_MASK);
@@ -1548,6 +1898,7 @@ static void render_map_output(uint32_t line, int32_t col, vdp_context * context)
 
 static void render_map_mode4(uint32_t line, int32_t col, vdp_context * context)
 {
+	SKIP_ON_TIMING_THREAD
 	uint32_t vscroll = line;
 	if (col < 24 || !(context->regs[REG_MODE_1] & BIT_VSCRL_LOCK)) {
 		vscroll += context->regs[REG_Y_SCROLL];
@@ -1730,9 +2081,16 @@ static void advance_output_line(vdp_context *context)
 			: 224 + BORDER_TOP_V28 + BORDER_BOT_V28;
 
 		if (context->output_lines == lines_max) {
-			render_framebuffer_updated(context->cur_buffer, context->h40_lines > (context->inactive_start + context->border_top) / 2 ? LINEBUF_SIZE : (256+HORIZ_BORDER));
-			context->cur_buffer = context->flags2 & FLAG2_EVEN_FIELD ? FRAMEBUFFER_EVEN : FRAMEBUFFER_ODD;
-			context->fb = render_get_framebuffer(context->cur_buffer, &context->output_pitch);
+			if (context->thread_role == VDP_THREAD_TIMING) {
+				//presented once the render thread gets here, see vdp_thread_wait
+				context->thread->frame_pending = 1;
+			} else if (context->thread_role == VDP_THREAD_RENDER) {
+				context->thread->frame_waiting = 1;
+				SDL_SemPost(context->thread->done);
+				SDL_SemWait(context->thread->resume);
+			} else {
+				vdp_swap_framebuffer(context);
+			}
 			context->h40_lines = 0;
 			context->frame++;
 			context->output_lines = 0;
@@ -1754,14 +2112,16 @@ static void advance_output_line(vdp_context *context)
 		} else {
 			output_line = INVALID_LINE;
 		}
-		context->output = (uint32_t *)(((char *)context->fb) + context->output_pitch * output_line);
-		context->done_output = context->output;
+		if (context->thread_role != VDP_THREAD_TIMING) {
+			context->output = (uint32_t *)(((char *)context->fb) + context->output_pitch * output_line);
+			context->done_output = context->output;
 #ifdef DEBUG_FB_FILL
-		for (int i = 0; i < LINEBUF_SIZE; i++)
-		{
-			context->output[i] = 0xFFFF00FF;
-		}
+			for (int i = 0; i < LINEBUF_SIZE; i++)
+			{
+				context->output[i] = 0xFFFF00FF;
+			}
 #endif	
+		}
 		if (output_line != INVALID_LINE && (context->regs[REG_MODE_4] & BIT_H40)) {
 			context->h40_lines++;
 		}
@@ -1770,12 +2130,20 @@ static void advance_output_line(vdp_context *context)
 
 void vdp_release_framebuffer(vdp_context *context)
 {
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_thread_wait(context);
+		context = context->thread->render;
+	}
 	render_framebuffer_updated(context->cur_buffer, context->h40_lines > (context->inactive_start + context->border_top) / 2 ? LINEBUF_SIZE : (256+HORIZ_BORDER));
 	context->output = context->fb = NULL;
 }
 
 void vdp_reacquire_framebuffer(vdp_context *context)
 {
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_thread_wait(context);
+		context = context->thread->render;
+	}
 	context->fb = render_get_framebuffer(context->cur_buffer, &context->output_pitch);
 	uint16_t lines_max = (context->flags2 & FLAG2_REGION_PAL) 
 			? 240 + BORDER_TOP_V30_PAL + BORDER_BOT_V30_PAL
@@ -1789,6 +2157,7 @@ void vdp_reacquire_framebuffer(vdp_context *context)
 
 static void render_border_garbage(vdp_context *context, uint32_t address, uint8_t *buf, uint8_t buf_off, uint16_t col)
 {
+	SKIP_ON_TIMING_THREAD
 	uint8_t base = col >> 9 & 0x30;
 	for (int i = 0; i < 4; i++, address++)
 	{
@@ -1800,6 +2169,7 @@ static void render_border_garbage(vdp_context *context, uint32_t address, uint8_
 
 static void draw_right_border(vdp_context *context)
 {
+	SKIP_ON_TIMING_THREAD
 	uint32_t *dst = context->output + BORDER_LEFT + ((context->regs[REG_MODE_4] & BIT_H40) ? 320 : 256);
 	uint8_t pixel = context->regs[REG_BG_COLOR] & 0x3F;
 	if ((context->test_port & TEST_BIT_DISABLE) != 0) {
@@ -1854,6 +2224,24 @@ static void draw_right_border(vdp_context *context)
 	context->buf_b_off = (context->buf_b_off + SCROLL_BUFFER_DRAW) & SCROLL_BUFFER_MASK;
 }
 
+static void read_hscroll(vdp_context *context)
+{
+	SKIP_ON_TIMING_THREAD
+	uint16_t address = (context->regs[REG_HSCROLL] & 0x3F) << 10;
+	uint32_t mask = 0;
+	if (context->regs[REG_MODE_3] & 0x2) {
+		mask |= 0xF8;
+	}
+	if (context->regs[REG_MODE_3] & 0x1) {
+		mask |= 0x7;
+	}
+	render_border_garbage(context, address, context->tmp_buf_a, context->buf_a_off+8, context->col_2);
+	address += (context->vcounter & mask) * 4;
+	context->hscroll_a = context->vdpmem[address] << 8 | context->vdpmem[address+1];
+	context->hscroll_b = context->vdpmem[address+2] << 8 | context->vdpmem[address+3];
+	//printf("%d: HScroll A: %d, HScroll B: %d\n", context->vcounter, context->hscroll_a, context->hscroll_b);
+}
+
 #define CHECK_ONLY if (context->cycles >= target_cycles) { return; }
 #define CHECK_LIMIT if (context->flags & FLAG_DMA_RUN) { run_dma_src(context, -1); } context->hslot++; context->cycles += slot_cycles; CHECK_ONLY
 
@@ -1943,8 +2331,7 @@ static void draw_right_border(vdp_context *context)
 	}\
 	CHECK_ONLY
 
-#define SPRITE_RENDER_H40(slot) \
-	case slot:\
+#define SPRITE_SLOT_H40(slot) \
 		if ((slot) == BG_START_SLOT + LINEBUF_SIZE/2) {\
 			advance_output_line(context);\
 		}\
@@ -1972,13 +2359,16 @@ static void draw_right_border(vdp_context *context)
 			draw_right_border(context);\
 		}\
 		render_sprite_cells( context);\
-		scan_sprite_table(context->vcounter, context);\
+		scan_sprite_table(context->vcounter, context);
+
+#define SPRITE_RENDER_H40(slot) \
+	case slot:\
+		SPRITE_SLOT_H40(slot)\
 		CHECK_LIMIT_HSYNC(slot)
 
 //Note that the line advancement check will fail if BG_START_SLOT is > 6
 //as we're bumping up against the hcounter jump
-#define SPRITE_RENDER_H32(slot) \
-	case slot:\
+#define SPRITE_SLOT_H32(slot) \
 		if ((slot) == BG_START_SLOT + (256+HORIZ_BORDER)/2) {\
 			advance_output_line(context);\
 		}\
@@ -1998,7 +2388,11 @@ static void draw_right_border(vdp_context *context)
 			draw_right_border(context);\
 		}\
 		render_sprite_cells( context);\
-		scan_sprite_table(context->vcounter, context);\
+		scan_sprite_table(context->vcounter, context);
+
+#define SPRITE_RENDER_H32(slot) \
+	case slot:\
+		SPRITE_SLOT_H32(slot)\
 		if (context->flags & FLAG_DMA_RUN) { run_dma_src(context, -1); } \
 		if (slot == 147) {\
 			context->hslot = 233;\
@@ -2058,10 +2452,28 @@ static void draw_right_border(vdp_context *context)
 		render_sprite_cells_mode4(context);\
 		MODE4_CHECK_SLOT_LINE(CALC_SLOT(slot, 5))
 
+//Returns true if the line starting at the current slot can be handed to one of the line renderers,
+//i.e. the caller wants at least a full line and nothing pending can touch VDP state before it ends
+static uint8_t can_render_line(vdp_context *context, uint32_t target_cycles)
+{
+	if (context->thread_role == VDP_THREAD_RENDER) {
+		vdp_log_entry *next = context->thread->log + (context->thread->read_pos & (VDP_LOG_SIZE-1));
+		return context->state == ACTIVE
+			&& context->vcounter != context->inactive_start
+			&& target_cycles - context->cycles >= MCLKS_LINE
+			&& (next->type > VDP_LOG_LAST_SLOT || next->cycle - context->cycles >= MCLKS_LINE);
+	}
+	return context->state == ACTIVE
+		&& context->vcounter != context->inactive_start
+		&& target_cycles - context->cycles >= MCLKS_LINE
+		&& context->fifo_read < 0
+		&& !(context->flags & FLAG_DMA_RUN)
+		//external slots would otherwise service a pending read
+		&& ((context->cd & 1) || (context->flags & (FLAG_READ_FETCHED|FLAG_PENDING)));
+}
+
 static void vdp_h40(vdp_context * context, uint32_t target_cycles)
 {
-	uint16_t address;
-	uint32_t mask;
 	uint32_t const slot_cycles = MCLKS_SLOT_H40;
 	switch(context->hslot)
 	{
@@ -2169,19 +2581,7 @@ static void vdp_h40(vdp_context * context, uint32_t target_cycles)
 	SPRITE_RENDER_H40(242)
 	SPRITE_RENDER_H40(243) //provides "garbage" for border when plane A selected
 	case 244:
-		address = (context->regs[REG_HSCROLL] & 0x3F) << 10;
-		mask = 0;
-		if (context->regs[REG_MODE_3] & 0x2) {
-			mask |= 0xF8;
-		}
-		if (context->regs[REG_MODE_3] & 0x1) {
-			mask |= 0x7;
-		}
-		render_border_garbage(context, address, context->tmp_buf_a, context->buf_a_off+8, context->col_2);
-		address += (context->vcounter & mask) * 4;
-		context->hscroll_a = context->vdpmem[address] << 8 | context->vdpmem[address+1];
-		context->hscroll_b = context->vdpmem[address+2] << 8 | context->vdpmem[address+3];
-		//printf("%d: HScroll A: %d, HScroll B: %d\n", context->vcounter, context->hscroll_a, context->hscroll_b);
+		read_hscroll(context);
 		if (context->flags & FLAG_DMA_RUN) { run_dma_src(context, -1); }
 		context->hslot++;
 		context->cycles += h40_hsync_cycles[14];
@@ -2275,6 +2675,9 @@ static void vdp_h40(vdp_context * context, uint32_t target_cycles)
 		context->cycles += slot_cycles;
 		vdp_advance_line(context);
 		CHECK_ONLY
+		if (can_render_line(context, target_cycles)) {
+			return;
+		}
 	}
 	default:
 		context->hslot++;
@@ -2285,8 +2688,6 @@ static void vdp_h40(vdp_context * context, uint32_t target_cycles)
 
 static void vdp_h32(vdp_context * context, uint32_t target_cycles)
 {
-	uint16_t address;
-	uint32_t mask;
 	uint32_t const slot_cycles = MCLKS_SLOT_H32;
 	switch(context->hslot)
 	{
@@ -2398,19 +2799,7 @@ static void vdp_h32(vdp_context * context, uint32_t target_cycles)
 			);
 		CHECK_LIMIT
 	case 244:
-		address = (context->regs[REG_HSCROLL] & 0x3F) << 10;
-		mask = 0;
-		if (context->regs[REG_MODE_3] & 0x2) {
-			mask |= 0xF8;
-		}
-		if (context->regs[REG_MODE_3] & 0x1) {
-			mask |= 0x7;
-		}
-		render_border_garbage(context, address, context->tmp_buf_a, context->buf_a_off+8, context->col_2);
-		address += (context->vcounter & mask) * 4;
-		context->hscroll_a = context->vdpmem[address] << 8 | context->vdpmem[address+1];
-		context->hscroll_b = context->vdpmem[address+2] << 8 | context->vdpmem[address+3];
-		//printf("%d: HScroll A: %d, HScroll B: %d\n", context->vcounter, context->hscroll_a, context->hscroll_b);
+		read_hscroll(context);
 		CHECK_LIMIT //provides "garbage" for border when plane A selected
 	SPRITE_RENDER_H32(245)
 	SPRITE_RENDER_H32(246)
@@ -2500,6 +2889,9 @@ static void vdp_h32(vdp_context * context, uint32_t target_cycles)
 		context->cycles += slot_cycles;
 		vdp_advance_line(context);
 		CHECK_ONLY
+		if (can_render_line(context, target_cycles)) {
+			return;
+		}
 	}
 	default:
 		context->hslot++;
@@ -2507,10 +2899,182 @@ static void vdp_h32(vdp_context * context, uint32_t target_cycles)
 	}
 }
 
+//Renders a full H40 line starting at LINE_CHANGE_H40 in one pass. Does the same per-slot work
+//as vdp_h40 in the same order, but skips external slots and per-slot cycle bookkeeping,
+//so it is only used when can_render_line says nothing can interleave with it
+static void vdp_h40_line(vdp_context * context)
+{
+	if (!(context->regs[REG_MODE_3] & BIT_VSCROLL)) {
+		context->vscroll_latch[0] = context->vsram[0];
+		context->vscroll_latch[1] = context->vsram[1];
+	}
+	render_sprite_cells(context);
+	render_sprite_cells(context);
+	//sprite attribute table scan starts
+	context->sprite_index = 0x80;
+	context->slot_counter = 0;
+	render_border_garbage(
+		context,
+		context->sprite_draw_list[context->cur_slot].address,
+		context->tmp_buf_b, context->buf_b_off,
+		context->col_1
+	);
+	render_sprite_cells(context);
+	scan_sprite_table(context->vcounter, context);
+	for (uint32_t slot = 168; slot <= 182; slot++)
+	{
+		SPRITE_SLOT_H40(slot)
+	}
+	for (uint32_t slot = 229; slot <= 243; slot++)
+	{
+		//232 is an external slot
+		if (slot != 232) {
+			SPRITE_SLOT_H40(slot)
+		}
+	}
+	read_hscroll(context);
+	for (uint32_t slot = 245; slot <= 248; slot++)
+	{
+		SPRITE_SLOT_H40(slot)
+	}
+	read_map_scroll_a(0, context->vcounter, context);
+	SPRITE_SLOT_H40(250)
+	render_map_1(context);
+	scan_sprite_table(context->vcounter, context);
+	render_map_2(context);
+	scan_sprite_table(context->vcounter, context);
+	read_map_scroll_b(0, context->vcounter, context);
+	SPRITE_SLOT_H40(254)
+	render_map_3(context);
+	scan_sprite_table(context->vcounter, context);
+	render_map_output(context->vcounter, 0, context);
+	scan_sprite_table(context->vcounter, context);
+	context->cur_slot = context->slot_counter;
+	context->sprite_draws = MAX_DRAWS;
+	context->flags &= (~FLAG_CAN_MASK & ~FLAG_MASKED);
+	for (uint16_t column = 2; column <= 40; column += 2)
+	{
+		read_map_scroll_a(column, context->vcounter, context);
+		render_map_1(context);
+		render_map_2(context);
+		read_map_scroll_b(column, context->vcounter, context);
+		read_sprite_x(context->vcounter, context);
+		render_map_3(context);
+		render_map_output(context->vcounter, column, context);
+	}
+	//sprite render to line buffer starts
+	context->cur_slot = MAX_DRAWS-1;
+	memset(context->linebuf, 0, LINEBUF_SIZE);
+	render_border_garbage(
+		context,
+		context->sprite_draw_list[context->cur_slot].address,
+		context->tmp_buf_a, context->buf_a_off,
+		context->col_1
+	);
+	render_sprite_cells(context);
+	render_border_garbage(
+		context,
+		context->sprite_draw_list[context->cur_slot].address,
+		context->tmp_buf_a, context->buf_a_off + 8,
+		context->col_2
+	);
+	render_sprite_cells(context);
+	context->cycles += MCLKS_LINE;
+	vdp_advance_line(context);
+}
+
+//H32 counterpart of vdp_h40_line, starting at LINE_CHANGE_H32
+static void vdp_h32_line(vdp_context * context)
+{
+	render_sprite_cells(context);
+	render_sprite_cells(context);
+	//sprite attribute table scan starts
+	context->sprite_index = 0x80;
+	context->slot_counter = 0;
+	render_border_garbage(
+		context,
+		context->sprite_draw_list[context->cur_slot].address,
+		context->tmp_buf_b, context->buf_b_off,
+		context->col_1
+	);
+	render_sprite_cells(context);
+	scan_sprite_table(context->vcounter, context);
+	for (uint32_t slot = 136; slot <= 147; slot++)
+	{
+		//145 is an external slot
+		if (slot != 145) {
+			SPRITE_SLOT_H32(slot)
+		}
+	}
+	for (uint32_t slot = 233; slot <= 242; slot++)
+	{
+		SPRITE_SLOT_H32(slot)
+	}
+	if (!(context->regs[REG_MODE_3] & BIT_VSCROLL)) {
+		context->vscroll_latch[0] = context->vsram[0];
+		context->vscroll_latch[1] = context->vsram[1];
+	}
+	render_border_garbage(
+		context,
+		context->sprite_draw_list[context->cur_slot].address,
+		context->tmp_buf_a,
+		context->buf_a_off,
+		context->col_1
+	);
+	read_hscroll(context);
+	for (uint32_t slot = 245; slot <= 248; slot++)
+	{
+		SPRITE_SLOT_H32(slot)
+	}
+	read_map_scroll_a(0, context->vcounter, context);
+	SPRITE_SLOT_H32(250)
+	render_map_1(context);
+	scan_sprite_table(context->vcounter, context);
+	render_map_2(context);
+	scan_sprite_table(context->vcounter, context);
+	read_map_scroll_b(0, context->vcounter, context);
+	render_sprite_cells(context);
+	scan_sprite_table(context->vcounter, context);
+	render_map_3(context);
+	scan_sprite_table(context->vcounter, context);
+	render_map_output(context->vcounter, 0, context);
+	scan_sprite_table(context->vcounter, context);
+	context->cur_slot = context->slot_counter;
+	context->sprite_draws = MAX_DRAWS_H32;
+	context->flags &= (~FLAG_CAN_MASK & ~FLAG_MASKED);
+	for (uint16_t column = 2; column <= 32; column += 2)
+	{
+		read_map_scroll_a(column, context->vcounter, context);
+		render_map_1(context);
+		render_map_2(context);
+		read_map_scroll_b(column, context->vcounter, context);
+		read_sprite_x(context->vcounter, context);
+		render_map_3(context);
+		render_map_output(context->vcounter, column, context);
+	}
+	//sprite render to line buffer starts
+	context->cur_slot = MAX_DRAWS_H32-1;
+	memset(context->linebuf, 0, LINEBUF_SIZE);
+	render_border_garbage(
+		context,
+		context->sprite_draw_list[context->cur_slot].address,
+		context->tmp_buf_a, context->buf_a_off,
+		context->col_1
+	);
+	render_sprite_cells(context);
+	render_border_garbage(
+		context,
+		context->sprite_draw_list[context->cur_slot].address,
+		context->tmp_buf_a, context->buf_a_off + 8,
+		context->col_2
+	);
+	render_sprite_cells(context);
+	context->cycles += MCLKS_LINE;
+	vdp_advance_line(context);
+}
+
 static void vdp_h32_mode4(vdp_context * context, uint32_t target_cycles)
 {
-	uint16_t address;
-	uint32_t mask;
 	uint32_t const slot_cycles = MCLKS_SLOT_H32;
 	switch(context->hslot)
 	{
@@ -2704,6 +3268,139 @@ static void check_switch_inactive(vdp_context *context, uint8_t is_h40)
 	}
 }
 
+static uint16_t clip_slot_window(uint16_t end, uint8_t hslot, uint8_t event_slot)
+{
+	return event_slot >= hslot && event_slot < end ? event_slot : end;
+}
+
+//Applies a Mode 5 VRAM fill or copy directly to the non-refresh slots among the next num_slots blanking slots.
+//DMA state is only written back once at the end, returns the number of slots used
+static uint16_t vdp_inactive_dma_direct(vdp_context *context, uint16_t num_slots, uint32_t slot_cycles)
+{
+	uint8_t fill = (context->regs[REG_DMASRC_H] & 0xC0) == 0x80;
+	fifo_entry *fill_entry = context->fifo + ((context->fifo_write-1) & (FIFO_SIZE-1));
+	uint8_t fill_byte = fill_entry->value >> 8;
+	uint32_t sat_address = mode5_sat_address(context);
+	uint16_t src = context->regs[REG_DMASRC_M] << 8 | context->regs[REG_DMASRC_L];
+	uint16_t len = context->regs[REG_DMALEN_H] << 8 | context->regs[REG_DMALEN_L];
+	uint32_t address = context->address;
+	uint8_t autoinc = context->regs[REG_AUTOINC];
+	uint8_t fetched = context->flags & FLAG_READ_FETCHED;
+	uint32_t start_cycles = context->cycles;
+	uint16_t start_len = len;
+	uint8_t done = 0;
+	uint16_t slot;
+	for (slot = 0; slot < num_slots;)
+	{
+		uint16_t hslot = context->hslot + slot++;
+		if (is_refresh(context, hslot)) {
+			continue;
+		}
+		//write_vdpmem logs with the current cycle when the render thread needs to replay this
+		context->cycles = start_cycles + (slot - 1) * slot_cycles;
+		uint16_t dst = (address ^ 1) & 0xFFFF;
+		if (fill) {
+			if (!(address & 4) && (address ^ 1) - sat_address < SAT_CACHE_SIZE*2) {
+				uint16_t cache_address = (address ^ 1) - sat_address;
+				write_sat_cache(context, (cache_address & 3) | (cache_address >> 1 & 0x1FC), fill_byte);
+			}
+			write_vdpmem(context, dst, fill_byte);
+		} else if (fetched) {
+			write_vdpmem(context, dst, context->prefetch);
+			fetched = 0;
+		} else {
+			context->prefetch = context->vdpmem[src ^ 1];
+			fetched = FLAG_READ_FETCHED;
+			continue;
+		}
+		src++;
+		address += autoinc;
+		if (!--len) {
+			done = 1;
+			break;
+		}
+	}
+	if (fill && len != start_len) {
+		//same state as a FIFO entry with partial set to 2 left by external_slot
+		fill_entry->cycle = context->cycles;
+		fill_entry->address = address - autoinc;
+		fill_entry->partial = 2;
+	}
+	context->cycles = start_cycles + slot * slot_cycles;
+	context->hslot += slot;
+	context->serial_address += 1024 * slot;
+	context->flags = (context->flags & ~FLAG_READ_FETCHED) | fetched;
+	context->regs[REG_DMASRC_L] = src;
+	context->regs[REG_DMASRC_M] = src >> 8;
+	context->regs[REG_DMALEN_H] = len >> 8;
+	context->regs[REG_DMALEN_L] = len;
+	context->address = address;
+	if (done) {
+		context->flags &= ~FLAG_DMA_RUN;
+		context->cd &= 0xF;
+	}
+	return slot;
+}
+
+//Runs a DMA through the next num_slots blanking slots, which must have no side effects other than border drawing.
+//Fills and copies within VRAM are applied directly instead of going through the FIFO one slot at a time
+static uint32_t *vdp_inactive_dma(vdp_context *context, uint32_t target_cycles, uint16_t num_slots, uint32_t slot_cycles, uint32_t *dst)
+{
+	uint8_t dma_type = context->regs[REG_DMASRC_H] & 0xC0;
+	fifo_entry *fill = context->fifo + ((context->fifo_write-1) & (FIFO_SIZE-1));
+	uint8_t direct = context->fifo_read < 0 && (
+		dma_type == 0xC0
+		|| (dma_type == 0x80 && (fill->cd & 0xF) == VRAM_WRITE && !(context->regs[REG_MODE_2] & BIT_128K_VRAM))
+	);
+	if (direct) {
+		uint32_t max_slots = (target_cycles - context->cycles + slot_cycles - 1) / slot_cycles;
+		if (num_slots > max_slots) {
+			num_slots = max_slots;
+		}
+		num_slots = vdp_inactive_dma_direct(context, num_slots, slot_cycles);
+		if (dst) {
+			uint32_t bg_color = context->colors[context->regs[REG_BG_COLOR] & 0x3F];
+			for (uint32_t *end = dst + 2 * num_slots; dst < end; dst++)
+			{
+				if (dst >= context->done_output) {
+					*dst = bg_color;
+				}
+			}
+			if (dst > context->done_output) {
+				context->done_output = dst;
+			}
+		}
+		return dst;
+	}
+	for (; num_slots && (context->flags & FLAG_DMA_RUN) && context->cycles < target_cycles; num_slots--)
+	{
+		if (dst) {
+			uint32_t bg_color = context->colors[context->regs[REG_BG_COLOR] & 0x3F];
+			if (dst >= context->done_output) {
+				*(dst++) = bg_color;
+			} else {
+				dst++;
+			}
+			if (dst >= context->done_output) {
+				*(dst++) = bg_color;
+				context->done_output = dst;
+			} else {
+				dst++;
+			}
+		}
+		context->serial_address += 1024;
+		if (!is_refresh(context, context->hslot)) {
+			external_slot(context);
+			if (context->flags & FLAG_DMA_RUN) {
+				run_dma_src(context, context->hslot);
+			}
+		}
+		context->cycles += slot_cycles;
+		context->hslot++;
+	}
+	return dst;
+}
+
 static void vdp_inactive(vdp_context *context, uint32_t target_cycles, uint8_t is_h40, uint8_t mode_5)
 {
 	uint8_t buf_clear_slot, index_reset_slot, bg_end_slot, vint_slot, line_change, jump_start, jump_dest, latch_slot;
@@ -2784,6 +3481,37 @@ static void vdp_inactive(vdp_context *context, uint32_t target_cycles, uint8_t i
 	
 	while(context->cycles < target_cycles)
 	{
+		if (
+			(context->flags & FLAG_DMA_RUN) && mode_5 && !test_layer && context->thread_role != VDP_THREAD_RENDER
+			&& !(context->state == ACTIVE && context->vcounter == context->inactive_start)
+		) {
+			//find the next slot that needs the full treatment below and run the DMA in bulk until then
+			uint16_t end;
+			if (context->hslot <= jump_start) {
+				end = jump_start;
+			} else if (is_h40 && context->hslot < HSYNC_END_H40) {
+				end = HSYNC_SLOT_H40;
+			} else {
+				end = 256;
+			}
+			end = clip_slot_window(end, context->hslot, line_change - 1);
+			end = clip_slot_window(end, context->hslot, BG_START_SLOT);
+			end = clip_slot_window(end, context->hslot, bg_end_slot - 1);
+			end = clip_slot_window(end, context->hslot, bg_end_slot);
+			end = clip_slot_window(end, context->hslot, buf_clear_slot);
+			end = clip_slot_window(end, context->hslot, index_reset_slot);
+			end = clip_slot_window(end, context->hslot, latch_slot);
+			if (context->vcounter == vint_line) {
+				end = clip_slot_window(end, context->hslot, vint_slot);
+			}
+			if (context->vcounter == context->inactive_start) {
+				end = clip_slot_window(end, context->hslot, 1);
+			}
+			if (end > context->hslot) {
+				dst = vdp_inactive_dma(context, target_cycles, end - context->hslot, is_h40 ? MCLKS_SLOT_H40 : MCLKS_SLOT_H32, dst);
+				continue;
+			}
+		}
 		check_switch_inactive(context, is_h40);
 		if (context->hslot == BG_START_SLOT && !test_layer && (
 			context->vcounter < context->inactive_start + context->border_bot 
@@ -2900,16 +3628,36 @@ void vdp_run_context_full(vdp_context * context, uint32_t target_cycles)
 {
 	uint8_t is_h40 = context->regs[REG_MODE_4] & BIT_H40;
 	uint8_t mode_5 = context->regs[REG_MODE_2] & BIT_MODE_5;
+	uint32_t start_cycles = context->cycles;
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_thread *thread = context->thread;
+		if (context->debug != thread->debug || context->debug_pal != thread->debug_pal) {
+			thread->debug = context->debug;
+			thread->debug_pal = context->debug_pal;
+			vdp_log_write(context, VDP_LOG_DEBUG, context->debug_pal, context->debug);
+		}
+	}
 	while(context->cycles < target_cycles)
 	{
 		check_switch_inactive(context, is_h40);
 		
 		if (is_active(context)) {
+			if (context->thread_role == VDP_THREAD_TIMING) {
+				context->thread->active_run = 1;
+			}
 			if (mode_5) {
 				if (is_h40) {
-					vdp_h40(context, target_cycles);
+					if (context->hslot == LINE_CHANGE_H40 && can_render_line(context, target_cycles)) {
+						vdp_h40_line(context);
+					} else {
+						vdp_h40(context, target_cycles);
+					}
 				} else {
-					vdp_h32(context, target_cycles);
+					if (context->hslot == LINE_CHANGE_H32 && can_render_line(context, target_cycles)) {
+						vdp_h32_line(context);
+					} else {
+						vdp_h32(context, target_cycles);
+					}
 				}
 			} else {
 				vdp_h32_mode4(context, target_cycles);
@@ -2918,6 +3666,14 @@ void vdp_run_context_full(vdp_context * context, uint32_t target_cycles)
 			vdp_inactive(context, target_cycles, is_h40, mode_5);
 		}
 	}
+	if (context->thread_role == VDP_THREAD_TIMING && context->cycles != start_cycles) {
+		vdp_log(context, VDP_LOG_RUN)->value = target_cycles;
+		if (context->thread->frame_pending) {
+			vdp_thread_wait(context);
+		} else {
+			vdp_log_publish(context->thread);
+		}
+	}
 }
 
 void vdp_run_context(vdp_context *context, uint32_t target_cycles)
@@ -3006,6 +3762,23 @@ uint16_t vdp_hv_counter_read(vdp_context * context)
 	return hv;
 }
 
+static void vdp_reg_write(vdp_context *context, uint8_t reg, uint8_t value)
+{
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_log_write(context, VDP_LOG_REG, reg, value);
+	}
+	context->regs[reg] = value;
+	if (reg == REG_MODE_4) {
+		context->double_res = (value & (BIT_INTERLACE | BIT_DOUBLE_RES)) == (BIT_INTERLACE | BIT_DOUBLE_RES);
+		if (!context->double_res) {
+			context->flags2 &= ~FLAG2_EVEN_FIELD;
+		}
+	}
+	if (reg == REG_MODE_1 || reg == REG_MODE_2 || reg == REG_MODE_4) {
+		update_video_params(context);
+	}
+}
+
 int vdp_control_port_write(vdp_context * context, uint16_t value)
 {
 	//printf("control port write: %X at %d\n", value, context->cycles);
@@ -3063,16 +3836,7 @@ int vdp_control_port_write(vdp_context * context, uint16_t value)
 				/*if (reg == REG_MODE_4 && ((value ^ context->regs[reg]) & BIT_H40)) {
 					printf("Mode changed from H%d to H%d @ %d, frame: %d\n", context->regs[reg] & BIT_H40 ? 40 : 32, value & BIT_H40 ? 40 : 32, context->cycles, context->frame);
 				}*/
-				context->regs[reg] = value;
-				if (reg == REG_MODE_4) {
-					context->double_res = (value & (BIT_INTERLACE | BIT_DOUBLE_RES)) == (BIT_INTERLACE | BIT_DOUBLE_RES);
-					if (!context->double_res) {
-						context->flags2 &= ~FLAG2_EVEN_FIELD;
-					}
-				}
-				if (reg == REG_MODE_1 || reg == REG_MODE_2 || reg == REG_MODE_4) {
-					update_video_params(context);
-				}
+				vdp_reg_write(context, reg, value);
 			}
 		} else if (mode_5) {
 			context->flags |= FLAG_PENDING;
@@ -3179,6 +3943,9 @@ void vdp_data_port_write_pbc(vdp_context * context, uint8_t value)
 
 void vdp_test_port_write(vdp_context * context, uint16_t value)
 {
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_log(context, VDP_LOG_TEST_PORT)->value = value;
+	}
 	context->test_port = value;
 }
 
@@ -3186,6 +3953,17 @@ uint16_t vdp_control_port_read(vdp_context * context)
 {
 	context->flags &= ~FLAG_PENDING;
 	context->flags2 &= ~FLAG2_BYTE_PENDING;
+	if (context->thread_role == VDP_THREAD_TIMING && context->thread->active_run) {
+		//sprite overflow and collision are only tracked by the render thread,
+		//but they can only change while it is running active display
+		vdp_context *render = context->thread->render;
+		vdp_thread_wait(context);
+		context->thread->active_run = 0;
+		context->flags = (context->flags & ~FLAG_DOT_OFLOW) | (render->flags & FLAG_DOT_OFLOW);
+		context->flags2 = (context->flags2 & ~FLAG2_SPRITE_COLLIDE) | (render->flags2 & FLAG2_SPRITE_COLLIDE);
+		render->flags &= ~FLAG_DOT_OFLOW;
+		render->flags2 &= ~FLAG2_SPRITE_COLLIDE;
+	}
 	//Bits 15-10 are not fixed like Charles MacDonald's doc suggests, but instead open bus values that reflect 68K prefetch
 	uint16_t value = context->system->get_open_bus_value(context->system) & 0xFC00;
 	if (context->fifo_read < 0) {
@@ -3266,6 +4044,9 @@ uint16_t vdp_test_port_read(vdp_context * context)
 
 void vdp_adjust_cycles(vdp_context * context, uint32_t deduction)
 {
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_log(context, VDP_LOG_ADJUST)->value = deduction;
+	}
 	context->cycles -= deduction;
 	if (context->pending_vint_start >= deduction) {
 		context->pending_vint_start -= deduction;
@@ -3290,6 +4071,168 @@ void vdp_adjust_cycles(vdp_context * context, uint32_t deduction)
 	}
 }
 
+static int render_thread_main(void *data)
+{
+	vdp_context *context = data;
+	vdp_thread *thread = context->thread;
+	for (;;)
+	{
+		//slot writes are consumed by the run that follows them
+		uint32_t pos = thread->read_pos;
+		vdp_log_entry *entry;
+		for (;;)
+		{
+			while ((uint32_t)SDL_AtomicGet(&thread->tail) == pos)
+			{
+				SDL_AtomicCAS(&thread->sleeping, 0, 1);
+				if ((uint32_t)SDL_AtomicGet(&thread->tail) != pos && SDL_AtomicCAS(&thread->sleeping, 1, 0)) {
+					break;
+				}
+				SDL_SemWait(thread->wake);
+			}
+			entry = thread->log + (pos & (VDP_LOG_SIZE-1));
+			if (entry->type > VDP_LOG_LAST_SLOT) {
+				break;
+			}
+			pos++;
+		}
+		uint8_t type = entry->type;
+		if (type == VDP_LOG_RUN) {
+			vdp_run_context_full(context, entry->value);
+		}
+		//anything left was written outside of a run, e.g. by a savestate loader
+		while (thread->read_pos != pos)
+		{
+			replay_slot_write(context, thread->log + (thread->read_pos++ & (VDP_LOG_SIZE-1)));
+		}
+		switch (type)
+		{
+		case VDP_LOG_REG:
+			vdp_reg_write(context, entry->address, entry->value);
+			break;
+		case VDP_LOG_TEST_PORT:
+			context->test_port = entry->value;
+			break;
+		case VDP_LOG_DEBUG:
+			context->debug = entry->value;
+			context->debug_pal = entry->address;
+			break;
+		case VDP_LOG_ADJUST:
+			vdp_adjust_cycles(context, entry->value);
+			break;
+		}
+		//SDL_AtomicSet is only an acquire barrier with some compilers
+		thread->read_pos++;
+		SDL_AtomicAdd(&thread->head, thread->read_pos - (uint32_t)SDL_AtomicGet(&thread->head));
+		if (type == VDP_LOG_SYNC) {
+			SDL_SemPost(thread->done);
+		} else if (type == VDP_LOG_QUIT) {
+			return 0;
+		}
+	}
+}
+
+//Splits the VDP in two: the passed context keeps handling port accesses and timing on the calling thread
+//while a copy running on a new thread replays its memory and register writes to generate the actual pixels
+void vdp_start_render_thread(vdp_context *context)
+{
+	vdp_thread *thread = calloc(1, sizeof(vdp_thread));
+	vdp_context *render = malloc(sizeof(vdp_context));
+	*render = *context;
+	render->vdpmem = malloc(VRAM_SIZE);
+	memcpy(render->vdpmem, context->vdpmem, VRAM_SIZE);
+	render->tile_cache = malloc(TILE_CACHE_SIZE);
+	vdp_invalidate_tile_cache(render);
+	render->linebuf = malloc(LINEBUF_SIZE + SCROLL_BUFFER_SIZE*2);
+	memcpy(render->linebuf, context->linebuf, LINEBUF_SIZE + SCROLL_BUFFER_SIZE*2);
+	render->tmp_buf_a = render->linebuf + LINEBUF_SIZE;
+	render->tmp_buf_b = render->tmp_buf_a + SCROLL_BUFFER_SIZE;
+	render->fifo_read = -1;
+	render->flags &= ~FLAG_DMA_RUN;
+	render->thread = thread;
+	render->thread_role = VDP_THREAD_RENDER;
+	
+	//the timing side still goes through the motions for the border, give it a line of its own to draw into
+	context->fb = NULL;
+	context->output = context->done_output = malloc(LINEBUF_SIZE * sizeof(uint32_t));
+	context->thread = thread;
+	context->thread_role = VDP_THREAD_TIMING;
+	
+	thread->log = malloc(VDP_LOG_SIZE * sizeof(vdp_log_entry));
+	thread->render = render;
+	thread->debug = context->debug;
+	thread->debug_pal = context->debug_pal;
+	thread->active_run = 1;
+	thread->wake = SDL_CreateSemaphore(0);
+	thread->done = SDL_CreateSemaphore(0);
+	thread->resume = SDL_CreateSemaphore(0);
+	thread->thread = SDL_CreateThread(render_thread_main, "VDP render", render);
+	if (!thread->thread) {
+		fatal_error("Failed to create VDP render thread: %s\n", SDL_GetError());
+	}
+}
+
+//copies state that only the render thread keeps up to date
+static void copy_render_state(vdp_context *dst, vdp_context *src)
+{
+	memcpy(dst->sprite_draw_list, src->sprite_draw_list, sizeof(dst->sprite_draw_list));
+	memcpy(dst->sprite_info_list, src->sprite_info_list, sizeof(dst->sprite_info_list));
+	dst->serial_address = src->serial_address;
+	dst->hscroll_a = src->hscroll_a;
+	dst->hscroll_b = src->hscroll_b;
+	dst->col_1 = src->col_1;
+	dst->col_2 = src->col_2;
+	dst->sprite_index = src->sprite_index;
+	dst->sprite_draws = src->sprite_draws;
+	dst->slot_counter = src->slot_counter;
+	dst->cur_slot = src->cur_slot;
+	dst->fetch_tmp[0] = src->fetch_tmp[0];
+	dst->fetch_tmp[1] = src->fetch_tmp[1];
+	dst->v_offset = src->v_offset;
+	dst->buf_a_off = src->buf_a_off;
+	dst->buf_b_off = src->buf_b_off;
+	uint8_t render_flags = FLAG_DOT_OFLOW | FLAG_CAN_MASK | FLAG_MASKED | FLAG_WINDOW;
+	dst->flags = (dst->flags & ~render_flags) | (src->flags & render_flags);
+	dst->flags2 = (dst->flags2 & ~FLAG2_SPRITE_COLLIDE) | (src->flags2 & FLAG2_SPRITE_COLLIDE);
+}
+
+//brings the render thread in line with state that was modified directly rather than through the ports
+static void vdp_thread_push_state(vdp_context *context, uint8_t include_render)
+{
+	vdp_context *render = context->thread->render;
+	vdp_thread_wait(context);
+	vdp_context saved = *render;
+	*render = *context;
+	memcpy(saved.vdpmem, context->vdpmem, VRAM_SIZE);
+	render->vdpmem = saved.vdpmem;
+	render->tile_cache = saved.tile_cache;
+	vdp_invalidate_tile_cache(render);
+	render->linebuf = saved.linebuf;
+	render->tmp_buf_a = saved.tmp_buf_a;
+	render->tmp_buf_b = saved.tmp_buf_b;
+	if (include_render) {
+		memcpy(render->linebuf, context->linebuf, LINEBUF_SIZE + SCROLL_BUFFER_SIZE*2);
+	} else {
+		copy_render_state(render, &saved);
+	}
+	render->output = saved.output;
+	render->done_output = saved.done_output;
+	render->fb = saved.fb;
+	render->output_pitch = saved.output_pitch;
+	render->cur_buffer = saved.cur_buffer;
+	render->fifo_read = -1;
+	render->flags &= ~FLAG_DMA_RUN;
+	render->thread_role = VDP_THREAD_RENDER;
+	context->thread->active_run = 1;
+}
+
+void vdp_sync_render_thread(vdp_context *context)
+{
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_thread_push_state(context, 0);
+	}
+}
+
 static uint32_t vdp_cycles_hslot_wrap_h40(vdp_context * context)
 {
 	if (context->hslot < 183) {
@@ -3558,6 +4501,12 @@ void vdp_int_ack(vdp_context * context)
 
 void vdp_serialize(vdp_context *context, serialize_buffer *buf)
 {
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_context *render = context->thread->render;
+		vdp_thread_wait(context);
+		copy_render_state(context, render);
+		memcpy(context->linebuf, render->linebuf, LINEBUF_SIZE + SCROLL_BUFFER_SIZE*2);
+	}
 	save_int8(buf, VRAM_SIZE / 1024);//VRAM size in KB, needed for future proofing
 	save_buffer8(buf, context->vdpmem, VRAM_SIZE);
 	save_buffer16(buf, context->cram, CRAM_SIZE);
@@ -3639,6 +4588,7 @@ void vdp_deserialize(deserialize_buffer *buf, void *vcontext)
 	vdp_context *context = vcontext;
 	uint8_t vramk = load_int8(buf);
 	load_buffer8(buf, context->vdpmem, (vramk * 1024) <= VRAM_SIZE ? vramk * 1024 : VRAM_SIZE);
+	vdp_invalidate_tile_cache(context);
 	if ((vramk * 1024) > VRAM_SIZE) {
 		buf->cur_pos += (vramk * 1024) - VRAM_SIZE;
 	}
@@ -3720,4 +4670,7 @@ void vdp_deserialize(deserialize_buffer *buf, void *vcontext)
 	context->pending_vint_start = load_int32(buf);
 	context->pending_hint_start = load_int32(buf);
 	update_video_params(context);
+	if (context->thread_role == VDP_THREAD_TIMING) {
+		vdp_thread_push_state(context, 1);
+	}
 }
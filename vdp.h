@@ -28,6 +28,9 @@
 #define MAX_SPRITES_FRAME 80
 #define MAX_SPRITES_FRAME_H32 64
 #define SAT_CACHE_SIZE (MAX_SPRITES_FRAME * 4)
+//each 4-byte pattern row expands to 8 pixels in normal order followed by the same 8 H-flipped
+#define TILE_CACHE_SIZE (VRAM_SIZE * 4)
+#define TILE_DIRTY_WORDS (VRAM_SIZE / 32 / 32)
 
 #define FBUF_SHADOW 0x0001
 #define FBUF_HILIGHT 0x0010
@@ -44,6 +47,12 @@
 
 #define MCLKS_LINE 3420
 
+enum {
+	VDP_THREAD_NONE,
+	VDP_THREAD_TIMING, //emulation side of a threaded VDP, only tracks timing-visible state
+	VDP_THREAD_RENDER  //worker side, replays the write log to produce pixels
+};
+
 #define FLAG_DOT_OFLOW     0x01
 #define FLAG_CAN_MASK      0x02
 #define FLAG_MASKED        0x04
@@ -139,6 +148,8 @@ typedef struct {
 
 #define FIFO_SIZE 4
 
+typedef struct vdp_thread vdp_thread;
+
 typedef struct {
 	uint32_t cycle;
 	uint32_t address;
@@ -212,6 +223,12 @@ typedef struct {
 	uint8_t     cur_buffer;
 	uint8_t     *tmp_buf_a;
 	uint8_t     *tmp_buf_b;
+	//8bpp expansion of the Mode 5 patterns in VRAM, refreshed lazily per pattern
+	uint8_t     *tile_cache;
+	uint32_t    tile_dirty[TILE_DIRTY_WORDS];
+	//shared by both halves of a VDP split with vdp_start_render_thread, NULL otherwise
+	vdp_thread  *thread;
+	uint8_t     thread_role;
 } vdp_context;
 
 void init_vdp_context(vdp_context * context, uint8_t region_pal);
@@ -247,6 +264,9 @@ void latch_mode(vdp_context * context);
 uint32_t vdp_cycles_to_frame_end(vdp_context * context);
 void write_cram_internal(vdp_context * context, uint16_t addr, uint16_t value);
 void vdp_check_update_sat_byte(vdp_context *context, uint32_t address, uint8_t value);
+void vdp_invalidate_tile_cache(vdp_context *context);
+void vdp_start_render_thread(vdp_context *context);
+void vdp_sync_render_thread(vdp_context *context);
 void vdp_pbc_pause(vdp_context *context);
 void vdp_release_framebuffer(vdp_context *context);
 void vdp_reacquire_framebuffer(vdp_context *context);
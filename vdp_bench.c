@@ -0,0 +1,437 @@
+/*
+ Copyright 2013 Michael Pavone
+ This file is part of BlastEm.
+ BlastEm is free software distributed under the terms of the GNU General Public License version 3 or greater. See COPYING for full license text.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vdp.h"
+#include "render.h"
+#include "system.h"
+#include "util.h"
+
+//util.c and vdp.c expect these to be provided by the frontend
+int headless = 0;
+void render_errorbox(char *title, char *message) {}
+void render_infobox(char *title, char *message) {}
+
+enum {
+	SCENE_BUSY,
+	SCENE_QUIET,
+	SCENE_POLL,
+	SCENE_DMA,
+	SCENE_FILL,
+	SCENE_COPY,
+	SCENE_COUNT
+};
+
+static const char *scene_names[SCENE_COUNT] = {"busy", "quiet", "poll", "dma", "fill", "copy"};
+
+static uint32_t framebuffer[2][LINEBUF_SIZE * 512];
+static uint16_t ram[0x8000];
+static uint8_t hash_frames;
+//frames are hashed separately since they can come from the render thread
+static uint64_t hash, frame_hash;
+
+static uint64_t mix_into(uint64_t hash, uint64_t value)
+{
+	return (hash ^ value) * 1099511628211ULL;
+}
+
+static void mix(uint64_t value)
+{
+	hash = mix_into(hash, value);
+}
+
+uint32_t render_map_color(uint8_t r, uint8_t g, uint8_t b)
+{
+	return r << 16 | g << 8 | b;
+}
+
+uint32_t *render_get_framebuffer(uint8_t which, int *pitch)
+{
+	*pitch = LINEBUF_SIZE * sizeof(uint32_t);
+	return framebuffer[which];
+}
+
+void render_framebuffer_updated(uint8_t which, int width)
+{
+	if (hash_frames) {
+		for (uint32_t i = 0; i < LINEBUF_SIZE * 512; i++)
+		{
+			frame_hash = mix_into(frame_hash, framebuffer[which][i]);
+		}
+		frame_hash = mix_into(frame_hash, width);
+	}
+}
+
+uint16_t read_dma_value(uint32_t address)
+{
+	return ram[address & 0x7FFF];
+}
+
+static uint16_t get_open_bus_value(system_header *system)
+{
+	return 0x4E71;
+}
+
+static uint32_t rnd_state;
+static uint32_t rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+static vdp_context *vdp;
+static uint32_t cycle;
+
+//Port accesses sync the VDP up to the current cycle first, the same way the 68K side does
+static void control_write(uint16_t value)
+{
+	vdp_run_context_full(vdp, cycle);
+	int blocked = vdp_control_port_write(vdp, value);
+	while (blocked)
+	{
+		while (vdp->flags & FLAG_DMA_RUN)
+		{
+			vdp_run_dma_done(vdp, vdp->cycles + 100000);
+		}
+		blocked = blocked < 0 ? vdp_control_port_write(vdp, value) : 0;
+	}
+	if (vdp->cycles > cycle) {
+		cycle = vdp->cycles;
+	}
+}
+
+static void data_write(uint16_t value)
+{
+	vdp_run_context(vdp, cycle);
+	while (vdp_data_port_write(vdp, value) < 0)
+	{
+		while (vdp->flags & FLAG_DMA_RUN)
+		{
+			vdp_run_dma_done(vdp, vdp->cycles + 100000);
+		}
+	}
+	if (vdp->cycles > cycle) {
+		cycle = vdp->cycles;
+	}
+}
+
+static uint16_t control_read(void)
+{
+	vdp_run_context(vdp, cycle);
+	return vdp_control_port_read(vdp);
+}
+
+static void set_reg(uint8_t reg, uint8_t value)
+{
+	control_write(0x8000 | reg << 8 | value);
+}
+
+static void set_address(uint8_t cd, uint16_t address)
+{
+	control_write((cd & 3) << 14 | (address & 0x3FFF));
+	control_write((cd >> 2) << 4 | address >> 14);
+}
+
+static void set_dma(uint32_t len, uint32_t src, uint8_t src_high)
+{
+	set_reg(REG_DMALEN_L, len);
+	set_reg(REG_DMALEN_H, len >> 8);
+	set_reg(REG_DMASRC_L, src);
+	set_reg(REG_DMASRC_M, src >> 8);
+	set_reg(REG_DMASRC_H, src_high);
+}
+
+//a fill only starts once the data port write that triggers it has left the FIFO
+static void fill_write(uint16_t value)
+{
+	data_write(value);
+	while (!(vdp->flags & FLAG_DMA_RUN) && vdp->fifo_read >= 0)
+	{
+		cycle = vdp->cycles + 100;
+		vdp_run_context(vdp, cycle);
+	}
+}
+
+static void run_dma(uint32_t step)
+{
+	while (vdp->flags & FLAG_DMA_RUN)
+	{
+		cycle = vdp->cycles + step;
+		vdp_run_context(vdp, cycle);
+	}
+}
+
+static void setup(uint8_t pal, uint8_t threaded)
+{
+	vdp = malloc(sizeof(vdp_context));
+	init_vdp_context(vdp, pal);
+	if (threaded) {
+		vdp_start_render_thread(vdp);
+	}
+	static system_header system;
+	system.get_open_bus_value = get_open_bus_value;
+	vdp->system = &system;
+	cycle = 0;
+	set_reg(REG_MODE_1, 0x04);
+	set_reg(REG_MODE_2, 0x04 | BIT_DMA_ENABLE);
+	set_reg(REG_SCROLL_A, 0xC000 >> 10);
+	set_reg(REG_WINDOW, 0xB000 >> 10);
+	set_reg(REG_SCROLL_B, 0xE000 >> 13);
+	set_reg(REG_SAT, 0xF800 >> 9);
+	set_reg(REG_BG_COLOR, 0x01);
+	set_reg(REG_MODE_3, 0x00);
+	set_reg(REG_MODE_4, 0x81);
+	set_reg(REG_HSCROLL, 0xFC00 >> 10);
+	set_reg(REG_AUTOINC, 2);
+	set_reg(REG_SCROLL, 0x01);
+	//random patterns and name tables, with a sprite table that links all 80 sprites
+	set_address(1, 0);
+	for (uint32_t address = 0; address < 0x10000; address += 2)
+	{
+		uint16_t value = rnd();
+		if (address >= 0xB000 && address < 0xF800) {
+			value &= 0xE7FF;
+		} else if (address >= 0xF800 && address < 0xFA80) {
+			uint32_t sprite = (address - 0xF800) / 8;
+			switch ((address / 2) & 3)
+			{
+			case 0: value = 128 + rnd() % 240; break;
+			case 1: value = (rnd() & 0xF00) | ((sprite + 1) % 80); break;
+			case 2: value &= 0xE7FF; break;
+			case 3: value = 100 + rnd() % 340; break;
+			}
+		}
+		data_write(value);
+	}
+	set_address(3, 0);
+	for (int i = 0; i < 64; i++)
+	{
+		data_write(rnd() & 0xEEE);
+	}
+	set_address(5, 0);
+	for (int i = 0; i < 40; i++)
+	{
+		data_write(rnd() & 0x3FF);
+	}
+	set_reg(REG_MODE_2, 0x44 | BIT_DMA_ENABLE | BIT_VINT_EN);
+}
+
+//Mid-frame scroll, palette, VRAM and register writes plus 68K, fill and copy DMA every few hundred pixels
+static void busy_event(void)
+{
+	cycle += rnd() % 4000;
+	uint32_t r = rnd() % 100;
+	if (r < 30) {
+		set_address(1, 0xFC00 + (rnd() % 224) * 4);
+		data_write(rnd() & 0x3FF);
+		data_write(rnd() & 0x3FF);
+	} else if (r < 40) {
+		set_address(5, (rnd() % 40) * 2);
+		data_write(rnd() & 0x3FF);
+	} else if (r < 50) {
+		set_address(3, (rnd() % 64) * 2);
+		data_write(rnd() & 0xEEE);
+	} else if (r < 65) {
+		set_dma(16 + rnd() % 2048, rnd() & 0x7FFF, 0);
+		set_address(0x21, rnd() & 0xAFFE);
+	} else if (r < 72) {
+		set_dma(1 + rnd() % 1024, 0, 0x80);
+		set_address(0x21, rnd() & 0xAFFF);
+		data_write(rnd());
+		run_dma(2000);
+	} else if (r < 77) {
+		set_dma(1 + rnd() % 1024, rnd() & 0xAFFF, 0xC0);
+		set_address(0x30, rnd() & 0xAFFF);
+		run_dma(2000);
+	} else if (r < 82) {
+		set_reg(REG_BG_COLOR, rnd() & 0x3F);
+	} else if (r < 90) {
+		set_address(1, rnd() & 0xAFFE);
+		for (uint32_t n = rnd() % 32; n; n--)
+		{
+			data_write(rnd());
+		}
+	} else {
+		mix(control_read());
+	}
+}
+
+//Game style frame: the active area is left alone and everything is uploaded in vblank
+static void quiet_event(void)
+{
+	cycle += MCLKS_LINE * (4 + rnd() % 60);
+	vdp_run_context(vdp, cycle);
+	if (vdp->vcounter < vdp->inactive_start) {
+		return;
+	}
+	set_address(1, 0xFC00 + (rnd() % 224) * 4);
+	data_write(rnd() & 0x3FF);
+	data_write(rnd() & 0x3FF);
+	set_address(3, (rnd() % 64) * 2);
+	data_write(rnd() & 0xEEE);
+	set_dma(16 + rnd() % 2048, rnd() & 0x7FFF, 0);
+	set_address(0x21, rnd() & 0xAFFE);
+}
+
+//Status register polling a few times per line, like a 68K waiting for vblank
+static void poll_event(void)
+{
+	cycle += 100 + rnd() % 400;
+	mix(control_read());
+	if (!(rnd() % 64)) {
+		set_address(1, 0xFC00 + (rnd() % 224) * 4);
+		data_write(rnd() & 0x3FF);
+	}
+}
+
+//VRAM fills, VSRAM fills, VRAM copies and 68K transfers back to back from the start of vblank
+static void dma_event(void)
+{
+	cycle = vdp_run_to_vblank(vdp);
+	set_dma(0x600 + rnd() % 0x200, rnd() & 0x7FFF, 0);
+	set_address(0x21, rnd() & 0x7FFE);
+	set_dma(0x40, rnd() & 0x7FFF, 0);
+	set_address(0x23, 0);
+	if (!(rnd() % 3)) {
+		set_reg(REG_AUTOINC, 1);
+	}
+	set_dma(0x200 + rnd() % 0x200, 0, 0x80);
+	set_address(0x21, rnd() & 0x7FFF);
+	fill_write(rnd());
+	run_dma(500);
+	set_reg(REG_AUTOINC, 2);
+	set_dma(20, 0, 0x80);
+	set_address(0x25, 0);
+	fill_write(rnd() & 0x3FF);
+	run_dma(500);
+	set_dma(0x100 + rnd() % 0x100, rnd() & 0x7FFF, 0xC0);
+	set_address(0x30, rnd() & 0x7FFF);
+	run_dma(500);
+	mix(control_read());
+	cycle = vdp->cycles + MCLKS_LINE * (rnd() % 8);
+	vdp_run_context(vdp, cycle);
+}
+
+//32KB VRAM fills or copies back to back with the display disabled, so they run through blanking the whole frame
+static void blank_dma(uint8_t copy)
+{
+	set_reg(REG_MODE_2, 0x04 | BIT_DMA_ENABLE);
+	if (copy) {
+		//copies move a byte per autoinc step, so with an increment of 1 the destination stays inside VRAM
+		set_reg(REG_AUTOINC, 1);
+		set_dma(0x8000, rnd() & 0x7FFF, 0xC0);
+		set_address(0x30, rnd() & 0x7FFF);
+	} else {
+		set_dma(0x8000, 0, 0x80);
+		set_address(0x21, rnd() & 0x7FFF);
+		fill_write(rnd());
+	}
+	run_dma(MCLKS_LINE);
+	set_reg(REG_AUTOINC, 2);
+}
+
+static void fill_event(void)
+{
+	blank_dma(0);
+}
+
+static void copy_event(void)
+{
+	blank_dma(1);
+}
+
+static void (*scene_events[SCENE_COUNT])(void) = {busy_event, quiet_event, poll_event, dma_event, fill_event, copy_event};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//Runs the scene for num_frames frames and returns how long that took in nanoseconds
+static double run_scene(uint32_t scene, uint32_t num_frames, uint8_t threaded)
+{
+	rnd_state = scene + 1;
+	for (int i = 0; i < 0x8000; i++)
+	{
+		ram[i] = rnd();
+	}
+	setup(0, threaded);
+	double begin = now();
+	uint32_t start_frame = vdp->frame;
+	while (vdp->frame - start_frame < num_frames)
+	{
+		scene_events[scene]();
+		if (vdp->cycles > 0xF0000000) {
+			vdp_adjust_cycles(vdp, vdp->cycles);
+			cycle = 0;
+		}
+	}
+	if (threaded) {
+		vdp_sync_render_thread(vdp);
+	}
+	double elapsed = now() - begin;
+	mix(vdp->cycles);
+	for (int i = 0; i < VRAM_SIZE; i++)
+	{
+		mix(vdp->vdpmem[i]);
+	}
+	for (int i = 0; i < CRAM_SIZE; i++)
+	{
+		mix(vdp->cram[i]);
+	}
+	for (int i = 0; i < VSRAM_SIZE; i++)
+	{
+		mix(vdp->vsram[i]);
+	}
+	vdp_free(vdp);
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t threaded = argc > 1 && !strcmp(argv[1], "-t");
+	if (threaded) {
+		argc--;
+		argv++;
+	}
+	if (argc < 2) {
+		fatal_error("Usage: vdp_bench [-t] busy|quiet|poll|dma|fill|copy [frames=600] [reps=5]\n");
+	}
+	uint32_t scene;
+	for (scene = 0; scene < SCENE_COUNT; scene++)
+	{
+		if (!strcmp(argv[1], scene_names[scene])) {
+			break;
+		}
+	}
+	if (scene == SCENE_COUNT) {
+		fatal_error("Unknown scene %s\n", argv[1]);
+	}
+	uint32_t num_frames = argc > 2 ? strtoul(argv[2], NULL, 0) : 600;
+	uint32_t reps = argc > 3 ? strtoul(argv[3], NULL, 0) : 5;
+
+	//an untimed first run hashes every frame so output can be compared between builds
+	hash = frame_hash = 1469598103934665603ULL;
+	hash_frames = 1;
+	run_scene(scene, num_frames, threaded);
+	hash_frames = 0;
+	printf("%s: %u frames, hash %016llX\n", scene_names[scene], num_frames, (unsigned long long)mix_into(hash, frame_hash));
+
+	double best = 0;
+	for (uint32_t i = 0; i < reps; i++)
+	{
+		double elapsed = run_scene(scene, num_frames, threaded);
+		if (!i || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	printf("run: best of %u %.3f s, %.3f ms/frame\n", reps, best / 1e9, best / 1e6 / num_frames);
+	return 0;
+}
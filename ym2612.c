@@ -992,6 +992,34 @@ uint8_t ym_read_status(ym2612_context * context)
 	return context->status;
 }
 
+//Returns a cycle before which ym_read_status is guaranteed to keep returning
+//its current value as long as there are no writes in between
+uint32_t ym_status_stable_until(ym2612_context * context)
+{
+	uint32_t period = context->clock_inc * NUM_OPERATORS;
+	//timers are only updated at the start of each sample period
+	uint32_t next_period = context->current_cycle + ((NUM_OPERATORS - context->current_op) % NUM_OPERATORS) * context->clock_inc;
+	uint32_t limit = CYCLE_NEVER;
+	if (context->write_cycle != CYCLE_NEVER) {
+		//ym_run can finish up to one step past the target so be conservative
+		limit = context->write_cycle + (context->busy_cycles * context->clock_inc / 6) - context->clock_inc;
+	}
+	if (context->timer_control & BIT_TIMERA_ENABLE) {
+		uint32_t overflow = next_period + (TIMER_A_MAX - context->timer_a) * period;
+		if (overflow < limit) {
+			limit = overflow;
+		}
+	}
+	if (context->timer_control & BIT_TIMERB_ENABLE && !(context->sub_timer_b & 0xF)) {
+		uint32_t first_tick = ((0x100 - context->sub_timer_b) & 0xFF) >> 4;
+		uint32_t overflow = next_period + (first_tick + 16 * (TIMER_B_MAX - context->timer_b)) * period;
+		if (overflow < limit) {
+			limit = overflow;
+		}
+	}
+	return limit;
+}
+
 void ym_print_channel_info(ym2612_context *context, int channel)
 {
 	ym_channel *chan = context->channels + channel;
@@ -17,6 +17,10 @@
 #define MAX_MCYCLE_LENGTH 6
 #define NATIVE_CHUNK_SIZE 1024
 #define NATIVE_MAP_CHUNKS (0x10000 / NATIVE_CHUNK_SIZE)
+//longest loop body considered for idle loop skipping
+#define Z80_IDLE_LOOP_BYTES 16
+#define IDLE_NONE 0xFFFFFFFF
+#define IDLE_REJECTED 0x10000
 
 //#define DO_DEBUG_PRINT
 
@@ -65,6 +69,34 @@ uint8_t zar_off(uint8_t reg)
 	return offsetof(z80_context, alt_regs) + reg;
 }
 
+//Flags in opts->dead_flags are overwritten before they can be read, so the
+//stores below can be skipped for the instruction being translated
+static uint8_t zf_live(z80_options *opts, uint8_t flag)
+{
+	return !(opts->dead_flags & (1 << flag));
+}
+
+static void zf_setcc(z80_options *opts, uint8_t cc, uint8_t flag)
+{
+	if (zf_live(opts, flag)) {
+		setcc_rdisp(&opts->gen.code, cc, opts->gen.context_reg, zf_off(flag));
+	}
+}
+
+static void zf_set_imm(z80_options *opts, uint8_t value, uint8_t flag)
+{
+	if (zf_live(opts, flag)) {
+		mov_irdisp(&opts->gen.code, value, opts->gen.context_reg, zf_off(flag), SZ_B);
+	}
+}
+
+static void zf_set_reg(z80_options *opts, uint8_t reg, uint8_t flag)
+{
+	if (zf_live(opts, flag)) {
+		mov_rrdisp(&opts->gen.code, reg, opts->gen.context_reg, zf_off(flag), SZ_B);
+	}
+}
+
 void zreg_to_native(z80_options *opts, uint8_t reg, uint8_t native_reg)
 {
 	if (opts->regs[reg] >= 0) {
@@ -323,6 +355,19 @@ void z80_print_regs_exit(z80_context * context)
 	exit(0);
 }
 
+//Emits the call to the idle loop stub on the taken path of a loop back edge,
+//loops that the stub has already turned down for this run just branch
+static void z80_idle_check(z80_options *opts, uint16_t head, uint16_t address)
+{
+	code_info *code = &opts->gen.code;
+	cmp_irdisp(code, head | IDLE_REJECTED, opts->gen.context_reg, offsetof(z80_context, idle_head), SZ_D);
+	code_ptr rejected = code->cur + 1;
+	jcc(code, CC_Z, rejected);
+	mov_ir(code, head | address << 16, opts->gen.scratch1, SZ_D);
+	call(code, opts->idle_loop);
+	*rejected = code->cur - (rejected + 1);
+}
+
 void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address, uint8_t interp)
 {
 	uint32_t num_cycles;
@@ -879,17 +924,19 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		cycles(&opts->gen, num_cycles);
 		translate_z80_reg(inst, &dst_op, opts);
 		translate_z80_ea(inst, &src_op, opts, READ, DONT_MODIFY);
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
-		}
-		if (src_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
-		} else if (src_op.mode == MODE_IMMED) {
-			xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			if (src_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
+			} else if (src_op.mode == MODE_IMMED) {
+				xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
 		}
 		if (dst_op.mode == MODE_REG_DIRECT) {
 			if (src_op.mode == MODE_REG_DIRECT) {
@@ -900,7 +947,7 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				add_rdispr(code, src_op.base, src_op.disp, dst_op.base, z80_size(inst));
 			}
 			if (z80_size(inst) == SZ_B) {
-				mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+				zf_set_reg(opts, dst_op.base, ZF_XY);
 			}
 		} else {
 			if (src_op.mode == MODE_REG_DIRECT) {
@@ -911,24 +958,28 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				mov_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch1, z80_size(inst));
 				add_rrdisp(code, opts->gen.scratch1, dst_op.base, dst_op.disp, z80_size(inst));
 			}
-			mov_rdispr(code, dst_op.base, dst_op.disp + (z80_size(inst) == SZ_B ? 0 : 1), opts->gen.scratch1, SZ_B);
-			mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			if (zf_live(opts, ZF_XY)) {
+				mov_rdispr(code, dst_op.base, dst_op.disp + (z80_size(inst) == SZ_B ? 0 : 1), opts->gen.scratch1, SZ_B);
+				mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			}
 		}
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_C));
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
+		zf_setcc(opts, CC_C, ZF_C);
+		zf_set_imm(opts, 0, ZF_N);
 		if (z80_size(inst) == SZ_B) {
-			setcc_rdisp(code, CC_O, opts->gen.context_reg, zf_off(ZF_PV));
-			setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-			setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
+			zf_setcc(opts, CC_O, ZF_PV);
+			zf_setcc(opts, CC_Z, ZF_Z);
+			zf_setcc(opts, CC_S, ZF_S);
 		}
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
+			zf_setcc(opts, CC_C, ZF_H);
 		}
-		bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_H));
-		if (z80_size(inst) == SZ_W & dst_op.mode == MODE_REG_DIRECT) {
+		if (z80_size(inst) == SZ_W && dst_op.mode == MODE_REG_DIRECT && zf_live(opts, ZF_XY)) {
 			mov_rr(code, dst_op.base, opts->gen.scratch2, SZ_W);
 			shr_ir(code, 8, opts->gen.scratch2, SZ_W);
 			mov_rrdisp(code, opts->gen.scratch2, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
@@ -947,17 +998,19 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		cycles(&opts->gen, num_cycles);
 		translate_z80_reg(inst, &dst_op, opts);
 		translate_z80_ea(inst, &src_op, opts, READ, DONT_MODIFY);
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
-		}
-		if (src_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
-		} else if (src_op.mode == MODE_IMMED) {
-			xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			if (src_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
+			} else if (src_op.mode == MODE_IMMED) {
+				xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
 		}
 		bt_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_C), SZ_B);
 		if (dst_op.mode == MODE_REG_DIRECT) {
@@ -969,7 +1022,7 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				adc_rdispr(code, src_op.base, src_op.disp, dst_op.base, z80_size(inst));
 			}
 			if (z80_size(inst) == SZ_B) {
-				mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+				zf_set_reg(opts, dst_op.base, ZF_XY);
 			}
 		} else {
 			if (src_op.mode == MODE_REG_DIRECT) {
@@ -980,22 +1033,26 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				mov_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch1, z80_size(inst));
 				adc_rrdisp(code, opts->gen.scratch1, dst_op.base, dst_op.disp, z80_size(inst));
 			}
-			mov_rdispr(code, dst_op.base, dst_op.disp + z80_size(inst) == SZ_B ? 0 : 8, opts->gen.scratch1, SZ_B);
-			mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			if (zf_live(opts, ZF_XY)) {
+				mov_rdispr(code, dst_op.base, dst_op.disp + z80_size(inst) == SZ_B ? 0 : 8, opts->gen.scratch1, SZ_B);
+				mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			}
 		}
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_C));
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-		setcc_rdisp(code, CC_O, opts->gen.context_reg, zf_off(ZF_PV));
-		setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-		setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+		zf_setcc(opts, CC_C, ZF_C);
+		zf_set_imm(opts, 0, ZF_N);
+		zf_setcc(opts, CC_O, ZF_PV);
+		zf_setcc(opts, CC_Z, ZF_Z);
+		zf_setcc(opts, CC_S, ZF_S);
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
+			zf_setcc(opts, CC_C, ZF_H);
 		}
-		bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_H));
-		if (z80_size(inst) == SZ_W & dst_op.mode == MODE_REG_DIRECT) {
+		if (z80_size(inst) == SZ_W && dst_op.mode == MODE_REG_DIRECT && zf_live(opts, ZF_XY)) {
 			mov_rr(code, dst_op.base, opts->gen.scratch2, SZ_W);
 			shr_ir(code, 8, opts->gen.scratch2, SZ_W);
 			mov_rrdisp(code, opts->gen.scratch2, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
@@ -1012,17 +1069,19 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		cycles(&opts->gen, num_cycles);
 		translate_z80_reg(inst, &dst_op, opts);
 		translate_z80_ea(inst, &src_op, opts, READ, DONT_MODIFY);
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
-		}
-		if (src_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
-		} else if (src_op.mode == MODE_IMMED) {
-			xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			if (src_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
+			} else if (src_op.mode == MODE_IMMED) {
+				xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
 		}
 		if (dst_op.mode == MODE_REG_DIRECT) {
 			if (src_op.mode == MODE_REG_DIRECT) {
@@ -1033,7 +1092,7 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				sub_rdispr(code, src_op.base, src_op.disp, dst_op.base, z80_size(inst));
 			}
 			if (z80_size(inst) == SZ_B) {
-				mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+				zf_set_reg(opts, dst_op.base, ZF_XY);
 			}
 		} else {
 			if (src_op.mode == MODE_REG_DIRECT) {
@@ -1044,22 +1103,26 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				mov_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch1, z80_size(inst));
 				sub_rrdisp(code, opts->gen.scratch1, dst_op.base, dst_op.disp, z80_size(inst));
 			}
-			mov_rdispr(code, dst_op.base, dst_op.disp + z80_size(inst) == SZ_B ? 0 : 8, opts->gen.scratch1, SZ_B);
-			mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			if (zf_live(opts, ZF_XY)) {
+				mov_rdispr(code, dst_op.base, dst_op.disp + z80_size(inst) == SZ_B ? 0 : 8, opts->gen.scratch1, SZ_B);
+				mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			}
 		}
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_C));
-		mov_irdisp(code, 1, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-		setcc_rdisp(code, CC_O, opts->gen.context_reg, zf_off(ZF_PV));
-		setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-		setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+		zf_setcc(opts, CC_C, ZF_C);
+		zf_set_imm(opts, 1, ZF_N);
+		zf_setcc(opts, CC_O, ZF_PV);
+		zf_setcc(opts, CC_Z, ZF_Z);
+		zf_setcc(opts, CC_S, ZF_S);
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
+			zf_setcc(opts, CC_C, ZF_H);
 		}
-		bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_H));
-		if (z80_size(inst) == SZ_W & dst_op.mode == MODE_REG_DIRECT) {
+		if (z80_size(inst) == SZ_W && dst_op.mode == MODE_REG_DIRECT && zf_live(opts, ZF_XY)) {
 			mov_rr(code, dst_op.base, opts->gen.scratch2, SZ_W);
 			shr_ir(code, 8, opts->gen.scratch2, SZ_W);
 			mov_rrdisp(code, opts->gen.scratch2, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
@@ -1078,17 +1141,19 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		cycles(&opts->gen, num_cycles);
 		translate_z80_reg(inst, &dst_op, opts);
 		translate_z80_ea(inst, &src_op, opts, READ, DONT_MODIFY);
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
-		}
-		if (src_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
-		} else if (src_op.mode == MODE_IMMED) {
-			xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			if (src_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
+			} else if (src_op.mode == MODE_IMMED) {
+				xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
 		}
 		bt_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_C), SZ_B);
 		if (dst_op.mode == MODE_REG_DIRECT) {
@@ -1100,7 +1165,7 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				sbb_rdispr(code, src_op.base, src_op.disp, dst_op.base, z80_size(inst));
 			}
 			if (z80_size(inst) == SZ_B) {
-				mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+				zf_set_reg(opts, dst_op.base, ZF_XY);
 			}
 		} else {
 			if (src_op.mode == MODE_REG_DIRECT) {
@@ -1111,22 +1176,26 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 				mov_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch1, z80_size(inst));
 				sbb_rrdisp(code, opts->gen.scratch1, dst_op.base, dst_op.disp, z80_size(inst));
 			}
-			mov_rdispr(code, dst_op.base, dst_op.disp + z80_size(inst) == SZ_B ? 0 : 8, opts->gen.scratch1, SZ_B);
-			mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			if (zf_live(opts, ZF_XY)) {
+				mov_rdispr(code, dst_op.base, dst_op.disp + z80_size(inst) == SZ_B ? 0 : 8, opts->gen.scratch1, SZ_B);
+				mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			}
 		}
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_C));
-		mov_irdisp(code, 1, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-		setcc_rdisp(code, CC_O, opts->gen.context_reg, zf_off(ZF_PV));
-		setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-		setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
-		if (dst_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+		zf_setcc(opts, CC_C, ZF_C);
+		zf_set_imm(opts, 1, ZF_N);
+		zf_setcc(opts, CC_O, ZF_PV);
+		zf_setcc(opts, CC_Z, ZF_Z);
+		zf_setcc(opts, CC_S, ZF_S);
+		if (zf_live(opts, ZF_H)) {
+			if (dst_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
+			zf_setcc(opts, CC_C, ZF_H);
 		}
-		bt_ir(code, z80_size(inst) == SZ_B ? 4 : 12, opts->gen.scratch2, z80_size(inst));
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_H));
-		if (z80_size(inst) == SZ_W & dst_op.mode == MODE_REG_DIRECT) {
+		if (z80_size(inst) == SZ_W && dst_op.mode == MODE_REG_DIRECT && zf_live(opts, ZF_XY)) {
 			mov_rr(code, dst_op.base, opts->gen.scratch2, SZ_W);
 			shr_ir(code, 8, opts->gen.scratch2, SZ_W);
 			mov_rrdisp(code, opts->gen.scratch2, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
@@ -1152,13 +1221,13 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		} else {
 			and_rdispr(code, src_op.base, src_op.disp, dst_op.base, z80_size(inst));
 		}
-		mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_C), SZ_B);
-		mov_irdisp(code, 1, opts->gen.context_reg, zf_off(ZF_H), SZ_B);
-		setcc_rdisp(code, CC_P, opts->gen.context_reg, zf_off(ZF_PV));
-		setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-		setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
+		zf_set_reg(opts, dst_op.base, ZF_XY);
+		zf_set_imm(opts, 0, ZF_N);
+		zf_set_imm(opts, 0, ZF_C);
+		zf_set_imm(opts, 1, ZF_H);
+		zf_setcc(opts, CC_P, ZF_PV);
+		zf_setcc(opts, CC_Z, ZF_Z);
+		zf_setcc(opts, CC_S, ZF_S);
 		z80_save_reg(inst, opts);
 		z80_save_ea(code, inst, opts);
 		break;
@@ -1180,13 +1249,13 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		} else {
 			or_rdispr(code, src_op.base, src_op.disp, dst_op.base, z80_size(inst));
 		}
-		mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_C), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_H), SZ_B);
-		setcc_rdisp(code, CC_P, opts->gen.context_reg, zf_off(ZF_PV));
-		setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-		setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
+		zf_set_reg(opts, dst_op.base, ZF_XY);
+		zf_set_imm(opts, 0, ZF_N);
+		zf_set_imm(opts, 0, ZF_C);
+		zf_set_imm(opts, 0, ZF_H);
+		zf_setcc(opts, CC_P, ZF_PV);
+		zf_setcc(opts, CC_Z, ZF_Z);
+		zf_setcc(opts, CC_S, ZF_S);
 		z80_save_reg(inst, opts);
 		z80_save_ea(code, inst, opts);
 		break;
@@ -1208,13 +1277,13 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		} else {
 			xor_rdispr(code, src_op.base, src_op.disp, dst_op.base, z80_size(inst));
 		}
-		mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_C), SZ_B);
-		mov_irdisp(code, 0, opts->gen.context_reg, zf_off(ZF_H), SZ_B);
-		setcc_rdisp(code, CC_P, opts->gen.context_reg, zf_off(ZF_PV));
-		setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-		setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
+		zf_set_reg(opts, dst_op.base, ZF_XY);
+		zf_set_imm(opts, 0, ZF_N);
+		zf_set_imm(opts, 0, ZF_C);
+		zf_set_imm(opts, 0, ZF_H);
+		zf_setcc(opts, CC_P, ZF_PV);
+		zf_setcc(opts, CC_Z, ZF_Z);
+		zf_setcc(opts, CC_S, ZF_S);
 		z80_save_reg(inst, opts);
 		z80_save_ea(code, inst, opts);
 		break;
@@ -1230,30 +1299,34 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		mov_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
 		if (src_op.mode == MODE_REG_DIRECT) {
 			sub_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
-			mov_rrdisp(code, src_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			zf_set_reg(opts, src_op.base, ZF_XY);
 		} else if (src_op.mode == MODE_IMMED) {
 			sub_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
-			mov_irdisp(code, src_op.disp, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			zf_set_imm(opts, src_op.disp, ZF_XY);
 		} else {
 			sub_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
-			mov_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch1, SZ_B);
-			mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			if (zf_live(opts, ZF_XY)) {
+				mov_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch1, SZ_B);
+				mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			}
 		}
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_C));
-		mov_irdisp(code, 1, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-		setcc_rdisp(code, CC_O, opts->gen.context_reg, zf_off(ZF_PV));
-		setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-		setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
-		xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
-		if (src_op.mode == MODE_REG_DIRECT) {
-			xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
-		} else if (src_op.mode == MODE_IMMED) {
-			xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
-		} else {
-			xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+		zf_setcc(opts, CC_C, ZF_C);
+		zf_set_imm(opts, 1, ZF_N);
+		zf_setcc(opts, CC_O, ZF_PV);
+		zf_setcc(opts, CC_Z, ZF_Z);
+		zf_setcc(opts, CC_S, ZF_S);
+		if (zf_live(opts, ZF_H)) {
+			xor_rr(code, dst_op.base, opts->gen.scratch2, z80_size(inst));
+			if (src_op.mode == MODE_REG_DIRECT) {
+				xor_rr(code, src_op.base, opts->gen.scratch2, z80_size(inst));
+			} else if (src_op.mode == MODE_IMMED) {
+				xor_ir(code, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			} else {
+				xor_rdispr(code, src_op.base, src_op.disp, opts->gen.scratch2, z80_size(inst));
+			}
+			bt_ir(code, 4, opts->gen.scratch2, SZ_B);
+			zf_setcc(opts, CC_C, ZF_H);
 		}
-		bt_ir(code, 4, opts->gen.scratch2, SZ_B);
-		setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_H));
 		z80_save_reg(inst, opts);
 		z80_save_ea(code, inst, opts);
 		break;
@@ -1267,7 +1340,7 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		if (dst_op.mode == MODE_UNUSED) {
 			translate_z80_ea(inst, &dst_op, opts, READ, MODIFY);
 		}
-		if (z80_size(inst) == SZ_B) {
+		if (z80_size(inst) == SZ_B && zf_live(opts, ZF_H)) {
 			if (dst_op.mode == MODE_REG_DIRECT) {
 				if (dst_op.base >= AH && dst_op.base <= BH) {
 					mov_rr(code, dst_op.base - AH, opts->gen.scratch2, SZ_W);
@@ -1292,26 +1365,29 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 			}
 		}
 		if (z80_size(inst) == SZ_B) {
-			mov_irdisp(code, inst->op == Z80_DEC, opts->gen.context_reg, zf_off(ZF_N), SZ_B);
-			setcc_rdisp(code, CC_O, opts->gen.context_reg, zf_off(ZF_PV));
-			setcc_rdisp(code, CC_Z, opts->gen.context_reg, zf_off(ZF_Z));
-			setcc_rdisp(code, CC_S, opts->gen.context_reg, zf_off(ZF_S));
-			int bit = 4;
+			zf_set_imm(opts, inst->op == Z80_DEC, ZF_N);
+			zf_setcc(opts, CC_O, ZF_PV);
+			zf_setcc(opts, CC_Z, ZF_Z);
+			zf_setcc(opts, CC_S, ZF_S);
 			if (dst_op.mode == MODE_REG_DIRECT) {
-				mov_rrdisp(code, dst_op.base, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
-				if (dst_op.base >= AH && dst_op.base <= BH) {
+				zf_set_reg(opts, dst_op.base, ZF_XY);
+			} else if (zf_live(opts, ZF_XY)) {
+				mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch1, SZ_B);
+				mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+			}
+			if (zf_live(opts, ZF_H)) {
+				int bit = 4;
+				if (dst_op.mode != MODE_REG_DIRECT) {
+					xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, SZ_B);
+				} else if (dst_op.base >= AH && dst_op.base <= BH) {
 					bit = 12;
 					xor_rr(code, dst_op.base - AH, opts->gen.scratch2, SZ_W);
 				} else {
 					xor_rr(code, dst_op.base, opts->gen.scratch2, SZ_B);
 				}
-			} else {
-				mov_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch1, SZ_B);
-				xor_rdispr(code, dst_op.base, dst_op.disp, opts->gen.scratch2, SZ_B);
-				mov_rrdisp(code, opts->gen.scratch1, opts->gen.context_reg, zf_off(ZF_XY), SZ_B);
+				bt_ir(code, bit, opts->gen.scratch2, SZ_W);
+				zf_setcc(opts, CC_C, ZF_H);
 			}
-			bt_ir(code, bit, opts->gen.scratch2, SZ_W);
-			setcc_rdisp(code, CC_C, opts->gen.context_reg, zf_off(ZF_H));
 		}
 		z80_save_reg(inst, opts);
 		z80_save_ea(code, inst, opts);
@@ -2056,6 +2132,9 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		}
 		cycles(&opts->gen, num_cycles);
 		if (inst->addr_mode != Z80_REG_INDIRECT) {
+			if (opts->idle_back_edge) {
+				z80_idle_check(opts, inst->immed, address);
+			}
 			code_ptr call_dst = z80_get_native_address(context, inst->immed);
 			if (!call_dst) {
 				opts->gen.deferred = defer_address(opts->gen.deferred, inst->immed, code->cur + 1);
@@ -2104,6 +2183,9 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		jcc(code, cond, code->cur+2);
 		cycles(&opts->gen, 5);//T States: 5
 		uint16_t dest_addr = inst->immed;
+		if (opts->idle_back_edge) {
+			z80_idle_check(opts, dest_addr, address);
+		}
 		code_ptr call_dst = z80_get_native_address(context, dest_addr);
 			if (!call_dst) {
 			opts->gen.deferred = defer_address(opts->gen.deferred, dest_addr, code->cur + 1);
@@ -2112,11 +2194,18 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 			}
 		jmp(code, call_dst);
 		*no_jump_off = code->cur - (no_jump_off+1);
+		if (opts->idle_back_edge) {
+			//leaving the loop ends the current measurement
+			mov_irdisp(code, IDLE_NONE, opts->gen.context_reg, offsetof(z80_context, idle_head), SZ_D);
+		}
 		break;
 	}
 	case Z80_JR: {
 		cycles(&opts->gen, num_cycles + 8);//T States: 4,3,5
 		uint16_t dest_addr = address + inst->immed + 2;
+		if (opts->idle_back_edge) {
+			z80_idle_check(opts, dest_addr, address);
+		}
 		code_ptr call_dst = z80_get_native_address(context, dest_addr);
 			if (!call_dst) {
 			opts->gen.deferred = defer_address(opts->gen.deferred, dest_addr, code->cur + 1);
@@ -2146,6 +2235,9 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 		jcc(code, cond, code->cur+2);
 		cycles(&opts->gen, 5);//T States: 5
 		uint16_t dest_addr = address + inst->immed + 2;
+		if (opts->idle_back_edge) {
+			z80_idle_check(opts, dest_addr, address);
+		}
 		code_ptr call_dst = z80_get_native_address(context, dest_addr);
 			if (!call_dst) {
 			opts->gen.deferred = defer_address(opts->gen.deferred, dest_addr, code->cur + 1);
@@ -2154,6 +2246,9 @@ void translate_z80inst(z80inst * inst, z80_context * context, uint16_t address,
 			}
 		jmp(code, call_dst);
 		*no_jump_off = code->cur - (no_jump_off+1);
+		if (opts->idle_back_edge) {
+			mov_irdisp(code, IDLE_NONE, opts->gen.context_reg, offsetof(z80_context, idle_head), SZ_D);
+		}
 		break;
 	}
 	case Z80_DJNZ: {
@@ -2883,22 +2978,12 @@ code_info z80_make_interp_stub(z80_context * context, uint16_t address)
 uint8_t * z80_get_native_address(z80_context * context, uint32_t address)
 {
 	z80_options *opts = context->options;
-	native_map_slot * native_code_map = opts->gen.native_code_map;
-	
 	memmap_chunk const *mem_chunk = find_map_chunk(address, &opts->gen, 0, NULL);
 	if (mem_chunk) {
 		//calculate the lowest alias for this address
 		address = mem_chunk->start + ((address - mem_chunk->start) & mem_chunk->mask);
 	}
-	uint32_t chunk = address / NATIVE_CHUNK_SIZE;
-	if (!native_code_map[chunk].base) {
-		return NULL;
-	}
-	uint32_t offset = address % NATIVE_CHUNK_SIZE;
-	if (native_code_map[chunk].offsets[offset] == INVALID_OFFSET || native_code_map[chunk].offsets[offset] == EXTENSION_WORD) {
-		return NULL;
-	}
-	return native_code_map[chunk].base + native_code_map[chunk].offsets[offset];
+	return native_map_lookup(&opts->gen.native_code_map, address);
 }
 
 uint8_t z80_get_native_inst_size(z80_options * opts, uint32_t address)
@@ -2942,26 +3027,11 @@ void z80_map_native_address(z80_context * context, uint32_t address, uint8_t * n
 		address &= opts->gen.address_mask;
 	}
 	
-	native_map_slot *map = opts->gen.native_code_map + address / NATIVE_CHUNK_SIZE;
-	if (!map->base) {
-		map->base = native_address;
-		map->offsets = malloc(sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-		memset(map->offsets, 0xFF, sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-	}
-	map->offsets[address % NATIVE_CHUNK_SIZE] = native_address - map->base;
+	native_map_set(&opts->gen.native_code_map, address, native_address);
 	for(--size, address++; size; --size, address++) {
 		address &= opts->gen.address_mask;
-		map = opts->gen.native_code_map + address / NATIVE_CHUNK_SIZE;
-		if (!map->base) {
-			map->base = native_address;
-			map->offsets = malloc(sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-			memset(map->offsets, 0xFF, sizeof(int32_t) * NATIVE_CHUNK_SIZE);
-		}
-	
-		if (map->offsets[address % NATIVE_CHUNK_SIZE] == INVALID_OFFSET) {
-			//TODO: better handling of potentially overlapping instructions
-			map->offsets[address % NATIVE_CHUNK_SIZE] = EXTENSION_WORD;
-		}
+		//TODO: better handling of potentially overlapping instructions
+		native_map_set_extension(&opts->gen.native_code_map, address);
 	}
 }
 
@@ -2970,52 +3040,116 @@ void z80_map_native_address(z80_context * context, uint32_t address, uint8_t * n
 uint32_t z80_get_instruction_start(z80_context *context, uint32_t address)
 {	
 	z80_options *opts = context->options;
-	native_map_slot * native_code_map = opts->gen.native_code_map;
 	memmap_chunk const *mem_chunk = find_map_chunk(address, &opts->gen, 0, NULL);
 	if (mem_chunk) {
 		//calculate the lowest alias for this address
 		address = mem_chunk->start + ((address - mem_chunk->start) & mem_chunk->mask);
 	}
 	
-	uint32_t chunk = address / NATIVE_CHUNK_SIZE;
-	if (!native_code_map[chunk].base) {
+	uint32_t offset = native_map_offset(&opts->gen.native_code_map, address);
+	if (offset == INVALID_OFFSET) {
 		return INVALID_INSTRUCTION_START;
 	}
-	uint32_t offset = address % NATIVE_CHUNK_SIZE;
-	if (native_code_map[chunk].offsets[offset] == INVALID_OFFSET) {
-		return INVALID_INSTRUCTION_START;
-	}
-	while (native_code_map[chunk].offsets[offset] == EXTENSION_WORD)
+	while (offset == EXTENSION_WORD)
 	{
 		--address;
-		chunk = address / NATIVE_CHUNK_SIZE;
-		offset = address % NATIVE_CHUNK_SIZE;
+		offset = native_map_offset(&opts->gen.native_code_map, address);
 	}
 	return address;
 }
 
 //Technically unbounded due to redundant prefixes, but this is the max useful size
 #define Z80_MAX_INST_SIZE 4
+//Flag liveness never looks further than this many bytes past the start of an
+//instruction, so a code write can only affect instructions this far back
+#define Z80_FLAG_WINDOW (2*Z80_MAX_INST_SIZE)
+
+//Overwrites the native code of the instruction at address with a call to the retranslation stub
+static code_ptr z80_patch_for_retrans(z80_options *opts, code_ptr native, uint32_t address)
+{
+	code_info code = {native, native+32, 0};
+	mov_ir(&code, address, opts->gen.scratch1, SZ_D);
+	//the stub never returns, so the stack doesn't need to be aligned for it
+	call_noalign(&code, opts->retrans_stub);
+	return code.cur;
+}
 
 z80_context * z80_handle_code_write(uint32_t address, z80_context * context)
 {
 	uint32_t inst_start = z80_get_instruction_start(context, address);
-	while (inst_start != INVALID_INSTRUCTION_START && (address - inst_start) < Z80_MAX_INST_SIZE) {
+	while (inst_start != INVALID_INSTRUCTION_START && (address - inst_start) < Z80_FLAG_WINDOW) {
 		code_ptr dst = z80_get_native_address(context, inst_start);
-		code_info code = {dst, dst+32, 0};
-		z80_options * opts = context->options;
-		dprintf("patching code at %p for Z80 instruction at %X due to write to %X\n", code.cur, inst_start, address);
-		mov_ir(&code, inst_start, opts->gen.scratch1, SZ_D);
-		call(&code, opts->retrans_stub);
+		dprintf("patching code at %p for Z80 instruction at %X due to write to %X\n", dst, inst_start, address);
+		z80_patch_for_retrans(context->options, dst, inst_start);
 		inst_start = z80_get_instruction_start(context, inst_start - 1);
 	}
 	return context;
 }
 
+//Records a write to Z80 RAM made while the Z80 can't run, the affected code is
+//invalidated in one go by z80_apply_code_writes before it runs again
+void z80_defer_code_write(z80_context *context, uint32_t address)
+{
+	for (uint32_t i = 0; i < context->num_pending_writes; i++)
+	{
+		if (address + 1 >= context->pending_write_start[i] && address <= context->pending_write_end[i]) {
+			if (address < context->pending_write_start[i]) {
+				context->pending_write_start[i] = address;
+			} else if (address == context->pending_write_end[i]) {
+				context->pending_write_end[i]++;
+			}
+			return;
+		}
+	}
+	if (context->num_pending_writes < Z80_PENDING_WRITE_RANGES) {
+		context->pending_write_start[context->num_pending_writes] = address;
+		context->pending_write_end[context->num_pending_writes++] = address + 1;
+	} else {
+		//out of ranges, grow the last one to cover this write
+		uint32_t last = Z80_PENDING_WRITE_RANGES - 1;
+		if (address < context->pending_write_start[last]) {
+			context->pending_write_start[last] = address;
+		} else if (address >= context->pending_write_end[last]) {
+			context->pending_write_end[last] = address + 1;
+		}
+	}
+}
+
+static void z80_apply_code_writes(z80_context *context)
+{
+	for (uint32_t i = 0; i < context->num_pending_writes; i++)
+	{
+		//instructions that start a little before a written byte can include it
+		//or have had their flag stores trimmed based on it
+		uint32_t start = context->pending_write_start[i];
+		start = start >= Z80_FLAG_WINDOW - 1 ? start - (Z80_FLAG_WINDOW - 1) : 0;
+		z80_invalidate_code_range(context, start, context->pending_write_end[i]);
+	}
+	context->num_pending_writes = 0;
+}
+
+static void z80_free_code_bank(z80_code_bank *bank)
+{
+	free(bank->insts);
+	free(bank->saved);
+}
+
+void z80_flush_code_cache(z80_context *context)
+{
+	z80_options *opts = context->options;
+	flush_code_cache(&opts->gen);
+	for (uint32_t i = 0; i < opts->num_code_banks; i++)
+	{
+		z80_free_code_bank(opts->code_banks + i);
+	}
+	opts->num_code_banks = 0;
+	memset(context->ram_code_flags, 0, ram_size(&opts->gen) / (1 << opts->gen.ram_flags_shift) / 8);
+	memset(context->interp_code, 0, sizeof(context->interp_code));
+}
+
 void z80_invalidate_code_range(z80_context *context, uint32_t start, uint32_t end)
 {
 	z80_options *opts = context->options;
-	native_map_slot * native_code_map = opts->gen.native_code_map;
 	memmap_chunk const *mem_chunk = find_map_chunk(start, &opts->gen, 0, NULL);
 	if (mem_chunk) {
 		//calculate the lowest alias for this address
@@ -3029,21 +3163,135 @@ void z80_invalidate_code_range(z80_context *context, uint32_t start, uint32_t en
 	uint32_t start_chunk = start / NATIVE_CHUNK_SIZE, end_chunk = end / NATIVE_CHUNK_SIZE;
 	for (uint32_t chunk = start_chunk; chunk <= end_chunk; chunk++)
 	{
-		if (native_code_map[chunk].base) {
+		native_map_slot *slot = find_native_slot(&opts->gen.native_code_map, chunk * NATIVE_CHUNK_SIZE);
+		if (slot) {
 			uint32_t start_offset = chunk == start_chunk ? start % NATIVE_CHUNK_SIZE : 0;
 			uint32_t end_offset = chunk == end_chunk ? end % NATIVE_CHUNK_SIZE : NATIVE_CHUNK_SIZE;
 			for (uint32_t offset = start_offset; offset < end_offset; offset++)
 			{
-				if (native_code_map[chunk].offsets[offset] != INVALID_OFFSET && native_code_map[chunk].offsets[offset] != EXTENSION_WORD) {
-					code_info code;
-					code.cur = native_code_map[chunk].base + native_code_map[chunk].offsets[offset];
-					code.last = code.cur + 32;
-					code.stack_off = 0;
-					mov_ir(&code, chunk * NATIVE_CHUNK_SIZE + offset, opts->gen.scratch1, SZ_D);
-					call(&code, opts->retrans_stub);
+				uint32_t native_off = native_slot_offset(slot, offset);
+				if (native_off != INVALID_OFFSET && native_off != EXTENSION_WORD) {
+					z80_patch_for_retrans(opts, slot->base + (int32_t)native_off, chunk * NATIVE_CHUNK_SIZE + offset);
+				}
+			}
+		}
+	}
+}
+
+static uint8_t z80_has_breakpoint(z80_context *context, uint16_t address)
+{
+	return context->breakpoint_flags[address / 8] & (1 << (address % 8));
+}
+
+//puts back the normal cycle check at the start of the translation of a breakpoint
+static void z80_clear_breakpoint_patch(z80_options *opts, code_ptr native, uint16_t address)
+{
+	code_info tmp_code = opts->gen.code;
+	opts->gen.code.cur = native;
+	opts->gen.code.last = native + 128;
+	check_cycles_int(&opts->gen, address);
+	opts->gen.code = tmp_code;
+}
+
+//Called after the memory behind start-end has been switched from old_base to new_base.
+//Translations for old_base are set aside rather than thrown away and the ones for
+//new_base are put back if it was seen in this range before. Either base can be NULL
+//for memory whose contents can change while it's switched out, like cartridge RAM
+void z80_switch_code_bank(z80_context *context, uint32_t start, uint32_t end, uint8_t *old_base, uint8_t *new_base)
+{
+	z80_options *opts = context->options;
+	native_map *map = &opts->gen.native_code_map;
+	z80_code_bank *bank = NULL;
+	if (old_base) {
+		if (opts->num_code_banks == opts->code_bank_storage) {
+			opts->code_bank_storage = opts->code_bank_storage ? opts->code_bank_storage * 2 : 8;
+			opts->code_banks = realloc(opts->code_banks, opts->code_bank_storage * sizeof(z80_code_bank));
+		}
+		bank = opts->code_banks + opts->num_code_banks++;
+		memset(bank, 0, sizeof(z80_code_bank));
+		bank->base = old_base;
+		bank->start = start;
+		bank->end = end;
+	}
+	uint32_t storage = 0;
+	uint32_t start_chunk = start / NATIVE_CHUNK_SIZE, end_chunk = (end - 1) / NATIVE_CHUNK_SIZE;
+	for (uint32_t chunk = start_chunk; chunk <= end_chunk; chunk++)
+	{
+		native_map_slot *slot = find_native_slot(map, chunk * NATIVE_CHUNK_SIZE);
+		if (!slot) {
+			continue;
+		}
+		uint32_t start_offset = chunk == start_chunk ? start % NATIVE_CHUNK_SIZE : 0;
+		uint32_t end_offset = chunk == end_chunk ? (end - 1) % NATIVE_CHUNK_SIZE + 1 : NATIVE_CHUNK_SIZE;
+		for (uint32_t offset = start_offset; offset < end_offset; offset++)
+		{
+			uint32_t native_off = native_slot_offset(slot, offset);
+			if (native_off == INVALID_OFFSET) {
+				continue;
+			}
+			uint32_t address = chunk * NATIVE_CHUNK_SIZE + offset;
+			native_map_clear(map, address);
+			if (native_off == EXTENSION_WORD) {
+				if (bank && bank->num_insts) {
+					z80_bank_inst *last = bank->insts + bank->num_insts - 1;
+					if (last->address + last->size == address) {
+						last->size++;
+					}
 				}
+				continue;
+			}
+			code_ptr native = slot->base + (int32_t)native_off;
+			if (!bank) {
+				z80_patch_for_retrans(opts, native, address);
+				continue;
+			}
+			if (bank->num_insts == storage) {
+				storage = storage ? storage * 2 : 256;
+				bank->insts = realloc(bank->insts, storage * sizeof(z80_bank_inst));
+				bank->saved = realloc(bank->saved, storage * opts->retrans_patch_size);
+			}
+			memcpy(bank->saved + bank->num_insts * opts->retrans_patch_size, native, opts->retrans_patch_size);
+			bank->insts[bank->num_insts++] = (z80_bank_inst){
+				.native = native,
+				.address = address,
+				.size = 1,
+				.native_size = z80_get_native_inst_size(opts, address),
+				.breakpoint = z80_has_breakpoint(context, address) != 0
+			};
+		}
+	}
+	//patches can run into the next instruction, so they wait until all the bytes are saved.
+	//Anything still jumping straight into the old code ends up in the retranslation stub,
+	//which sends it to the code for the new bank without touching the old code
+	for (uint32_t i = 0; bank && i < bank->num_insts; i++)
+	{
+		z80_patch_for_retrans(opts, bank->insts[i].native, bank->insts[i].address);
+	}
+	if (!new_base) {
+		return;
+	}
+	for (uint32_t i = 0; i < opts->num_code_banks; i++)
+	{
+		z80_code_bank *cached = opts->code_banks + i;
+		if (cached->base != new_base || cached->start != start || cached->end != end || cached == bank) {
+			continue;
+		}
+		for (uint32_t j = 0; j < cached->num_insts; j++)
+		{
+			z80_bank_inst *inst = cached->insts + j;
+			memcpy(inst->native, cached->saved + j * opts->retrans_patch_size, opts->retrans_patch_size);
+			z80_map_native_address(context, inst->address, inst->native, inst->size, inst->native_size);
+			//breakpoints may have been added or removed while the bank was switched out
+			uint8_t breakpoint = z80_has_breakpoint(context, inst->address) != 0;
+			if (breakpoint && !inst->breakpoint) {
+				zbreakpoint_patch(context, inst->address, inst->native);
+			} else if (!breakpoint && inst->breakpoint) {
+				z80_clear_breakpoint_patch(opts, inst->native, inst->address);
 			}
 		}
+		z80_free_code_bank(cached);
+		*cached = opts->code_banks[--opts->num_code_banks];
+		break;
 	}
 }
 
@@ -3074,6 +3322,11 @@ void * z80_retranslate_inst(uint32_t address, z80_context * context, uint8_t * o
 {
 	char disbuf[80];
 	z80_options * opts = context->options;
+	if (z80_get_native_address(context, address) != orig_start) {
+		//orig_start belongs to a bank that was switched out, leave it alone so it
+		//can be switched back in and continue with whatever is mapped now
+		return z80_get_native_address_trans(context, address);
+	}
 	uint8_t orig_size = z80_get_native_inst_size(opts, address);
 	code_info *code = &opts->gen.code;
 	uint8_t *after, *inst = get_native_pointer(address, (void **)context->mem_pointers, &opts->gen);
@@ -3136,6 +3389,418 @@ void * z80_retranslate_inst(uint32_t address, z80_context * context, uint8_t * o
 	}
 }
 
+static uint8_t z80_flags_written(z80inst *inst)
+{
+	uint8_t all = (1 << ZF_NUM) - 1;
+	switch (inst->op)
+	{
+	case Z80_ADD:
+		if (z80_size(inst) == SZ_W) {
+			return 1 << ZF_C | 1 << ZF_N | 1 << ZF_H | 1 << ZF_XY;
+		}
+		return all;
+	case Z80_ADC:
+	case Z80_SUB:
+	case Z80_SBC:
+	case Z80_AND:
+	case Z80_OR:
+	case Z80_XOR:
+	case Z80_CP:
+	case Z80_NEG:
+	case Z80_SLA:
+	case Z80_SRA:
+	case Z80_SLL:
+	case Z80_SRL:
+		return all;
+	case Z80_INC:
+	case Z80_DEC:
+		return z80_size(inst) == SZ_B ? all & ~(1 << ZF_C) : 0;
+	case Z80_RLC:
+	case Z80_RL:
+	case Z80_RRC:
+	case Z80_RR:
+		//rlca, rla, rrca and rra leave S, Z and P/V alone
+		return inst->immed ? all : 1 << ZF_C | 1 << ZF_N | 1 << ZF_H | 1 << ZF_XY;
+	case Z80_POP:
+		return inst->reg == Z80_AF ? all : 0;
+	default:
+		return 0;
+	}
+}
+
+//A store can rewrite an instruction the liveness scan has already decoded and I/O
+//can have effects it can't see, so neither may be stepped over
+static uint8_t z80_writes_memory_or_io(z80inst *inst)
+{
+	uint8_t mode = inst->addr_mode & 0x1F;
+	switch (inst->op)
+	{
+	case Z80_PUSH:
+	case Z80_RLD:
+	case Z80_RRD:
+	case Z80_IN:
+	case Z80_OUT:
+		return 1;
+	case Z80_LD:
+		return (inst->addr_mode & Z80_DIR) && mode != Z80_REG;
+	case Z80_ADD:
+	case Z80_ADC:
+	case Z80_SUB:
+	case Z80_SBC:
+	case Z80_AND:
+	case Z80_OR:
+	case Z80_XOR:
+	case Z80_CP:
+	case Z80_BIT:
+		return 0;
+	default:
+		//inc/dec, rotates, shifts, set/res and ex (sp) write back to a memory operand
+		return mode == Z80_REG_INDIRECT || mode == Z80_IMMED_INDIRECT || mode == Z80_IX_DISPLACE || mode == Z80_IY_DISPLACE;
+	}
+}
+
+static uint8_t z80_flags_read(z80inst *inst)
+{
+	if (z80_writes_memory_or_io(inst)) {
+		return 0xFF;
+	}
+	switch (inst->op)
+	{
+	case Z80_LD:
+	case Z80_POP:
+	case Z80_EXX:
+	case Z80_ADD:
+	case Z80_SUB:
+	case Z80_AND:
+	case Z80_OR:
+	case Z80_XOR:
+	case Z80_CP:
+	case Z80_INC:
+	case Z80_DEC:
+	case Z80_CPL:
+	case Z80_NEG:
+	case Z80_SCF:
+	case Z80_DI:
+	case Z80_IM:
+	case Z80_RLC:
+	case Z80_RRC:
+	case Z80_SLA:
+	case Z80_SRA:
+	case Z80_SLL:
+	case Z80_SRL:
+	case Z80_BIT:
+	case Z80_SET:
+	case Z80_RES:
+		return 0;
+	case Z80_NOP:
+		return z80_is_terminal(inst) ? 0xFF : 0;
+	case Z80_EX:
+		return inst->addr_mode == Z80_REG && inst->reg == Z80_AF ? 0xFF : 0;
+	case Z80_ADC:
+	case Z80_SBC:
+	case Z80_RL:
+	case Z80_RR:
+	case Z80_CCF:
+		return 1 << ZF_C;
+	default:
+		//branches, block instructions and anything else that might read flags
+		//or leave straight-line code ends the scan with everything still live
+		return 0xFF;
+	}
+}
+
+//Returns the flags stored by inst that the instructions following it in the
+//same memory chunk overwrite before anything can read them
+static uint8_t z80_dead_flags(z80_context *context, z80inst *inst, uint32_t address, uint8_t *encoded, uint8_t *next)
+{
+	z80_options *opts = context->options;
+	uint8_t pending = z80_flags_written(inst);
+	if (!pending || z80_writes_memory_or_io(inst)) {
+		//inc (hl) and friends could rewrite the instructions the scan relies on
+		return 0;
+	}
+	memmap_chunk const *chunk = find_map_chunk(address, &opts->gen, 0, NULL);
+	if (!chunk) {
+		return 0;
+	}
+	//stay inside the chunk and don't wrap around to another alias of it
+	uint32_t avail = chunk->end - address;
+	uint32_t alias_avail = chunk->mask + 1 - ((address - chunk->start) & chunk->mask);
+	if (alias_avail < avail) {
+		avail = alias_avail;
+	}
+	if (avail > Z80_FLAG_WINDOW) {
+		avail = Z80_FLAG_WINDOW;
+	}
+	uint8_t dead = 0;
+	uint32_t offset = next - encoded;
+	while (pending && offset + Z80_MAX_INST_SIZE <= avail)
+	{
+		uint32_t follow_address = address + offset;
+		if (context->breakpoint_flags[follow_address / 8] & (1 << (follow_address % 8))) {
+			//keep flags accurate for the debugger
+			break;
+		}
+		z80inst follow;
+		uint8_t *after = z80_decode(encoded + offset, &follow);
+		if (after - encoded > avail) {
+			break;
+		}
+		pending &= ~z80_flags_read(&follow);
+		uint8_t written = z80_flags_written(&follow) & pending;
+		dead |= written;
+		pending &= ~written;
+		offset = after - encoded;
+	}
+	return dead;
+}
+
+#define IDLE_FLAG(flag) (1 << (16 + (flag)))
+#define IDLE_ALL_FLAGS (((1 << ZF_NUM) - 1) << 16)
+
+static uint8_t z80_idle_reg(uint8_t reg)
+{
+	return reg < Z80_I || reg == Z80_A;
+}
+
+//Works out the registers and flags inst reads and writes, flags in the upper half.
+//written is a subset of what the instruction stores and may_write a superset.
+//Returns 0 for anything that writes memory, does I/O or changes control flow
+static uint8_t z80_idle_inst(z80inst *inst, uint32_t *read, uint32_t *written, uint32_t *may_write)
+{
+	uint32_t ea;
+	switch (inst->addr_mode & 0x1F)
+	{
+	case Z80_REG:
+		if (!z80_idle_reg(inst->ea_reg)) {
+			return 0;
+		}
+		ea = 1 << inst->ea_reg;
+		break;
+	case Z80_REG_INDIRECT:
+		if (inst->ea_reg != Z80_BC && inst->ea_reg != Z80_DE && inst->ea_reg != Z80_HL) {
+			return 0;
+		}
+		ea = 1 << z80_high_reg(inst->ea_reg) | 1 << z80_low_reg(inst->ea_reg);
+		break;
+	case Z80_IX_DISPLACE:
+		ea = 1 << Z80_IXH | 1 << Z80_IXL;
+		break;
+	case Z80_IY_DISPLACE:
+		ea = 1 << Z80_IYH | 1 << Z80_IYL;
+		break;
+	default:
+		ea = 0;
+		break;
+	}
+	if (inst->addr_mode & Z80_DIR) {
+		return 0;
+	}
+	uint32_t flags = z80_flags_written(inst) << 16;
+	switch (inst->op)
+	{
+	case Z80_LD:
+		if (!z80_idle_reg(inst->reg)) {
+			return 0;
+		}
+		*read = ea;
+		*written = *may_write = 1 << inst->reg;
+		return 1;
+	case Z80_ADD:
+	case Z80_ADC:
+	case Z80_SUB:
+	case Z80_SBC:
+	case Z80_AND:
+	case Z80_OR:
+	case Z80_XOR:
+	case Z80_CP:
+		if (inst->reg != Z80_A) {
+			return 0;
+		}
+		*read = ea | 1 << Z80_A | (inst->op == Z80_ADC || inst->op == Z80_SBC ? IDLE_FLAG(ZF_C) : 0);
+		*written = (inst->op == Z80_CP ? 0 : 1 << Z80_A) | flags;
+		*may_write = *written | IDLE_ALL_FLAGS;
+		return 1;
+	case Z80_INC:
+	case Z80_DEC:
+	case Z80_RLC:
+	case Z80_RL:
+	case Z80_RRC:
+	case Z80_RR:
+	case Z80_SLA:
+	case Z80_SRA:
+	case Z80_SLL:
+	case Z80_SRL:
+		if ((inst->addr_mode & 0x1F) != Z80_UNUSED || !z80_idle_reg(inst->reg)) {
+			return 0;
+		}
+		*read = 1 << inst->reg | (inst->op == Z80_RL || inst->op == Z80_RR ? IDLE_FLAG(ZF_C) : 0);
+		*written = 1 << inst->reg | flags;
+		*may_write = *written | IDLE_ALL_FLAGS;
+		return 1;
+	case Z80_BIT:
+		*read = ea;
+		*written = IDLE_FLAG(ZF_Z) | IDLE_FLAG(ZF_PV) | IDLE_FLAG(ZF_N) | IDLE_FLAG(ZF_H) | IDLE_FLAG(ZF_S);
+		*may_write = IDLE_ALL_FLAGS;
+		return 1;
+	case Z80_NOP:
+		*read = *written = *may_write = 0;
+		return !z80_is_terminal(inst);
+	default:
+		return 0;
+	}
+}
+
+//Lowers *limit to the cycle until which the memory read done by inst keeps
+//returning the same value, or sets it to 0 if the read might have side effects
+static void z80_idle_read_limit(z80_context *context, z80inst *inst, uint32_t *limit)
+{
+	uint16_t address;
+	uint8_t high;
+	switch (inst->addr_mode & 0x1F)
+	{
+	case Z80_REG_INDIRECT:
+		address = context->regs[z80_high_reg(inst->ea_reg)] << 8 | context->regs[z80_low_reg(inst->ea_reg)];
+		break;
+	case Z80_IMMED_INDIRECT:
+		address = inst->immed;
+		break;
+	case Z80_IX_DISPLACE:
+	case Z80_IY_DISPLACE:
+		high = (inst->addr_mode & 0x1F) == Z80_IX_DISPLACE ? Z80_IXH : Z80_IYH;
+		address = (context->regs[high] << 8 | context->regs[z80_low_reg(high)]) + (int8_t)inst->ea_reg;
+		break;
+	default:
+		return;
+	}
+	memmap_chunk const *chunk = find_map_chunk(address, &context->options->gen, 0, NULL);
+	if (chunk && (chunk->flags & MMAP_READ) && !(chunk->flags & MMAP_ARBITRATED)) {
+		if (!(chunk->flags & MMAP_PTR_IDX && chunk->flags & MMAP_FUNC_NULL) || context->mem_pointers[chunk->ptr_index]) {
+			return;
+		}
+	}
+	uint32_t handler_limit = chunk && chunk->read_8 && context->idle_read_limit ? context->idle_read_limit(context, address) : 0;
+	if (handler_limit < *limit) {
+		*limit = handler_limit;
+	}
+}
+
+//Checks that the straight-line code from head up to the branch at end only
+//reads registers and memory and leaves the same state behind on every pass.
+//If limit is not NULL, the memory reads are resolved with the current register
+//values and *limit is lowered to the cycle until which they are stable
+static uint8_t z80_is_idle_loop(z80_context *context, uint32_t head, uint32_t end, z80inst *branch, uint32_t *limit)
+{
+	z80_options *opts = context->options;
+	if (head > end || end - head > Z80_IDLE_LOOP_BYTES) {
+		return 0;
+	}
+	uint8_t *encoded = get_native_pointer(head, (void **)context->mem_pointers, &opts->gen);
+	if (!encoded || get_native_pointer(end, (void **)context->mem_pointers, &opts->gen) != encoded + (end - head)) {
+		return 0;
+	}
+	uint32_t written = 0, may_write = 0, carried = 0;
+	uint32_t offset = 0;
+	for (;;)
+	{
+		uint32_t address = head + offset;
+		if (context->breakpoint_flags[address / 8] & (1 << (address % 8))) {
+			return 0;
+		}
+		if (address == end) {
+			break;
+		}
+		z80inst inst;
+		uint32_t inst_read, inst_written, inst_may_write;
+		uint8_t *after = z80_decode(encoded + offset, &inst);
+		offset = after - encoded;
+		if (head + offset > end || !z80_idle_inst(&inst, &inst_read, &inst_written, &inst_may_write)) {
+			return 0;
+		}
+		if (limit) {
+			z80_idle_read_limit(context, &inst, limit);
+		}
+		carried |= inst_read & ~written;
+		written |= inst_written;
+		may_write |= inst_may_write;
+	}
+	if (branch->op == Z80_JRCC || branch->op == Z80_JPCC) {
+		static const uint8_t cond_flags[] = {ZF_Z, ZF_Z, ZF_C, ZF_C, ZF_PV, ZF_PV, ZF_S, ZF_S};
+		carried |= IDLE_FLAG(cond_flags[branch->reg]) & ~written;
+	}
+	//anything read before it's written in the same pass must not change
+	return !(carried & may_write);
+}
+
+//Returns the destination of a direct jump at address, or IDLE_NONE for anything else
+static uint32_t z80_jump_dest(z80inst *inst, uint32_t address)
+{
+	switch (inst->op)
+	{
+	case Z80_JR:
+	case Z80_JRCC:
+		return (address + inst->immed + 2) & 0xFFFF;
+	case Z80_JP:
+	case Z80_JPCC:
+		return inst->addr_mode == Z80_REG_INDIRECT ? IDLE_NONE : inst->immed;
+	default:
+		return IDLE_NONE;
+	}
+}
+
+//Returns whether inst at address closes a loop that z80_is_idle_loop accepts
+static uint8_t z80_idle_back_edge(z80_context *context, z80inst *inst, uint32_t address)
+{
+	uint32_t head = z80_jump_dest(inst, address);
+	return head != IDLE_NONE && z80_is_idle_loop(context, head, address, inst, NULL);
+}
+
+//Called from the taken back edge of a loop accepted by z80_idle_back_edge with
+//the head address in the low half of loop and the branch address in the upper
+//half. The first pass records the cycle count and R, later passes measure how
+//long an iteration takes and skip as many whole iterations as fit before the
+//next interrupt, sync or change in a value the loop polls
+static void z80_idle_loop(z80_context *context, uint32_t loop)
+{
+	uint32_t head = loop & 0xFFFF, end = loop >> 16;
+	uint8_t r = context->regs[Z80_R] & 0x7F;
+	if (context->idle_head != head) {
+		context->idle_head = head;
+		context->idle_cycle = context->current_cycle;
+		context->idle_r = r;
+		return;
+	}
+	uint32_t period = context->current_cycle - context->idle_cycle;
+	uint8_t r_inc = r - context->idle_r;
+	context->idle_cycle = context->current_cycle;
+	context->idle_r = r;
+	//the loop was validated at translation time, but it may have been overwritten since
+	z80inst branch;
+	uint8_t *encoded = get_native_pointer(end, (void **)context->mem_pointers, &context->options->gen);
+	if (!encoded) {
+		return;
+	}
+	z80_decode(encoded, &branch);
+	uint32_t limit = context->target_cycle;
+	if (z80_jump_dest(&branch, end) != head || !z80_is_idle_loop(context, head, end, &branch, &limit)) {
+		return;
+	}
+	if (!limit) {
+		//one of the reads has side effects, stop calling in until the loop is left
+		context->idle_head = head | IDLE_REJECTED;
+		return;
+	}
+	if (limit <= context->current_cycle || !period) {
+		return;
+	}
+	uint32_t skip = (limit - context->current_cycle - 1) / period;
+	context->current_cycle += skip * period;
+	context->idle_cycle = context->current_cycle;
+	r += skip * r_inc;
+	context->idle_r = r & 0x7F;
+	context->regs[Z80_R] = (context->regs[Z80_R] & 0x80) | (r & 0x7F);
+}
+
 void translate_z80_stream(z80_context * context, uint32_t address)
 {
 	char disbuf[80];
@@ -3174,11 +3839,20 @@ void translate_z80_stream(z80_context * context, uint32_t address)
 			}
 			#endif
 			code_ptr start = opts->gen.code.cur;
+			opts->dead_flags = z80_dead_flags(context, &inst, address, encoded, next);
+			opts->idle_back_edge = z80_idle_back_edge(context, &inst, address);
+			//every instruction is a possible branch target so each gets its own counter
+			code_profile_block_start(&opts->gen, address);
 			translate_z80inst(&inst, context, address, 0);
+			opts->dead_flags = 0;
+			opts->idle_back_edge = 0;
 			z80_map_native_address(context, address, start, next-encoded, opts->gen.code.cur - start);
+			code_profile_block_size(&opts->gen, opts->gen.code.cur - start);
 			address += next-encoded;
 				address &= 0xFFFF;
 		} while (!z80_is_terminal(&inst));
+		code_profile_stream_end(&opts->gen);
+		code_cache_track(&opts->gen);
 		process_deferred(&opts->gen.deferred, context, (native_addr_func)z80_get_native_address);
 		if (opts->gen.deferred) {
 			address = opts->gen.deferred->address;
@@ -3197,9 +3871,12 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	options->gen.address_mask = 0xFFFF;
 	options->gen.max_address = 0x10000;
 	options->gen.bus_cycles = 3;
+	//reads from the Genesis bank window wait for the 68K to release its bus
+	options->gen.arb_cycles = 3;
 	options->gen.clock_divider = clock_divider;
 	options->gen.mem_ptr_off = offsetof(z80_context, mem_pointers);
 	options->gen.ram_flags_off = offsetof(z80_context, ram_code_flags);
+	options->gen.arb_count_off = offsetof(z80_context, bank_reads);
 	options->gen.ram_flags_shift = 7;
 
 	options->flags = 0;
@@ -3245,8 +3922,7 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	options->gen.cycles = RBP;
 	options->gen.limit = -1;
 
-	options->gen.native_code_map = malloc(sizeof(native_map_slot) * NATIVE_MAP_CHUNKS);
-	memset(options->gen.native_code_map, 0, sizeof(native_map_slot) * NATIVE_MAP_CHUNKS);
+	init_native_map(&options->gen.native_code_map, NATIVE_MAP_CHUNKS, NATIVE_CHUNK_SIZE);
 	options->gen.deferred = NULL;
 	uint32_t inst_size_size = sizeof(uint8_t *) * ram_size(&options->gen) / 1024;
 	options->gen.ram_inst_sizes = malloc(inst_size_size);
@@ -3331,6 +4007,14 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	call(code, options->gen.load_context);
 	retn(code);
 
+	options->idle_loop = code->cur;
+	call(code, options->gen.save_context);
+	push_r(code, options->gen.context_reg);
+	call_args(code, (code_ptr)z80_idle_loop, 2, options->gen.context_reg, options->gen.scratch1);
+	pop_r(code, options->gen.context_reg);
+	call(code, options->gen.load_context);
+	retn(code);
+
 	uint32_t tmp_stack_off;
 
 	options->gen.handle_cycle_limit = code->cur;
@@ -3463,6 +4147,8 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	mov_irdisp(code, CYCLE_NEVER, options->gen.context_reg, offsetof(z80_context, nmi_start), SZ_D);
 	mov_ir(code, 0x66, options->gen.scratch1, SZ_W);
 	*after_int_dest = code->cur - (after_int_dest + 1);
+	//save PC so native_pc can be recalculated if the code cache gets flushed
+	mov_rrdisp(code, options->gen.scratch1, options->gen.context_reg, offsetof(z80_context, pc), SZ_W);
 	call(code, options->native_addr);
 	mov_rrind(code, options->gen.scratch1, options->gen.context_reg, SZ_PTR);
 	tmp_stack_off = code->stack_off;
@@ -3540,10 +4226,6 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	tmp_stack_off = code->stack_off;
 	//calculate size of patch
 	mov_ir(code, 0x7FFF, options->gen.scratch1, SZ_D);
-	code->stack_off += sizeof(void *);
-	if (code->stack_off & 0xF) {
-		sub_ir(code, 16 - (code->stack_off & 0xF), RSP, SZ_PTR);
-	}
 	call_noalign(code, options->retrans_stub);
 	uint32_t patch_size = code->cur - options->retrans_stub;
 	code->cur = options->retrans_stub;
@@ -3551,7 +4233,6 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	
 	//pop return address
 	pop_r(code, options->gen.scratch2);
-	add_ir(code, 16-sizeof(void*), RSP, SZ_PTR);
 	code->stack_off = tmp_stack_off;
 	call(code, options->gen.save_context);
 	//adjust pointer before move and call instructions that got us here
@@ -3562,6 +4243,10 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	mov_rr(code, RAX, options->gen.scratch1, SZ_PTR);
 	call(code, options->gen.load_context);
 	jmp_r(code, options->gen.scratch1);
+	//bytes z80_patch_for_retrans overwrites, switched out banks keep a copy of them
+	check_alloc_code(code, 32);
+	options->retrans_patch_size = z80_patch_for_retrans(options, code->cur, 0) - code->cur;
+	options->gen.check_patch_size = options->retrans_patch_size;
 
 	options->run = (z80_ctx_fun)code->cur;
 	tmp_stack_off = code->stack_off;
@@ -3581,6 +4266,7 @@ void init_z80_opts(z80_options * options, memmap_chunk const * chunks, uint32_t
 	*no_extra = code->cur - (no_extra + 1);
 	jmp_rind(code, options->gen.context_reg);
 	code->stack_off = tmp_stack_off;
+	init_code_cache(&options->gen, DEFAULT_CODE_CACHE_SIZE);
 }
 
 z80_context *init_z80_context(z80_options * options)
@@ -3592,6 +4278,7 @@ z80_context *init_z80_context(z80_options * options)
 	context->int_pulse_start = CYCLE_NEVER;
 	context->int_pulse_end = CYCLE_NEVER;
 	context->nmi_start = CYCLE_NEVER;
+	context->idle_head = IDLE_NONE;
 	
 	return context;
 }
@@ -3613,6 +4300,9 @@ void z80_run(z80_context * context, uint32_t target_cycle)
 			//busreq is sampled at the end of an m-cycle
 			//we can approximate that by running for a single m-cycle after a bus request
 			context->sync_cycle = context->busreq ? context->current_cycle + 3*context->options->gen.clock_divider : target_cycle;
+			if (context->num_pending_writes) {
+				z80_apply_code_writes(context);
+			}
 			if (!context->native_pc) {
 				context->native_pc = z80_get_native_address_trans(context, context->pc);
 			}
@@ -3628,8 +4318,16 @@ void z80_run(z80_context * context, uint32_t target_cycle)
 					context->int_cycle = CYCLE_NEVER;
 				}
 				check_nmi(context);
+				//native_pc can only be recalculated from pc between instructions and the breakpoint
+				//stub lives in the same buffer as translated code, so flushes wait for those cases
+				if (context->options->gen.code_cache.flush_pending && !context->extra_pc && !context->bp_handler) {
+					z80_flush_code_cache(context);
+					context->native_pc = z80_get_native_address_trans(context, context->pc);
+				}
 				
 				context->target_cycle = context->sync_cycle < context->int_cycle ? context->sync_cycle : context->int_cycle;
+				//time can pass without the Z80 executing anything between runs so measurements start over
+				context->idle_head = IDLE_NONE;
 				dprintf("Running Z80 from cycle %d to cycle %d. Int cycle: %d (%d - %d)\n", context->current_cycle, context->sync_cycle, context->int_cycle, context->int_pulse_start, context->int_pulse_end);
 				context->options->run(context);
 				dprintf("Z80 ran to cycle %d\n", context->current_cycle);
@@ -3644,7 +4342,14 @@ void z80_run(z80_context * context, uint32_t target_cycle)
 
 void z80_options_free(z80_options *opts)
 {
-	free(opts->gen.native_code_map);
+	free_native_map(&opts->gen.native_code_map);
+	for (uint32_t i = 0; i < opts->num_code_banks; i++)
+	{
+		z80_free_code_bank(opts->code_banks + i);
+	}
+	free(opts->code_banks);
+	free(opts->gen.code_cache.chunks.list);
+	code_profile_free(&opts->gen);
 	free(opts->gen.ram_inst_sizes);
 	free(opts);
 }
@@ -3821,12 +4526,7 @@ void zremove_breakpoint(z80_context * context, uint16_t address)
 	context->breakpoint_flags[address / 8] &= ~(1 << (address % 8));
 	uint8_t * native = z80_get_native_address(context, address);
 	if (native) {
-		z80_options * opts = context->options;
-		code_info tmp_code = opts->gen.code;
-		opts->gen.code.cur = native;
-		opts->gen.code.last = native + 128;
-		check_cycles_int(&opts->gen, address);
-		opts->gen.code = tmp_code;
+		z80_clear_breakpoint_patch(context->options, native, address);
 	}
 }
 
@@ -10,6 +10,7 @@
 #include "serialize.h"
 
 #define ZNUM_MEM_AREAS 4
+#define Z80_PENDING_WRITE_RANGES 8
 #ifdef Z80_LOG_ADDRESS
 #define ZMAX_NATIVE_SIZE 255
 #else
@@ -29,6 +30,26 @@ enum {
 
 typedef struct z80_context z80_context;
 typedef void (*z80_ctx_fun)(z80_context * context);
+typedef uint32_t (*z80_read_limit_fun)(z80_context * context, uint32_t address);
+
+typedef struct {
+	code_ptr native;
+	uint16_t address;
+	uint8_t  size;
+	uint8_t  native_size;
+	uint8_t  breakpoint;
+} z80_bank_inst;
+
+//translations for code in a bank that has been switched out, kept so that they
+//can be put back in place if the same bank is switched back into the same range
+typedef struct {
+	uint8_t       *base;
+	z80_bank_inst *insts;
+	uint8_t       *saved;
+	uint32_t      start;
+	uint32_t      end;
+	uint32_t      num_insts;
+} z80_code_bank;
 
 typedef struct {
 	cpu_options     gen;
@@ -46,8 +67,15 @@ typedef struct {
 	code_ptr        write_16_lowfirst;
 	code_ptr		read_io;
 	code_ptr		write_io;
+	code_ptr        idle_loop;
 
+	z80_code_bank   *code_banks;
+	uint32_t        num_code_banks;
+	uint32_t        code_bank_storage;
 	uint32_t        flags;
+	uint8_t         retrans_patch_size;
+	uint8_t         dead_flags;
+	uint8_t         idle_back_edge;
 	int8_t          regs[Z80_UNUSED];
 	z80_ctx_fun     run;
 } z80_options;
@@ -64,6 +92,7 @@ struct z80_context {
 	uint32_t          current_cycle;
 	uint8_t           alt_flags[ZF_NUM];
 	uint8_t *         mem_pointers[ZNUM_MEM_AREAS];
+	uint32_t          bank_reads; //direct reads from the banked window since the system last collected them
 	uint8_t           iff1;
 	uint8_t           iff2;
 	uint16_t          scratch1;
@@ -83,10 +112,19 @@ struct z80_context {
 	uint8_t *         bp_stub;
 	uint8_t *         interp_code[256];
 	z80_ctx_fun       next_int_pulse;
+	//returns the cycle until which reads from a handler address have no side effects
+	//and keep returning the value of the last read, or 0 if that can't be guaranteed
+	z80_read_limit_fun idle_read_limit;
+	uint32_t          idle_head;
+	uint32_t          idle_cycle;
+	uint8_t           idle_r;
 	uint8_t           reset;
 	uint8_t           busreq;
 	uint8_t           busack;
 	uint8_t           int_is_nmi;
+	uint8_t           num_pending_writes;
+	uint16_t          pending_write_start[Z80_PENDING_WRITE_RANGES];
+	uint32_t          pending_write_end[Z80_PENDING_WRITE_RANGES];
 	uint8_t           ram_code_flags[];
 };
 
@@ -97,7 +135,10 @@ z80_context * init_z80_context(z80_options * options);
 code_ptr z80_get_native_address(z80_context * context, uint32_t address);
 code_ptr z80_get_native_address_trans(z80_context * context, uint32_t address);
 z80_context * z80_handle_code_write(uint32_t address, z80_context * context);
+void z80_defer_code_write(z80_context *context, uint32_t address);
 void z80_invalidate_code_range(z80_context *context, uint32_t start, uint32_t end);
+void z80_switch_code_bank(z80_context *context, uint32_t start, uint32_t end, uint8_t *old_base, uint8_t *new_base);
+void z80_flush_code_cache(z80_context *context);
 void z80_reset(z80_context * context);
 void zinsert_breakpoint(z80_context * context, uint16_t address, uint8_t * bp_handler);
 void zremove_breakpoint(z80_context * context, uint16_t address);